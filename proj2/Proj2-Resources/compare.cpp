@@ -0,0 +1,223 @@
+#include "compare.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+const int ROWS_PER_TASK = 16;
+// Pixels per 32-bit SSE accumulator: each lane adds four squares of at
+// most 255 * 255 per step, so 4096 pixels stay far below 2^32
+const int SSE_CHUNK = 4096;
+
+const int SSIM_BLOCK = 4;  // block sums are gathered over 4x4 pixels
+const double SSIM_C1 = (0.01 * 255) * (0.01 * 255);
+const double SSIM_C2 = (0.03 * 255) * (0.03 * 255);
+
+// Squared differences and largest difference of each RGBA lane
+struct DiffSums {
+  uint64_t sse[4] = {0, 0, 0, 0};
+  int max[4] = {0, 0, 0, 0};
+};
+
+void AccumulateRow(const Pixel *a, const Pixel *b, int n, DiffSums &sums) {
+  int x = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  __m128i max = zero;
+  while (n - x >= 4) {
+    __m128i acc = zero;
+    int end = std::min(n, x + SSE_CHUNK);
+    for (; x + 4 <= end; x += 4) {
+      __m128i va = _mm_loadu_si128((const __m128i *)(a + x));
+      __m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+      __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+      max = _mm_max_epu8(max, d);
+      // Square in 16 bits (255 * 255 fits unsigned) and widen to one
+      // 32-bit lane per channel
+      __m128i lo = _mm_unpacklo_epi8(d, zero);
+      __m128i hi = _mm_unpackhi_epi8(d, zero);
+      lo = _mm_mullo_epi16(lo, lo);
+      hi = _mm_mullo_epi16(hi, hi);
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(lo, zero));
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(lo, zero));
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(hi, zero));
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(hi, zero));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    for (int c = 0; c < 4; c++)
+      sums.sse[c] += lanes[c];
+  }
+  uint8_t maxes[16];
+  _mm_storeu_si128((__m128i *)maxes, max);
+  for (int i = 0; i < 16; i++)
+    sums.max[i % 4] = std::max(sums.max[i % 4], (int)maxes[i]);
+#endif
+  for (; x < n; x++) {
+    const uint8_t *pa = &a[x].r, *pb = &b[x].r;
+    for (int c = 0; c < 4; c++) {
+      int d = std::abs(pa[c] - pb[c]);
+      sums.sse[c] += d * d;
+      sums.max[c] = std::max(sums.max[c], d);
+    }
+  }
+}
+
+// Sums over one block, per RGB channel
+struct BlockSums {
+  int s1[3], s2[3], ss[3], s12[3];
+};
+
+void SumBlocks(const ImageView &a, const ImageView &b, int by, int bw,
+               BlockSums *out) {
+  for (int bx = 0; bx < bw; bx++) {
+    BlockSums &s = out[bx];
+    for (int c = 0; c < 3; c++)
+      s.s1[c] = s.s2[c] = s.ss[c] = s.s12[c] = 0;
+    for (int y = by * SSIM_BLOCK; y < (by + 1) * SSIM_BLOCK; y++) {
+      const Pixel *pa = a.Row(y) + bx * SSIM_BLOCK;
+      const Pixel *pb = b.Row(y) + bx * SSIM_BLOCK;
+      for (int x = 0; x < SSIM_BLOCK; x++) {
+        const uint8_t *ca = &pa[x].r, *cb = &pb[x].r;
+        for (int c = 0; c < 3; c++) {
+          int va = ca[c], vb = cb[c];
+          s.s1[c] += va;
+          s.s2[c] += vb;
+          s.ss[c] += va * va + vb * vb;
+          s.s12[c] += va * vb;
+        }
+      }
+    }
+  }
+}
+
+// SSIM of one window of n pixels from its sums
+double Ssim(double s1, double s2, double ss, double s12, double n) {
+  double mu1 = s1 / n, mu2 = s2 / n;
+  double vars = ss / n - mu1 * mu1 - mu2 * mu2; // both variances
+  double covar = s12 / n - mu1 * mu2;
+  return (2 * mu1 * mu2 + SSIM_C1) * (2 * covar + SSIM_C2) /
+         ((mu1 * mu1 + mu2 * mu2 + SSIM_C1) * (vars + SSIM_C2));
+}
+
+// Mean SSIM over the RGB channels of images too small for 8x8 windows,
+// taking the whole image as one window
+double SsimWhole(const ImageView &a, const ImageView &b) {
+  double total = 0;
+  for (int c = 0; c < 3; c++) {
+    double s1 = 0, s2 = 0, ss = 0, s12 = 0;
+    for (int y = 0; y < a.height; y++) {
+      for (int x = 0; x < a.width; x++) {
+        int va = (&a.At(x, y).r)[c], vb = (&b.At(x, y).r)[c];
+        s1 += va, s2 += vb, ss += va * va + vb * vb, s12 += va * vb;
+      }
+    }
+    total += Ssim(s1, s2, ss, s12, (double)a.width * a.height);
+  }
+  return total / 3;
+}
+
+// Mean SSIM over the RGB channels. Every 8x8 window is the sum of 2x2
+// neighbouring 4x4 blocks, so each task keeps two rows of block sums and
+// slides down its band of window rows.
+double SsimWindows(const ImageView &a, const ImageView &b) {
+  int bw = a.width / SSIM_BLOCK, bh = a.height / SSIM_BLOCK;
+  if (bw < 2 || bh < 2)
+    return SsimWhole(a, b);
+
+  // Per window row, so the total does not depend on the thread count
+  std::vector<double> row_sums(bh - 1);
+  ParallelFor(0, bh - 1, [&](int begin, int end) {
+    std::vector<BlockSums> top(bw), bottom(bw);
+    SumBlocks(a, b, begin, bw, top.data());
+    for (int wy = begin; wy < end; wy++) {
+      SumBlocks(a, b, wy + 1, bw, bottom.data());
+      double sum = 0;
+      for (int wx = 0; wx + 1 < bw; wx++) {
+        const BlockSums *q[4] = {&top[wx], &top[wx + 1], &bottom[wx],
+                                 &bottom[wx + 1]};
+        for (int c = 0; c < 3; c++) {
+          int s1 = 0, s2 = 0, ss = 0, s12 = 0;
+          for (int k = 0; k < 4; k++) {
+            s1 += q[k]->s1[c];
+            s2 += q[k]->s2[c];
+            ss += q[k]->ss[c];
+            s12 += q[k]->s12[c];
+          }
+          sum += Ssim(s1, s2, ss, s12, 4 * SSIM_BLOCK * SSIM_BLOCK);
+        }
+      }
+      row_sums[wy] = sum;
+      std::swap(top, bottom);
+    }
+  }, ROWS_PER_TASK / SSIM_BLOCK);
+
+  double total = 0;
+  for (double s : row_sums)
+    total += s;
+  return total / (3.0 * (bw - 1) * (bh - 1));
+}
+
+} // namespace
+
+ImageDiff CompareImages(const ImageView &a, const ImageView &b) {
+  assert(a.width == b.width && a.height == b.height);
+  DiffSums sums;
+  std::mutex merge;
+  ParallelFor(0, a.height, [&](int begin, int end) {
+    DiffSums local;
+    for (int y = begin; y < end; y++)
+      AccumulateRow(a.Row(y), b.Row(y), a.width, local);
+    std::lock_guard<std::mutex> lock(merge);
+    for (int c = 0; c < 4; c++) {
+      sums.sse[c] += local.sse[c];
+      sums.max[c] = std::max(sums.max[c], local.max[c]);
+    }
+  }, ROWS_PER_TASK);
+
+  ImageDiff diff;
+  double pixels = (double)a.width * a.height;
+  uint64_t sse = 0;
+  for (int c = 0; c < 3; c++) {
+    diff.mse[c] = sums.sse[c] / pixels;
+    diff.max_diff[c] = sums.max[c];
+    sse += sums.sse[c];
+  }
+  diff.mse_total = sse / (3 * pixels);
+  diff.psnr = sse ? 10 * std::log10(255.0 * 255.0 / diff.mse_total) : INFINITY;
+  diff.ssim = SsimWindows(a, b);
+  return diff;
+}
+
+void DiffHeatmap(const ImageView &a, const ImageView &b, const ImageView &out) {
+  assert(a.width == b.width && a.height == b.height);
+  assert(out.width == a.width && out.height == a.height);
+
+  // Color of each difference, on a log scale through the "hot" colormap
+  Pixel colors[256];
+  for (int d = 0; d < 256; d++) {
+    double t = d ? 0.25 + 0.75 * std::log(d) / std::log(255.0) : 0;
+    colors[d].SetClamp(3 * t * 255, (3 * t - 1) * 255, (3 * t - 2) * 255);
+  }
+
+  ParallelFor(0, a.height, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      const Pixel *pa = a.Row(y), *pb = b.Row(y);
+      Pixel *po = out.Row(y);
+      for (int x = 0; x < a.width; x++) {
+        int d = std::max({std::abs(pa[x].r - pb[x].r),
+                          std::abs(pa[x].g - pb[x].g),
+                          std::abs(pa[x].b - pb[x].b)});
+        po[x] = colors[d];
+      }
+    }
+  }, ROWS_PER_TASK);
+}
@@ -0,0 +1,32 @@
+// compare.h
+//
+// Image comparison for regression checks. It reports the mean squared
+// error, PSNR, SSIM and the largest per-channel difference between two
+// images of the same size, and can draw a heatmap of where they differ.
+// The difference pass runs on 16 bytes at a time with SSE2. Both passes
+// run in parallel row bands.
+
+#ifndef COMPARE_INCLUDED
+#define COMPARE_INCLUDED
+
+#include "image.h"
+
+struct ImageDiff {
+  double mse[3];     // per channel (r, g, b)
+  double mse_total;  // over all three channels
+  double psnr;       // in dB, infinite for identical images
+  double ssim;       // mean of the channels, 1 for identical images
+  int max_diff[3];   // largest absolute difference per channel
+};
+
+// Compares the RGB channels of two views of the same size. SSIM uses 8x8
+// windows placed every 4 pixels, as in x264 and ffmpeg.
+ImageDiff CompareImages(const ImageView &a, const ImageView &b);
+
+// Colors each pixel of out, which has the size of a and b, by its largest
+// channel difference. Equal pixels are black and differences run from
+// dark red through yellow to white on a log scale, so that off-by-one
+// rounding still shows.
+void DiffHeatmap(const ImageView &a, const ImageView &b, const ImageView &out);
+
+#endif
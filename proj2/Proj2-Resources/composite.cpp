@@ -0,0 +1,218 @@
+#include "composite.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cassert>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// Tiles are a few rows of 256 pixels, so the span buffers stay in L1
+const int FLATTEN_TILE_W = 256;
+const int FLATTEN_TILE_H = 16;
+
+const char *const MODE_NAMES[BLEND_N_MODES] = {
+    "normal", "multiply", "screen", "darken", "lighten", "add"};
+
+// x * y / 255, rounded
+inline int Mul255(int x, int y) {
+  int t = x * y + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+// One premultiplied channel (or the alpha itself) of source s with alpha
+// sa over destination d with alpha da. Every mode reduces to the union of
+// the coverage on the alpha channel.
+template <BlendMode M> inline int BlendChannel(int s, int d, int sa, int da) {
+  switch (M) {
+  case BLEND_NORMAL:
+    return s + Mul255(d, 255 - sa);
+  case BLEND_MULTIPLY:
+    return Mul255(s, 255 - da) + Mul255(d, 255 - sa) + Mul255(s, d);
+  case BLEND_SCREEN:
+    return s + d - Mul255(s, d);
+  case BLEND_DARKEN:
+    return s + d - std::max(Mul255(s, da), Mul255(d, sa));
+  case BLEND_LIGHTEN:
+    return s + d - std::min(Mul255(s, da), Mul255(d, sa));
+  default: // BLEND_ADD
+    return s + d;
+  }
+}
+
+#ifdef __SSE2__
+// The same arithmetic on 16-bit lanes, two RGBA pixels per register
+inline __m128i Mul255(__m128i x, __m128i y) {
+  __m128i t = _mm_add_epi16(_mm_mullo_epi16(x, y), _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+inline __m128i BroadcastAlpha(__m128i x) {
+  return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xff), 0xff);
+}
+
+template <BlendMode M> inline __m128i BlendPixels(__m128i s, __m128i d) {
+  const __m128i full = _mm_set1_epi16(255);
+  __m128i sa = BroadcastAlpha(s), da = BroadcastAlpha(d);
+  switch (M) {
+  case BLEND_NORMAL:
+    return _mm_add_epi16(s, Mul255(d, _mm_sub_epi16(full, sa)));
+  case BLEND_MULTIPLY:
+    return _mm_add_epi16(
+        _mm_add_epi16(Mul255(s, _mm_sub_epi16(full, da)),
+                      Mul255(d, _mm_sub_epi16(full, sa))),
+        Mul255(s, d));
+  case BLEND_SCREEN:
+    return _mm_sub_epi16(_mm_add_epi16(s, d), Mul255(s, d));
+  case BLEND_DARKEN:
+    return _mm_sub_epi16(_mm_add_epi16(s, d),
+                         _mm_max_epi16(Mul255(s, da), Mul255(d, sa)));
+  case BLEND_LIGHTEN:
+    return _mm_sub_epi16(_mm_add_epi16(s, d),
+                         _mm_min_epi16(Mul255(s, da), Mul255(d, sa)));
+  default: // BLEND_ADD
+    return _mm_add_epi16(s, d);
+  }
+}
+#endif
+
+template <BlendMode M>
+void CompositeSpanMode(Pixel *dst, const Pixel *src, int n, int opacity) {
+  int x = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i vopacity = _mm_set1_epi16(opacity);
+  for (; x + 4 <= n; x += 4) {
+    __m128i vs = _mm_loadu_si128((const __m128i *)(src + x));
+    // A transparent source leaves the destination alone in every mode
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(vs, zero)) == 0xffff)
+      continue;
+    __m128i vd = _mm_loadu_si128((const __m128i *)(dst + x));
+    __m128i slo = _mm_unpacklo_epi8(vs, zero), shi = _mm_unpackhi_epi8(vs, zero);
+    if (opacity != 255) {
+      slo = Mul255(slo, vopacity);
+      shi = Mul255(shi, vopacity);
+    }
+    __m128i lo = BlendPixels<M>(slo, _mm_unpacklo_epi8(vd, zero));
+    __m128i hi = BlendPixels<M>(shi, _mm_unpackhi_epi8(vd, zero));
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(lo, hi));
+  }
+#endif
+  for (; x < n; x++) {
+    int s[4] = {src[x].r, src[x].g, src[x].b, src[x].a};
+    if (opacity != 255)
+      for (int c = 0; c < 4; c++)
+        s[c] = Mul255(s[c], opacity);
+    uint8_t *d = &dst[x].r;
+    int da = d[3];
+    for (int c = 0; c < 4; c++)
+      d[c] = std::min(255, BlendChannel<M>(s[c], d[c], s[3], da));
+  }
+}
+
+// 65536 * 255 / a, rounded, so that c * 255 / a is about
+// (c * reciprocal + 32768) >> 16
+struct Reciprocals {
+  uint32_t of[256];
+  Reciprocals() {
+    of[0] = 0;
+    for (int a = 1; a < 256; a++)
+      of[a] = (255u * 65536 + a / 2) / a;
+  }
+};
+
+} // namespace
+
+bool ParseBlendMode(const char *name, BlendMode &mode) {
+  for (int m = 0; m < BLEND_N_MODES; m++) {
+    if (!strcmp(name, MODE_NAMES[m])) {
+      mode = (BlendMode)m;
+      return true;
+    }
+  }
+  return false;
+}
+
+void PremultiplySpan(const Pixel *src, Pixel *dst, int n) {
+  int x = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  // Multiplying the alpha lanes by 255 keeps them as they are
+  const __m128i alpha_lanes = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+  for (; x + 4 <= n; x += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + x));
+    __m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+    lo = Mul255(lo, _mm_max_epi16(BroadcastAlpha(lo), alpha_lanes));
+    hi = Mul255(hi, _mm_max_epi16(BroadcastAlpha(hi), alpha_lanes));
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(lo, hi));
+  }
+#endif
+  for (; x < n; x++) {
+    int a = src[x].a;
+    dst[x].Set(Mul255(src[x].r, a), Mul255(src[x].g, a), Mul255(src[x].b, a),
+               a);
+  }
+}
+
+void UnpremultiplySpan(const Pixel *src, Pixel *dst, int n) {
+  static const Reciprocals reciprocal;
+  for (int x = 0; x < n; x++) {
+    int a = src[x].a;
+    if (a == 255) {
+      dst[x] = src[x];
+      continue;
+    }
+    uint32_t r = reciprocal.of[a];
+    dst[x].Set(std::min(255u, (src[x].r * r + 32768) >> 16),
+               std::min(255u, (src[x].g * r + 32768) >> 16),
+               std::min(255u, (src[x].b * r + 32768) >> 16), a);
+  }
+}
+
+void CompositeSpan(Pixel *dst, const Pixel *src, int n, BlendMode mode,
+                   int opacity) {
+  assert(opacity >= 0 && opacity <= 255);
+  switch (mode) {
+  case BLEND_NORMAL:
+    CompositeSpanMode<BLEND_NORMAL>(dst, src, n, opacity);
+    break;
+  case BLEND_MULTIPLY:
+    CompositeSpanMode<BLEND_MULTIPLY>(dst, src, n, opacity);
+    break;
+  case BLEND_SCREEN:
+    CompositeSpanMode<BLEND_SCREEN>(dst, src, n, opacity);
+    break;
+  case BLEND_DARKEN:
+    CompositeSpanMode<BLEND_DARKEN>(dst, src, n, opacity);
+    break;
+  case BLEND_LIGHTEN:
+    CompositeSpanMode<BLEND_LIGHTEN>(dst, src, n, opacity);
+    break;
+  default:
+    CompositeSpanMode<BLEND_ADD>(dst, src, n, opacity);
+  }
+}
+
+void FlattenLayers(const std::vector<Layer> &layers, const ImageView &out) {
+  for (const Layer &l : layers)
+    assert(l.view.width == out.width && l.view.height == out.height);
+  TuneScope tune("flatten");
+  ParallelForTiles(out.width, out.height, tune.TileW(FLATTEN_TILE_W),
+                   tune.TileH(FLATTEN_TILE_H),
+                   [&](int x0, int y0, int x1, int y1) {
+    int n = x1 - x0;
+    std::vector<Pixel> acc(n), span(n);
+    for (int y = y0; y < y1; y++) {
+      std::fill(acc.begin(), acc.end(), Pixel(0, 0, 0, 0));
+      for (const Layer &l : layers) {
+        PremultiplySpan(l.view.Row(y) + x0, span.data(), n);
+        CompositeSpan(acc.data(), span.data(), n, l.mode, l.opacity);
+      }
+      UnpremultiplySpan(acc.data(), out.Row(y) + x0, n);
+    }
+  });
+}
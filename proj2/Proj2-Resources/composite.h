@@ -0,0 +1,52 @@
+// composite.h
+//
+// Alpha compositing. Layers are kept as straight (non-premultiplied) RGBA
+// like every other image, and converted to premultiplied RGBA8 a span at a
+// time for the blend kernels, which process four pixels per step with
+// SSE2. Blend modes follow the separable modes of the W3C compositing
+// spec, always combined with Porter-Duff "over", so the alpha channel is
+// the union of the layers' coverage.
+
+#ifndef COMPOSITE_INCLUDED
+#define COMPOSITE_INCLUDED
+
+#include "image.h"
+#include <vector>
+
+enum BlendMode {
+  BLEND_NORMAL,   // source over destination
+  BLEND_MULTIPLY, // darkens: s * d
+  BLEND_SCREEN,   // lightens: s + d - s * d
+  BLEND_DARKEN,   // min(s, d)
+  BLEND_LIGHTEN,  // max(s, d)
+  BLEND_ADD,      // s + d, clamped; also adds coverage
+  BLEND_N_MODES
+};
+
+// Looks up a mode by its lowercase name ("normal", "multiply", ...).
+// Returns false for unknown names.
+bool ParseBlendMode(const char *name, BlendMode &mode);
+
+// Converts n straight-alpha pixels to premultiplied alpha and back. src and
+// dst may be the same span.
+void PremultiplySpan(const Pixel *src, Pixel *dst, int n);
+void UnpremultiplySpan(const Pixel *src, Pixel *dst, int n);
+
+// Composites n premultiplied pixels of src onto dst in place, with src's
+// alpha further scaled by opacity (0..255).
+void CompositeSpan(Pixel *dst, const Pixel *src, int n, BlendMode mode,
+                   int opacity = 255);
+
+struct Layer {
+  ImageView view;
+  BlendMode mode;
+  int opacity; // 0..255
+};
+
+// Composites the layers, bottom first, onto a transparent background and
+// stores the result in out, which has the layers' size and may be one of
+// them. Each tile goes through the whole stack while it is in cache,
+// instead of one full-image pass per layer.
+void FlattenLayers(const std::vector<Layer> &layers, const ImageView &out);
+
+#endif
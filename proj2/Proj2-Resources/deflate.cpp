@@ -0,0 +1,563 @@
+#include "deflate.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+namespace {
+
+// Input bytes per parallel chunk
+const size_t CHUNK_SIZE = 1 << 18;
+// Symbols per Huffman block; new blocks let the codes follow the data
+const size_t BLOCK_SYMBOLS = 1 << 15;
+
+const int WINDOW_SIZE = 32768;
+const int MIN_MATCH = 3, MAX_MATCH = 258;
+// Length 3 matches this far back cost more than the literals they replace
+const int TOO_FAR = 4096;
+const int HASH_BITS = 15;
+
+const int NUM_LITLEN = 286, NUM_DIST = 30, NUM_CODELEN = 19;
+const int END_OF_BLOCK = 256;
+
+// Search effort per level, after zlib's configuration table
+struct LevelParams {
+  int good_length; // search a quarter of the chain beyond a match this long
+  int max_lazy;    // try the next position for matches shorter than this
+  int nice_length; // stop searching at a match this long
+  int max_chain;   // candidates examined per position
+};
+
+const LevelParams LEVELS[10] = {
+    {0, 0, 0, 0},        {4, 0, 8, 4},         {4, 0, 16, 8},
+    {4, 0, 32, 32},      {4, 4, 16, 16},       {8, 16, 32, 32},
+    {8, 16, 128, 128},   {8, 32, 128, 256},    {32, 128, 258, 1024},
+    {32, 258, 258, 4096},
+};
+
+/**
+ * Code tables (RFC 1951, 3.2.5)
+ **/
+const int LENGTH_BASE[29] = {3,  4,  5,  6,  7,  8,  9,  10,  11,  13,
+                             15, 17, 19, 23, 27, 31, 35, 43,  51,  59,
+                             67, 83, 99, 115, 131, 163, 195, 227, 258};
+const int LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                              2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const int DIST_BASE[30] = {1,    2,    3,    4,    5,    7,     9,     13,
+                           17,   25,   33,   49,   65,   97,    129,   193,
+                           257,  385,  513,  769,  1025, 1537,  2049,  3073,
+                           4097, 6145, 8193, 12289, 16385, 24577};
+const int DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                            6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+const int CODELEN_ORDER[NUM_CODELEN] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                        11, 4,  12, 3, 13, 2, 14, 1, 15};
+
+struct CodeTables {
+  uint8_t length_code[MAX_MATCH + 1]; // by match length
+  uint8_t dist_code_near[256];        // by distance - 1 below 256
+  uint8_t dist_code_far[256];         // by (distance - 1) >> 7 above
+
+  CodeTables() {
+    for (int c = 0; c < 29; c++)
+      for (int l = LENGTH_BASE[c]; l < LENGTH_BASE[c] + (1 << LENGTH_EXTRA[c]);
+           l++)
+        if (l <= MAX_MATCH)
+          length_code[l] = c;
+    for (int c = 0; c < NUM_DIST; c++) {
+      for (int d = DIST_BASE[c]; d < DIST_BASE[c] + (1 << DIST_EXTRA[c]); d++) {
+        if (d - 1 < 256)
+          dist_code_near[d - 1] = c;
+        else
+          dist_code_far[(d - 1) >> 7] = c;
+      }
+    }
+  }
+
+  int DistCode(int dist) const {
+    return dist <= 256 ? dist_code_near[dist - 1]
+                       : dist_code_far[(dist - 1) >> 7];
+  }
+};
+
+const CodeTables &Tables() {
+  static const CodeTables tables;
+  return tables;
+}
+
+/**
+ * Bit output
+ **/
+struct BitWriter {
+  std::vector<uint8_t> out;
+  uint64_t buffer = 0;
+  int count = 0;
+
+  // Appends the low n bits of bits, least significant first
+  void Put(uint32_t bits, int n) {
+    buffer |= (uint64_t)bits << count;
+    count += n;
+    while (count >= 8) {
+      out.push_back(buffer & 0xff);
+      buffer >>= 8;
+      count -= 8;
+    }
+  }
+
+  void Align() {
+    if (count > 0)
+      out.push_back(buffer & 0xff);
+    buffer = 0;
+    count = 0;
+  }
+};
+
+/**
+ * Huffman codes
+ **/
+// Computes code lengths of at most limit bits for the given frequencies.
+// Frequencies are halved until the optimal tree fits the limit.
+void BuildLengths(const uint32_t *freq, int n, int limit, uint8_t *lengths) {
+  std::vector<uint32_t> f(freq, freq + n);
+  for (;;) {
+    std::vector<std::pair<uint32_t, int>> leaves;
+    for (int i = 0; i < n; i++)
+      if (f[i] > 0)
+        leaves.push_back({f[i], i});
+    std::sort(leaves.begin(), leaves.end());
+
+    // Two-queue Huffman construction: leaves in order, then internal nodes
+    // in the order they are made, which is also nondecreasing in weight
+    int m = leaves.size();
+    std::vector<uint64_t> weight(2 * m - 1);
+    std::vector<int> parent(2 * m - 1, -1);
+    for (int i = 0; i < m; i++)
+      weight[i] = leaves[i].first;
+    int next_leaf = 0, next_node = m;
+    auto take = [&](int made) {
+      if (next_leaf < m &&
+          (next_node >= made || weight[next_leaf] <= weight[next_node]))
+        return next_leaf++;
+      return next_node++;
+    };
+    for (int made = m; made < 2 * m - 1; made++) {
+      int a = take(made), b = take(made);
+      weight[made] = weight[a] + weight[b];
+      parent[a] = parent[b] = made;
+    }
+
+    std::vector<int> depth(2 * m - 1, 0);
+    int max_depth = 0;
+    for (int i = 2 * m - 3; i >= 0; i--) {
+      depth[i] = depth[parent[i]] + 1;
+      max_depth = std::max(max_depth, depth[i]);
+    }
+    if (max_depth <= limit) {
+      std::fill(lengths, lengths + n, 0);
+      for (int i = 0; i < m; i++)
+        lengths[leaves[i].second] = depth[i];
+      return;
+    }
+    for (uint32_t &x : f)
+      if (x > 0)
+        x = (x + 1) / 2;
+  }
+}
+
+// Canonical codes for the lengths, bit-reversed for LSB-first output
+void BuildCodes(const uint8_t *lengths, int n, uint16_t *codes) {
+  int count[16] = {0}, next[16] = {0};
+  for (int i = 0; i < n; i++)
+    count[lengths[i]]++;
+  count[0] = 0;
+  for (int bits = 1, code = 0; bits < 16; bits++) {
+    code = (code + count[bits - 1]) << 1;
+    next[bits] = code;
+  }
+  for (int i = 0; i < n; i++) {
+    int len = lengths[i];
+    if (len == 0)
+      continue;
+    int code = next[len]++, reversed = 0;
+    for (int b = 0; b < len; b++)
+      reversed |= ((code >> b) & 1) << (len - 1 - b);
+    codes[i] = reversed;
+  }
+}
+
+// A decoder needs a complete code, so every alphabet gets two symbols
+void EnsureTwoSymbols(uint32_t *freq, int n) {
+  int used = 0;
+  for (int i = 0; i < n; i++)
+    used += freq[i] > 0;
+  for (int i = 0; i < n && used < 2; i++) {
+    if (freq[i] == 0) {
+      freq[i] = 1;
+      used++;
+    }
+  }
+}
+
+/**
+ * Blocks
+ **/
+// A literal when dist is 0, else a match
+struct Symbol {
+  uint16_t value; // literal byte or match length
+  uint16_t dist;
+};
+
+void PutStored(BitWriter &bw, const uint8_t *raw, size_t size, bool final) {
+  do {
+    size_t n = std::min<size_t>(size, 65535);
+    size -= n;
+    bw.Put(final && size == 0, 1);
+    bw.Put(0, 2);
+    bw.Align();
+    bw.Put(n & 0xffff, 16);
+    bw.Put(~n & 0xffff, 16);
+    bw.out.insert(bw.out.end(), raw, raw + n);
+    raw += n;
+  } while (size > 0);
+}
+
+// Emits the symbols as one dynamic Huffman block, or as stored blocks if
+// that is smaller
+void PutBlock(BitWriter &bw, const Symbol *syms, size_t n, const uint8_t *raw,
+              size_t raw_size, bool final) {
+  const CodeTables &t = Tables();
+  uint32_t lit_freq[NUM_LITLEN] = {0}, dist_freq[NUM_DIST] = {0};
+  for (size_t i = 0; i < n; i++) {
+    if (syms[i].dist == 0) {
+      lit_freq[syms[i].value]++;
+    } else {
+      lit_freq[257 + t.length_code[syms[i].value]]++;
+      dist_freq[t.DistCode(syms[i].dist)]++;
+    }
+  }
+  lit_freq[END_OF_BLOCK] = 1;
+  EnsureTwoSymbols(lit_freq, NUM_LITLEN);
+  EnsureTwoSymbols(dist_freq, NUM_DIST);
+
+  uint8_t lit_len[NUM_LITLEN], dist_len[NUM_DIST];
+  BuildLengths(lit_freq, NUM_LITLEN, 15, lit_len);
+  BuildLengths(dist_freq, NUM_DIST, 15, dist_len);
+
+  int hlit = NUM_LITLEN, hdist = NUM_DIST;
+  while (hlit > 257 && lit_len[hlit - 1] == 0)
+    hlit--;
+  while (hdist > 1 && dist_len[hdist - 1] == 0)
+    hdist--;
+
+  // Run-length code the two length tables as one sequence (3.2.7)
+  std::vector<uint8_t> all(lit_len, lit_len + hlit);
+  all.insert(all.end(), dist_len, dist_len + hdist);
+  std::vector<std::pair<uint8_t, uint8_t>> rle; // code length symbol, extra
+  for (size_t i = 0; i < all.size();) {
+    uint8_t len = all[i];
+    size_t run = 1;
+    while (i + run < all.size() && all[i + run] == len)
+      run++;
+    i += run;
+    if (len == 0) {
+      for (; run >= 11; run -= std::min<size_t>(run, 138))
+        rle.push_back({18, std::min<size_t>(run, 138) - 11});
+      if (run >= 3) {
+        rle.push_back({17, run - 3});
+        run = 0;
+      }
+    } else {
+      rle.push_back({len, 0});
+      run--;
+      for (; run >= 3; run -= std::min<size_t>(run, 6))
+        rle.push_back({16, std::min<size_t>(run, 6) - 3});
+    }
+    for (; run > 0; run--)
+      rle.push_back({len, 0});
+  }
+
+  uint32_t cl_freq[NUM_CODELEN] = {0};
+  for (auto &r : rle)
+    cl_freq[r.first]++;
+  EnsureTwoSymbols(cl_freq, NUM_CODELEN);
+  uint8_t cl_len[NUM_CODELEN];
+  BuildLengths(cl_freq, NUM_CODELEN, 7, cl_len);
+  int hclen = NUM_CODELEN;
+  while (hclen > 4 && cl_len[CODELEN_ORDER[hclen - 1]] == 0)
+    hclen--;
+
+  // Compare against storing the bytes
+  const int rle_extra[3] = {2, 3, 7};
+  uint64_t bits = 3 + 14 + 3 * hclen;
+  for (auto &r : rle)
+    bits += cl_len[r.first] + (r.first >= 16 ? rle_extra[r.first - 16] : 0);
+  for (int s = 0; s < NUM_LITLEN; s++)
+    if (lit_len[s])
+      bits += (uint64_t)lit_freq[s] *
+              (lit_len[s] + (s > 256 ? LENGTH_EXTRA[s - 257] : 0));
+  for (int s = 0; s < NUM_DIST; s++)
+    if (dist_len[s])
+      bits += (uint64_t)dist_freq[s] * (dist_len[s] + DIST_EXTRA[s]);
+  uint64_t stored_bits = (raw_size + 5 * (raw_size / 65535 + 1)) * 8;
+  if (stored_bits <= bits) {
+    PutStored(bw, raw, raw_size, final);
+    return;
+  }
+
+  uint16_t lit_code[NUM_LITLEN], dist_code[NUM_DIST], cl_code[NUM_CODELEN];
+  BuildCodes(lit_len, NUM_LITLEN, lit_code);
+  BuildCodes(dist_len, NUM_DIST, dist_code);
+  BuildCodes(cl_len, NUM_CODELEN, cl_code);
+
+  bw.Put(final, 1);
+  bw.Put(2, 2); // dynamic Huffman codes
+  bw.Put(hlit - 257, 5);
+  bw.Put(hdist - 1, 5);
+  bw.Put(hclen - 4, 4);
+  for (int i = 0; i < hclen; i++)
+    bw.Put(cl_len[CODELEN_ORDER[i]], 3);
+  for (auto &r : rle) {
+    bw.Put(cl_code[r.first], cl_len[r.first]);
+    if (r.first >= 16)
+      bw.Put(r.second, rle_extra[r.first - 16]);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    const Symbol &s = syms[i];
+    if (s.dist == 0) {
+      bw.Put(lit_code[s.value], lit_len[s.value]);
+      continue;
+    }
+    int lc = t.length_code[s.value];
+    bw.Put(lit_code[257 + lc], lit_len[257 + lc]);
+    bw.Put(s.value - LENGTH_BASE[lc], LENGTH_EXTRA[lc]);
+    int dc = t.DistCode(s.dist);
+    bw.Put(dist_code[dc], dist_len[dc]);
+    bw.Put(s.dist - DIST_BASE[dc], DIST_EXTRA[dc]);
+  }
+  bw.Put(lit_code[END_OF_BLOCK], lit_len[END_OF_BLOCK]);
+}
+
+/**
+ * Matching
+ **/
+inline uint32_t Hash3(const uint8_t *p) {
+  return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Length of the common prefix of a and b, up to max
+inline int MatchLength(const uint8_t *a, const uint8_t *b, int max) {
+  int n = 0;
+  while (n + 8 <= max) {
+    uint64_t x, y;
+    memcpy(&x, a + n, 8);
+    memcpy(&y, b + n, 8);
+    if (x != y)
+      return n + (__builtin_ctzll(x ^ y) >> 3);
+    n += 8;
+  }
+  while (n < max && a[n] == b[n])
+    n++;
+  return n;
+}
+
+// Hash chains over [base, end): the chunk plus the window before it
+class Matcher {
+public:
+  Matcher(const uint8_t *data, size_t base, size_t end, const LevelParams &p)
+      : data(data), base(base), end(end), params(p), head(1 << HASH_BITS, -1),
+        prev(end - base) {}
+
+  void Insert(size_t pos) {
+    if (pos + MIN_MATCH > end)
+      return;
+    uint32_t h = Hash3(data + pos);
+    prev[pos - base] = head[h];
+    head[h] = pos - base;
+  }
+
+  // Longest earlier match for pos, which must not be inserted yet, that
+  // beats prev_len. Returns its length, or 0 if there is none worth taking.
+  int Find(size_t pos, int prev_len, int &dist) const {
+    int max_len = std::min<size_t>(MAX_MATCH, end - pos);
+    // Nothing can beat prev_len, and probing data[pos + best] below would
+    // read past end
+    if (max_len < MIN_MATCH || prev_len >= max_len)
+      return 0;
+    int best = std::max(prev_len, MIN_MATCH - 1);
+    int chain = params.max_chain;
+    if (prev_len >= params.good_length)
+      chain >>= 2;
+    for (int32_t c = head[Hash3(data + pos)]; c >= 0 && chain-- > 0;
+         c = prev[c]) {
+      size_t cand = base + c;
+      if (pos - cand > WINDOW_SIZE)
+        break;
+      if (data[cand + best] != data[pos + best])
+        continue;
+      int len = MatchLength(data + cand, data + pos, max_len);
+      if (len > best) {
+        best = len;
+        dist = pos - cand;
+        if (len >= params.nice_length || len == max_len)
+          break;
+      }
+    }
+    if (best <= prev_len || best < MIN_MATCH ||
+        (best == MIN_MATCH && dist > TOO_FAR))
+      return 0;
+    return best;
+  }
+
+private:
+  const uint8_t *data;
+  size_t base, end;
+  const LevelParams &params;
+  std::vector<int32_t> head, prev;
+};
+
+// Deflates data[start, end) into whole bytes. A chunk that is not the last
+// ends with an empty stored block instead of a final block.
+std::vector<uint8_t> DeflateChunk(const uint8_t *data, size_t start,
+                                  size_t end, bool last, int level) {
+  BitWriter bw;
+  if (level == 0) {
+    PutStored(bw, data + start, end - start, last);
+    return std::move(bw.out);
+  }
+
+  const LevelParams &params = LEVELS[level];
+  size_t base = start > (size_t)WINDOW_SIZE ? start - WINDOW_SIZE : 0;
+  Matcher matcher(data, base, end, params);
+  for (size_t q = base; q < start; q++)
+    matcher.Insert(q);
+
+  std::vector<Symbol> syms;
+  syms.reserve(std::min<size_t>(end - start, BLOCK_SYMBOLS));
+  size_t block_start = start;
+  auto flush = [&](size_t block_end, bool final) {
+    PutBlock(bw, syms.data(), syms.size(), data + block_start,
+             block_end - block_start, final);
+    syms.clear();
+    block_start = block_end;
+  };
+
+  size_t pos = start;
+  while (pos < end) {
+    int dist = 0;
+    int len = matcher.Find(pos, 0, dist);
+    matcher.Insert(pos);
+
+    // Lazy matching: a longer match one byte later wins over this one
+    while (len > 0 && len < params.max_lazy && pos + 1 < end) {
+      int next_dist = 0;
+      int next_len = matcher.Find(pos + 1, len, next_dist);
+      if (next_len == 0)
+        break;
+      syms.push_back({data[pos], 0});
+      pos++;
+      matcher.Insert(pos);
+      len = next_len;
+      dist = next_dist;
+    }
+
+    if (len > 0) {
+      syms.push_back({(uint16_t)len, (uint16_t)dist});
+      for (size_t q = pos + 1; q < pos + len; q++)
+        matcher.Insert(q);
+      pos += len;
+    } else {
+      syms.push_back({data[pos], 0});
+      pos++;
+    }
+    if (syms.size() >= BLOCK_SYMBOLS)
+      flush(pos, last && pos == end);
+  }
+  // An empty input still needs its final block
+  if (!syms.empty() || start == end)
+    flush(end, last);
+
+  if (!last) {
+    // Empty stored block, realigning the output like zlib's Z_SYNC_FLUSH
+    PutStored(bw, NULL, 0, false);
+  }
+  bw.Align();
+  return std::move(bw.out);
+}
+
+} // namespace
+
+/**
+ * Checksums
+ **/
+uint32_t Adler32(uint32_t adler, const uint8_t *data, size_t size) {
+  const uint32_t MOD = 65521;
+  // Largest n such that 255n(n+1)/2 + (n+1)(MOD-1) fits in 32 bits
+  const size_t NMAX = 5552;
+  uint32_t a = adler & 0xffff, b = adler >> 16;
+  while (size > 0) {
+    size_t n = std::min(size, NMAX);
+    size -= n;
+    for (size_t i = 0; i < n; i++) {
+      a += data[i];
+      b += a;
+    }
+    data += n;
+    a %= MOD;
+    b %= MOD;
+  }
+  return b << 16 | a;
+}
+
+uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, size_t size2) {
+  const uint32_t MOD = 65521;
+  uint32_t rem = size2 % MOD;
+  uint32_t a = (adler1 & 0xffff) + (adler2 & 0xffff) + MOD - 1;
+  uint64_t b = (uint64_t)rem * (adler1 & 0xffff) % MOD + (adler1 >> 16) +
+               (adler2 >> 16) + MOD - rem;
+  a %= MOD;
+  b %= MOD;
+  return (uint32_t)b << 16 | a;
+}
+
+/**
+ * Compression
+ **/
+std::vector<uint8_t> ZlibCompress(const uint8_t *data, size_t size,
+                                  int level) {
+  level = std::min(std::max(level, 0), 9);
+  int num_chunks = std::max<size_t>(1, (size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+
+  std::vector<std::vector<uint8_t>> chunks(num_chunks);
+  std::vector<uint32_t> adlers(num_chunks);
+  ParallelFor(0, num_chunks, [&](int b, int e) {
+    for (int i = b; i < e; i++) {
+      size_t start = i * CHUNK_SIZE, end = std::min(size, start + CHUNK_SIZE);
+      chunks[i] = DeflateChunk(data, start, end, i == num_chunks - 1, level);
+      adlers[i] = Adler32(1, data + start, end - start);
+    }
+  });
+
+  uint32_t adler = adlers[0];
+  for (int i = 1; i < num_chunks; i++)
+    adler = Adler32Combine(adler, adlers[i],
+                           std::min(size, (i + 1) * CHUNK_SIZE) -
+                               i * CHUNK_SIZE);
+
+  // CMF: deflate with a 32 KB window. FLG: the level hint, then check bits.
+  int level_hint = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+  uint8_t cmf = 0x78, flg = level_hint << 6;
+  flg += (31 - (cmf * 256 + flg) % 31) % 31;
+
+  size_t total = 6;
+  for (auto &c : chunks)
+    total += c.size();
+  std::vector<uint8_t> out;
+  out.reserve(total);
+  out.push_back(cmf);
+  out.push_back(flg);
+  for (auto &c : chunks)
+    out.insert(out.end(), c.begin(), c.end());
+  for (int shift = 24; shift >= 0; shift -= 8)
+    out.push_back(adler >> shift);
+  return out;
+}
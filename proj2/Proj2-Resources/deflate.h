@@ -0,0 +1,29 @@
+// deflate.h
+//
+// A zlib (RFC 1950/1951) compressor that splits its input into chunks and
+// deflates them on the worker pool, pigz-style. Each chunk is primed with
+// the 32 KB before it, so matches still reach across chunk boundaries, and
+// ends on a byte boundary with an empty stored block, so the chunks join
+// into one valid stream.
+
+#ifndef DEFLATE_INCLUDED
+#define DEFLATE_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Level 0 stores the data uncompressed; 1 is fastest and 9 compresses best,
+// as in zlib
+const int DEFLATE_DEFAULT_LEVEL = 6;
+
+// Compresses data into a complete zlib stream
+std::vector<uint8_t> ZlibCompress(const uint8_t *data, size_t size, int level);
+
+uint32_t Adler32(uint32_t adler, const uint8_t *data, size_t size);
+
+// The Adler-32 of two buffers back to back, given their checksums and the
+// length of the second
+uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, size_t size2);
+
+#endif
@@ -0,0 +1,166 @@
+#include "fft.h"
+#include <assert.h>
+#include <math.h>
+
+int NextFastSize(int n) {
+  for (int m = n < 1 ? 1 : n;; m++) {
+    int r = m;
+    for (int p : {2, 3, 5})
+      while (r % p == 0)
+        r /= p;
+    if (r == 1)
+      return m;
+  }
+}
+
+double TransformCost(int n) {
+  // Per-point cost of one pass of each radix; a radix-4 pass does the work
+  // of two radix-2 passes for little more than the price of one
+  const int radix[] = {4, 2, 3, 5};
+  const double pass_cost[] = {1.25, 1.0, 2.5, 4.5};
+  double cost = 0;
+  int r = n;
+  for (int i = 0; i < 4; i++) {
+    while (r % radix[i] == 0) {
+      cost += pass_cost[i];
+      r /= radix[i];
+    }
+  }
+  return n * cost;
+}
+
+/**
+ * Complex FFT
+ **/
+FFTPlan::FFTPlan(int n_) : n(n_) {
+  assert(n > 0);
+  // Radix 4 first, it needs the fewest multiplies per point
+  int r = n;
+  for (int p : {4, 2, 3, 5}) {
+    while (r % p == 0) {
+      factors.push_back(p);
+      r /= p;
+    }
+  }
+  assert(r == 1);
+
+  twiddle.resize(n);
+  for (int j = 0; j < n; j++)
+    twiddle[j] = std::polar(1.0, -2 * M_PI * j / n);
+}
+
+void FFTPlan::Transform(Complex *data, bool inverse) const {
+  if (n == 1)
+    return;
+  thread_local std::vector<Complex> scratch;
+  scratch.assign(data, data + n);
+  Recurse(scratch.data(), data, n, 1, 0, inverse);
+}
+
+// Decimation in time: transforms the p interleaved sub-sequences of "in"
+// into consecutive blocks of "out", then combines them with p-point DFTs.
+void FFTPlan::Recurse(const Complex *in, Complex *out, int len, int stride,
+                      size_t factor, bool inverse) const {
+  if (len == 1) {
+    out[0] = in[0];
+    return;
+  }
+
+  int p = factors[factor];
+  int m = len / p;
+  for (int q = 0; q < p; q++)
+    Recurse(in + q * stride, out + q * m, m, stride * p, factor + 1, inverse);
+
+  int step = n / len;
+  auto w = [&](int j) {
+    return inverse ? std::conj(twiddle[j]) : twiddle[j];
+  };
+
+  if (p == 2) {
+    for (int k = 0; k < m; k++) {
+      Complex a = out[k];
+      Complex b = out[k + m] * w(k * step);
+      out[k] = a + b;
+      out[k + m] = a - b;
+    }
+    return;
+  }
+
+  if (p == 4) {
+    // -i for the forward transform, +i for the inverse
+    Complex rot = inverse ? Complex(0, 1) : Complex(0, -1);
+    for (int k = 0; k < m; k++) {
+      Complex a0 = out[k];
+      Complex a1 = out[k + m] * w(k * step);
+      Complex a2 = out[k + 2 * m] * w(2 * k * step);
+      Complex a3 = out[k + 3 * m] * w(3 * k * step);
+      Complex s02 = a0 + a2, d02 = a0 - a2;
+      Complex s13 = a1 + a3, d13 = (a1 - a3) * rot;
+      out[k] = s02 + s13;
+      out[k + m] = d02 + d13;
+      out[k + 2 * m] = s02 - s13;
+      out[k + 3 * m] = d02 - d13;
+    }
+    return;
+  }
+
+  // Generic small prime: direct p-point DFT
+  Complex tmp[5];
+  for (int k = 0; k < m; k++) {
+    for (int q = 0; q < p; q++)
+      tmp[q] = out[k + q * m] * w(q * k * step);
+    for (int s = 0; s < p; s++) {
+      Complex sum = 0;
+      for (int q = 0; q < p; q++)
+        sum += tmp[q] * w((q * s % p) * m * step);
+      out[k + s * m] = sum;
+    }
+  }
+}
+
+/**
+ * Real FFT
+ **/
+RealFFTPlan::RealFFTPlan(int n_) : n(n_), half(n_ / 2) {
+  assert(n % 2 == 0);
+  twiddle.resize(n / 2 + 1);
+  for (int k = 0; k <= n / 2; k++)
+    twiddle[k] = std::polar(1.0, -2 * M_PI * k / n);
+}
+
+// Packs even samples into the real part and odd ones into the imaginary
+// part, then separates the two half-length spectra.
+void RealFFTPlan::Forward(const double *in, Complex *out) const {
+  int h = n / 2;
+  thread_local std::vector<Complex> z;
+  z.resize(h);
+  for (int k = 0; k < h; k++)
+    z[k] = Complex(in[2 * k], in[2 * k + 1]);
+  half.Forward(z.data());
+
+  for (int k = 0; k <= h; k++) {
+    Complex zk = z[k % h];
+    Complex zc = std::conj(z[(h - k) % h]);
+    Complex even = 0.5 * (zk + zc);
+    Complex odd = Complex(0, -0.5) * (zk - zc);
+    out[k] = even + twiddle[k] * odd;
+  }
+}
+
+void RealFFTPlan::Inverse(const Complex *in, double *out) const {
+  int h = n / 2;
+  thread_local std::vector<Complex> z;
+  z.resize(h);
+  for (int k = 0; k < h; k++) {
+    Complex xc = std::conj(in[h - k]);
+    Complex even = in[k] + xc;
+    Complex odd = (in[k] - xc) * std::conj(twiddle[k]);
+    z[k] = even + Complex(0, 1) * odd;
+  }
+  half.Inverse(z.data());
+
+  for (int k = 0; k < h; k++) {
+    out[2 * k] = z[k].real();
+    out[2 * k + 1] = z[k].imag();
+  }
+}
@@ -0,0 +1,65 @@
+// fft.h
+//
+// Self-contained mixed-radix (2, 3, 4, 5) FFT, plus a real-input transform
+// built on a half-length complex one. Used by the FFT convolution path for
+// large kernels.
+
+#ifndef FFT_INCLUDED
+#define FFT_INCLUDED
+
+#include <complex>
+#include <vector>
+
+typedef std::complex<double> Complex;
+
+// Smallest size >= n whose only prime factors are 2, 3 and 5
+int NextFastSize(int n);
+
+// Estimated work of one n-point transform, in radix-2 butterfly passes
+// over n points. Used to compare transform sizes.
+double TransformCost(int n);
+
+// Complex FFT of a fixed size. Plans are immutable after construction, so
+// one plan can be shared by many threads.
+class FFTPlan {
+public:
+  // n must only have 2, 3 and 5 as prime factors
+  explicit FFTPlan(int n);
+
+  int Size() const { return n; }
+
+  // In-place transforms. The inverse is unnormalized: Inverse(Forward(x))
+  // returns n * x.
+  void Forward(Complex *data) const { Transform(data, false); }
+  void Inverse(Complex *data) const { Transform(data, true); }
+
+private:
+  void Transform(Complex *data, bool inverse) const;
+  void Recurse(const Complex *in, Complex *out, int len, int stride,
+               size_t factor, bool inverse) const;
+
+  int n;
+  std::vector<int> factors;
+  std::vector<Complex> twiddle; // exp(-2 pi i j / n)
+};
+
+// FFT of n real values (n even) producing the n / 2 + 1 non-redundant
+// coefficients, computed with one complex FFT of size n / 2.
+class RealFFTPlan {
+public:
+  explicit RealFFTPlan(int n);
+
+  int Size() const { return n; }
+
+  void Forward(const double *in, Complex *out) const;
+
+  // Unnormalized like FFTPlan: Inverse(Forward(x)) returns n * x
+  void Inverse(const Complex *in, double *out) const;
+
+private:
+  int n;
+  FFTPlan half;
+  std::vector<Complex> twiddle; // exp(-2 pi i k / n) for k <= n / 2
+};
+
+#endif
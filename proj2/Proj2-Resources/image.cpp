@@ -4,20 +4,60 @@
 // cropping, and suppressing channels
 
 #include "image.h"
+#include "fft.h"
+#include "image_cache.h"
+#include "luma.h"
+#include "palette.h"
+#include "parallel.h"
+#include "png_writer.h"
+#include "qim.h"
+#include "trace.h"
+#include "transpose.h"
 #include "pixel.h"
 #include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <climits>
+#include <cstdarg>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <float.h>
+#include <functional>
+#include <map>
+#include <memory>
 #include <math.h>
+#include <mutex>
 #include <random>
+#include <stdexcept>
 #include <stdlib.h>
 #include <string.h>
+#include <utility>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <fstream>
 using namespace std;
 
+// File errors are thrown rather than exiting, so a long-running server can
+// fail one request and keep going. The CLI prints them and exits.
+[[noreturn]] static void FileError(const char *fmt, ...) {
+  char msg[1024];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, args);
+  va_end(args);
+  throw std::runtime_error(msg);
+}
+
 int map_to_midbucket(int value, int levels) {
   return ((2 * value + 1) * 255 + levels) / (2 * levels);
 }
@@ -25,58 +65,184 @@ int map_to_midbucket(int value, int levels) {
 // a maximum value of 255 (ie., an 8-bit PPM) ...
 // TODO - HW2: ... you need to adjust the function to support PPM files with a
 // max value of 1, 3, 7, 15, 31, 63, 127, and 255 (why these numbers?)
-uint8_t *read_ppm(char *imgName, int &width, int &height) {
-  // Open the texture image file
-  ifstream ppmFile;
-  ppmFile.open(imgName);
-  if (!ppmFile) {
-    printf("ERROR: Image file '%s' not found.\n", imgName);
-    exit(1);
+//
+// The file is memory mapped and its body parsed in parallel: it is split
+// into chunks at whitespace, every chunk counts its tokens, and a prefix
+// sum of those counts tells each chunk which pixel its first value belongs
+// to. Binary (P6) bodies have fixed-size values and are decoded by rows.
+static inline bool IsSpace(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' ||
+         c == '\f';
+}
+
+// Reads the next header integer at pos, skipping whitespace and comments
+static bool ReadHeaderInt(const char *text, size_t size, size_t &pos,
+                          int &value) {
+  while (pos < size && (IsSpace(text[pos]) || text[pos] == '#')) {
+    if (text[pos] == '#') {
+      while (pos < size && text[pos] != '\n')
+        pos++;
+    } else {
+      pos++;
+    }
   }
+  std::from_chars_result res = std::from_chars(text + pos, text + size, value);
+  if (res.ec != std::errc())
+    return false;
+  pos = res.ptr - text;
+  return true;
+}
 
-  // Check that this is an ASCII PPM (first line is P3)
+uint8_t *read_ppm(char *imgName, int &width, int &height) {
+  // Map the texture image file
+  int fd = open(imgName, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    FileError("ERROR: Image file '%s' not found.", imgName);
+  }
+  size_t size = st.st_size;
+  const char *text = (const char *)(size ? mmap(NULL, size, PROT_READ,
+                                                MAP_PRIVATE, fd, 0)
+                                         : MAP_FAILED);
+  close(fd);
+  if (text == MAP_FAILED)
+    FileError("ERROR: Could not read image file '%s'", imgName);
+  madvise((void *)text, size, MADV_SEQUENTIAL);
+
+  // Check that this is an ASCII (P3) or binary (P6) PPM
+  size_t pos = 0;
+  while (pos < size && IsSpace(text[pos]))
+    pos++;
   string PPM_style;
-  ppmFile >> PPM_style; // Read the first line of the header
-  if (PPM_style != "P3") {
-    printf("ERROR: PPM Type number is %s. Not an ASCII (P3) PPM file!\n",
-           PPM_style.c_str());
-    exit(1);
+  while (pos < size && !IsSpace(text[pos]))
+    PPM_style += text[pos++];
+  if (PPM_style != "P3" && PPM_style != "P6") {
+    munmap((void *)text, size);
+    FileError("ERROR: PPM Type number is %s. Not a P3 or P6 PPM file!",
+              PPM_style.c_str());
   }
+  bool binary = PPM_style == "P6";
 
-  // Read in the texture width and height
-  ppmFile >> width >> height;
-  unsigned char *img_data = new unsigned char[4 * width * height];
-
-  // Check that the 3rd line is 255 (ie., this is an 8 bit/pixel PPM)
+  // Read in the texture width, height and maximum value
   int maximum;
-  ppmFile >> maximum;
-  int bits = log2(maximum + 1);
-  // TODO - HW2: Remove this check below, instead make the function for for
-  // maximum values besides 255
-  // if (maximum != 255) {
-  //   printf("ERROR: We assume Maximum size is 255, not (%d)\n", maximum);
-  //   printf("TODO: This error means you didn't finish your HW yet!\n");
-  //   exit(1);
-  // }
-
-  // TODO - HW2: The values read from the file might not be 8-bits (ie, a
-  // maximum values besides 255)
-  // TODO - HW2: However img_data stores all values as 8-bit integers.
-  // TODO - HW2: When you read the values into img_data scale the values up to
-  // be 8 bits
-  // TODO - HW2: For example, the value 1 in a 1 bit PPM should become 255 ...
-  // TODO - HW2: Likewise, the value 1 in a 2 bit PPM should become 127 (or
-  // 128).
-  int r, g, b;
-  for (int i = 0; i < height; i++) {
-    for (int j = 0; j < width; j++) {
-      ppmFile >> r >> g >> b;
-      int idx = i * width * 4 + j * 4;
-      img_data[idx] = map_to_midbucket(r, maximum + 1);
-      img_data[idx + 1] = map_to_midbucket(g, maximum + 1);
-      img_data[idx + 2] = map_to_midbucket(b, maximum + 1);
-      img_data[idx + 3] = 255; // Alpha
+  if (!ReadHeaderInt(text, size, pos, width) ||
+      !ReadHeaderInt(text, size, pos, height) ||
+      !ReadHeaderInt(text, size, pos, maximum) || width <= 0 || height <= 0 ||
+      maximum <= 0 || (binary && maximum > 65535)) {
+    munmap((void *)text, size);
+    FileError("ERROR: Malformed PPM header in '%s'", imgName);
+  }
+  uint8_t *img_data = (uint8_t *)malloc(4 * (size_t)width * height);
+
+  // Values are scaled up to 8 bits through map_to_midbucket, looked up once
+  // per possible value
+  std::vector<uint8_t> to_8bit(maximum + 1);
+  for (int v = 0; v <= maximum; v++)
+    to_8bit[v] = map_to_midbucket(v, maximum + 1);
+
+  if (binary) {
+    // A single whitespace byte ends the header. Values take one byte, or
+    // two (most significant first) when the maximum is above 255.
+    int value_bytes = maximum > 255 ? 2 : 1;
+    size_t row_bytes = (size_t)width * 3 * value_bytes;
+    pos++;
+    if (pos > size || (size - pos) / row_bytes < (size_t)height) {
+      munmap((void *)text, size);
+      free(img_data);
+      FileError("ERROR: PPM file '%s' is truncated", imgName);
+    }
+    const uint8_t *body = (const uint8_t *)text + pos;
+    ParallelFor(0, height, [&](int begin, int end) {
+      for (int y = begin; y < end; y++) {
+        const uint8_t *in = body + y * row_bytes;
+        uint8_t *out = img_data + (size_t)y * width * 4;
+        for (int i = 0; i < width * 3; i++, in += value_bytes) {
+          int v = value_bytes == 2 ? in[0] << 8 | in[1] : in[0];
+          out[i / 3 * 4 + i % 3] =
+              v <= maximum ? to_8bit[v] : map_to_midbucket(v, maximum + 1);
+        }
+        for (int x = 0; x < width; x++)
+          out[4 * x + 3] = 255; // Alpha
+      }
+    });
+    munmap((void *)text, size);
+    return img_data;
+  }
+
+  // Split the body at whitespace so no value straddles two chunks
+  int num_chunks = std::max(1, std::min<int>(NumThreads() * 4,
+                                             (size - pos) / (1 << 16)));
+  std::vector<size_t> bounds(num_chunks + 1);
+  for (int c = 0; c <= num_chunks; c++) {
+    size_t b = pos + (size - pos) * c / num_chunks;
+    while (b < size && !IsSpace(text[b]))
+      b++;
+    bounds[c] = std::max(b, c ? bounds[c - 1] : pos);
+  }
+  bounds[num_chunks] = size;
+
+  std::vector<long long> first_token(num_chunks + 1, 0);
+  ParallelFor(0, num_chunks, [&](int b, int e) {
+    for (int c = b; c < e; c++) {
+      long long count = 0;
+      bool in_token = false;
+      for (size_t i = bounds[c]; i < bounds[c + 1]; i++) {
+        bool space = IsSpace(text[i]);
+        count += !space && !in_token;
+        in_token = !space;
+      }
+      first_token[c + 1] = count;
     }
+  });
+  for (int c = 0; c < num_chunks; c++)
+    first_token[c + 1] += first_token[c];
+
+  long long num_values = 3LL * width * height;
+  if (first_token[num_chunks] < num_values) {
+    munmap((void *)text, size);
+    free(img_data);
+    FileError("ERROR: PPM file '%s' holds %lld values, expected %lld", imgName,
+              first_token[num_chunks], num_values);
+  }
+
+  std::atomic<bool> bad_value(false);
+  ParallelFor(0, num_chunks, [&](int b, int e) {
+    for (int c = b; c < e; c++) {
+      long long t = first_token[c];
+      const char *p = text + bounds[c];
+      const char *end = text + bounds[c + 1];
+      while (t < num_values) {
+        while (p < end && IsSpace(*p))
+          p++;
+        if (p == end)
+          break;
+        int v;
+        std::from_chars_result res = std::from_chars(p, end, v);
+        if (res.ec != std::errc()) {
+          bad_value = true;
+          break;
+        }
+        p = res.ptr;
+        while (p < end && !IsSpace(*p)) // rest of a malformed token
+          p++;
+
+        size_t idx = t / 3 * 4 + t % 3;
+        img_data[idx] = (v >= 0 && v <= maximum) ? to_8bit[v]
+                                                 : map_to_midbucket(v, maximum + 1);
+        if (t % 3 == 2)
+          img_data[idx + 1] = 255; // Alpha
+        t++;
+      }
+    }
+  });
+  munmap((void *)text, size);
+
+  if (bad_value) {
+    free(img_data);
+    FileError("ERROR: PPM file '%s' holds a value that is not an integer",
+              imgName);
   }
 
   return img_data;
@@ -84,15 +250,40 @@ uint8_t *read_ppm(char *imgName, int &width, int &height) {
 
 int map_from_midbucket(int value, int levels) { return (value * levels) / 256; }
 
+// Writes a bit-packed image straight from its levels, without unpacking it
+void write_ppm_packed(char *imgName, int bits, const PackedPixels &packed) {
+  ofstream ppmFile;
+  ppmFile.open(imgName);
+  if (!ppmFile)
+    FileError("ERROR: Could not create file '%s'", imgName);
+
+  int maximum = (1 << bits) - 1;
+  ppmFile << "P3\n";
+  ppmFile << packed.Width() << " " << packed.Height() << "\n";
+  ppmFile << maximum << "\n";
+
+  // Output value of every stored level, same mapping as write_ppm
+  int out[1 << PACKED_MAX_BITS];
+  for (int l = 0; l < packed.Levels(); l++)
+    out[l] = map_from_midbucket(packed.level_value[l], maximum + 1);
+
+  for (int i = 0; i < packed.Height(); i++) {
+    for (int j = 0; j < packed.Width(); j++) {
+      ppmFile << out[packed.Get(j, i, 0)] << " " << out[packed.Get(j, i, 1)]
+              << " " << out[packed.Get(j, i, 2)] << " ";
+    }
+  }
+
+  ppmFile.close();
+}
+
 void write_ppm(char *imgName, int width, int height, int bits,
                const uint8_t *data) {
   // Open the texture image file
   ofstream ppmFile;
   ppmFile.open(imgName);
-  if (!ppmFile) {
-    printf("ERROR: Could not create file '%s'\n", imgName);
-    exit(1);
-  }
+  if (!ppmFile)
+    FileError("ERROR: Could not create file '%s'", imgName);
 
   // Set this as an ASCII PPM (first line is P3)
   string PPM_style = "P3\n";
@@ -133,6 +324,58 @@ void write_ppm(char *imgName, int width, int height, int bits,
   ppmFile.close();
 }
 
+/**
+ * Pixel buffer pool
+ **/
+// Freed pixel buffers are kept, up to IMAGE_BUFFER_POOL_MB (default 256), and
+// handed to the next image of the same size, so long-running processes such
+// as the server reuse warm memory instead of faulting in fresh pages.
+namespace {
+std::mutex pool_mutex;
+std::mutex unpack_mutex; // serializes Image::Unpack across all images
+std::multimap<size_t, uint8_t *> pool_buffers;
+size_t pool_bytes = 0;
+
+size_t PoolCapacity() {
+  static size_t capacity = [] {
+    const char *env = getenv("IMAGE_BUFFER_POOL_MB");
+    long long mb = env ? atoll(env) : 256;
+    return (size_t)std::max(mb, 0LL) << 20;
+  }();
+  return capacity;
+}
+} // namespace
+
+static uint8_t *AllocPixels(size_t bytes) {
+  TraceAlloc(bytes);
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    auto it = pool_buffers.find(bytes);
+    if (it != pool_buffers.end()) {
+      uint8_t *p = it->second;
+      pool_buffers.erase(it);
+      pool_bytes -= bytes;
+      return p;
+    }
+  }
+  return new uint8_t[bytes];
+}
+
+// Buffers must come from AllocPixels or new[]
+static void FreePixels(uint8_t *p, size_t bytes) {
+  if (p == NULL)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (pool_bytes + bytes <= PoolCapacity()) {
+      pool_buffers.emplace(bytes, p);
+      pool_bytes += bytes;
+      return;
+    }
+  }
+  delete[] p;
+}
+
 /**
  * Image
  **/
@@ -144,18 +387,11 @@ Image::Image(int width_, int height_) {
   width = width_;
   height = height_;
   num_pixels = width * height;
+  stride = width;
   sampling_method = IMAGE_SAMPLING_POINT;
 
-  data.raw = new uint8_t[num_pixels * 4];
-  int b = 0; // which byte to write to
-  for (int j = 0; j < height; j++) {
-    for (int i = 0; i < width; i++) {
-      data.raw[b++] = 0;
-      data.raw[b++] = 0;
-      data.raw[b++] = 0;
-      data.raw[b++] = 0;
-    }
-  }
+  data.raw = AllocPixels(num_pixels * 4);
+  memset(data.raw, 0, num_pixels * 4);
 
   assert(data.raw != NULL);
 }
@@ -164,60 +400,208 @@ Image::Image(const Image &src) {
   width = src.width;
   height = src.height;
   num_pixels = width * height;
+  stride = width;
   sampling_method = IMAGE_SAMPLING_POINT;
 
-  data.raw = new uint8_t[num_pixels * sizeof(Pixel)];
+  if (src.packed) {
+    std::lock_guard<std::mutex> lock(unpack_mutex);
+    // Recheck, since another thread may have unpacked src meanwhile
+    if (PackedPixels *p = src.packed.load()) {
+      packed = new PackedPixels(*p);
+      data.raw = NULL;
+      return;
+    }
+  }
+
+  data.raw = AllocPixels(num_pixels * sizeof(Pixel));
 
-  memcpy(data.raw, src.data.raw, num_pixels * sizeof(Pixel));
+  // The source may be a cropped view, so copy it row by row
+  for (int y = 0; y < height; y++)
+    memcpy(Row(y), src.Row(y), width * sizeof(Pixel));
+}
+
+Image::Image(const ImageView &view) {
+  assert(view.width > 0);
+  assert(view.height > 0);
+
+  width = view.width;
+  height = view.height;
+  num_pixels = width * height;
+  stride = view.stride;
+  owns_data = false;
+  sampling_method = IMAGE_SAMPLING_POINT;
+
+  data.pixels = view.pixels;
 }
 
 Image::Image(char *fname) {
 
   int numComponents; //(e.g., Y, YA, RGB, or RGBA)
 
+  int lastc = strlen(fname);
+  bool is_ppm = string(fname + lastc - 3) == "ppm";
+  bool is_qim = string(fname + lastc - 3) == "qim";
+
+  // PPM and QIM load about as fast as a cache entry, so only the formats
+  // STB has to decode are cached. A hit maps the entry's pixels directly.
+  bool cacheable = !is_ppm && !is_qim;
+  if (cacheable) {
+    data.raw = ImageCacheLoad(fname, width, height);
+    if (data.raw != NULL) {
+      cache_mapped = true;
+      num_pixels = width * height;
+      stride = width;
+      sampling_method = IMAGE_SAMPLING_POINT;
+      return;
+    }
+  }
+
   // Load the pixels with STB Image Lib
   //
-  int lastc = strlen(fname);
   uint8_t *loadedPixels;
-  if (string(fname + lastc - 3) == "ppm") {
+  if (is_ppm) {
     loadedPixels = read_ppm(fname, width, height);
+  } else if (is_qim) {
+    loadedPixels = ReadQim(fname, width, height);
   } else {
     int numComponents; //(e.g., Y, YA, RGB, or RGBA)
     loadedPixels = stbi_load(fname, &width, &height, &numComponents, 4);
   }
-  if (loadedPixels == NULL) {
-    printf("Error loading image: %s", fname);
-    exit(-1);
-  }
+  if (loadedPixels == NULL)
+    FileError("Error loading image: %s", fname);
 
   // Set image member variables
   num_pixels = width * height;
+  stride = width;
   sampling_method = IMAGE_SAMPLING_POINT;
 
   // Copy the loaded pixels into the image data structure
-  data.raw = new uint8_t[num_pixels * sizeof(Pixel)];
+  data.raw = AllocPixels(num_pixels * sizeof(Pixel));
   memcpy(data.raw, loadedPixels, num_pixels * sizeof(Pixel));
   free(loadedPixels);
+
+  if (cacheable)
+    ImageCacheStore(fname, width, height, data.raw);
 }
 
 Image::~Image() {
-  delete[] data.raw;
+  if (owns_data)
+    FreeData();
+  delete packed.load();
+}
+
+void Image::FreeData() {
+  if (cache_mapped)
+    ImageCacheRelease(data.raw, num_pixels * sizeof(Pixel));
+  else
+    FreePixels(data.raw, num_pixels * sizeof(Pixel));
   data.raw = NULL;
+  cache_mapped = false;
 }
 
-void Image::Write(char *fname) {
+void Image::Unpack() const {
+  // The first const access may come from several workers of a parallel
+  // loop at once: the first one unpacks and the others wait, then find
+  // nothing left to do
+  std::lock_guard<std::mutex> lock(unpack_mutex);
+  PackedPixels *p = packed.load();
+  if (p == NULL)
+    return;
+  // Packed images always own compact storage, so stride == width
+  data.raw = AllocPixels(num_pixels * sizeof(Pixel));
+  ParallelFor(0, height, [&](int b, int e) {
+    for (int y = b; y < e; y++)
+      p->UnpackRow(y, data.pixels + y * width);
+  });
+  // Publish the pixels only once they are all written
+  packed.store(NULL);
+  delete p;
+}
+
+void Image::AdoptPacked(PackedPixels *p) {
+  assert(owns_data);
+  FreeData();
+  delete packed.exchange(p);
+}
 
+// Packed storage for an nbits result whose level l decodes to l * step, or
+// NULL when the image cannot be stored packed
+static PackedPixels *PackedTarget(const Image &img, int nbits, double step) {
+  if (nbits < 1 || nbits > PACKED_MAX_BITS || !img.owns_data)
+    return NULL;
+  PackedPixels *p = new PackedPixels(img.Width(), img.Height(), nbits);
+  for (int l = 0; l < p->Levels(); l++)
+    p->level_value[l] = ComponentClamp((int)(l * step));
+  return p;
+}
+
+void Image::Write(char *fname) {
   int lastc = strlen(fname);
 
+  bool is_qim = lastc >= 3 && string(fname + lastc - 3) == "qim";
+  bool is_png = lastc >= 3 && string(fname + lastc - 3) == "png";
+
+  if (const PackedPixels *p = packed.load()) {
+    if (fname[lastc - 1] == 'm' && !is_qim) { // ppm
+      write_ppm_packed(fname, export_depth, *p);
+      return;
+    }
+    if (is_png) {
+      // Decode each row into the PNG filter as it goes; there is no alpha
+      // to store
+      auto rows = [&](int y, uint8_t *scratch) {
+        thread_local std::vector<Pixel> rgba;
+        rgba.resize(width);
+        p->UnpackRow(y, rgba.data());
+        for (int x = 0; x < width; x++) {
+          scratch[3 * x] = rgba[x].r;
+          scratch[3 * x + 1] = rgba[x].g;
+          scratch[3 * x + 2] = rgba[x].b;
+        }
+        return (const uint8_t *)scratch;
+      };
+      if (!WritePNGRows(fname, width, height, 3, rows, png_level))
+        FileError("ERROR: Could not write file '%s'", fname);
+      return;
+    }
+    // The other writers want an 8-bit buffer, so decode into a temporary
+    // image
+    Image expanded(width, height);
+    ParallelFor(0, height, [&](int b, int e) {
+      for (int y = b; y < e; y++)
+        p->UnpackRow(y, expanded.Row(y));
+    });
+    expanded.Write(fname);
+    return;
+  }
+
+  if (is_qim) {
+    if (!WriteQim(fname, width, height, stride, data.raw))
+      FileError("ERROR: Could not write file '%s'", fname);
+    return;
+  }
+
+  if (is_png) {
+    if (!WritePNG(fname, width, height, stride, data.raw, png_level))
+      FileError("ERROR: Could not write file '%s'", fname);
+    return;
+  }
+
+  // The other writers expect tightly packed rows, so materialize cropped
+  // views
+  if (stride != width) {
+    Image compact(*this);
+    compact.export_depth = export_depth;
+    compact.Write(fname);
+    return;
+  }
+
   switch (fname[lastc - 1]) {
   case 'm': // ppm
     write_ppm(fname, width, height, export_depth, data.raw);
     break;
-  case 'g': // jpeg (or jpg) or png
-    if (fname[lastc - 2] == 'p' || fname[lastc - 2] == 'e')  // jpeg or jpg
-      stbi_write_jpg(fname, width, height, 4, data.raw, 95); // 95% jpeg quality
-    else                                                     // png
-      stbi_write_png(fname, width, height, 4, data.raw, width * 4);
+  case 'g': // jpeg or jpg (png is handled above)
+    stbi_write_jpg(fname, width, height, 4, data.raw, 95); // 95% jpeg quality
     break;
   case 'a': // tga (targa)
     stbi_write_tga(fname, width, height, 4, data.raw);
@@ -264,6 +648,24 @@ void Image::ExtractChannel(int channel) {
 }
 
 void Image::Quantize(int nbits) {
+  // Same levels and rounding as PixelQuant, kept bit-packed
+  int shift = 8 - nbits;
+  if (PackedPixels *out = PackedTarget(*this, nbits, 255 / float(255 >> shift))) {
+    TuneScope tune("quantize");
+    ParallelFor(0, height, [&](int b, int e) {
+      for (int y = b; y < e; y++) {
+        const Pixel *row = Row(y);
+        for (int x = 0; x < width; x++) {
+          out->Set(x, y, 0, row[x].r >> shift);
+          out->Set(x, y, 1, row[x].g >> shift);
+          out->Set(x, y, 2, row[x].b >> shift);
+        }
+      }
+    }, tune.Rows(1));
+    AdoptPacked(out);
+    return;
+  }
+
   for (int x = 0; x < Width(); x++) {
     for (int y = 0; y < Height(); y++) {
       Pixel p = GetPixel(x, y);
@@ -273,15 +675,64 @@ void Image::Quantize(int nbits) {
   }
 }
 
-Image *Image::Crop(int x, int y, int w, int h) {
-  Image *new_img = new Image(w, h);
-  for (int i = x; i < x + w; i++) {
-    for (int j = y; j < y + h; j++) {
-      Pixel p = GetPixel(i, j);
-      new_img->SetPixel(i - x, j - y, p);
+/**
+ * Palette quantization
+ **/
+void Image::PaletteQuantize(int ncolors, bool dither) {
+  std::vector<Pixel> palette = BuildPalette(View(), ncolors);
+  InverseColormap inverse(palette);
+  int w = Width(), h = Height();
+
+  if (!dither) {
+    ParallelFor(0, h, [&](int b, int e) {
+      for (int y = b; y < e; y++) {
+        Pixel *row = Row(y);
+        for (int x = 0; x < w; x++) {
+          const Pixel &q = palette[inverse.Nearest(row[x].r, row[x].g, row[x].b)];
+          row[x].Set(q.r, q.g, q.b);
+        }
+      }
+    });
+    return;
+  }
+
+  // Serpentine error diffusion, as in FloydSteinbergDither. The errors
+  // owed to the current and next rows live in two padded row buffers.
+  std::vector<float> cur((w + 2) * 3, 0), next((w + 2) * 3, 0);
+  for (int y = 0; y < h; y++) {
+    Pixel *row = Row(y);
+    int dir = y % 2 == 0 ? 1 : -1;
+    std::fill(next.begin(), next.end(), 0);
+    for (int i = 0; i < w; i++) {
+      int x = dir > 0 ? i : w - 1 - i;
+      float *err = &cur[(x + 1) * 3];
+      int want[3] = {ComponentClamp(lround(row[x].r + err[0])),
+                     ComponentClamp(lround(row[x].g + err[1])),
+                     ComponentClamp(lround(row[x].b + err[2]))};
+      const Pixel &q = palette[inverse.Nearest(want[0], want[1], want[2])];
+      int got[3] = {q.r, q.g, q.b};
+      for (int k = 0; k < 3; k++) {
+        float e = want[k] - got[k];
+        cur[(x + 1 + dir) * 3 + k] += e * (7 / 16.0f);
+        next[(x + 1 - dir) * 3 + k] += e * (3 / 16.0f);
+        next[(x + 1) * 3 + k] += e * (5 / 16.0f);
+        next[(x + 1 + dir) * 3 + k] += e * (1 / 16.0f);
+      }
+      row[x].Set(q.r, q.g, q.b);
     }
+    std::swap(cur, next);
+  }
+}
+
+ImageView Image::Crop(int x, int y, int w, int h) const {
+  if (!ValidCoord(x, y) || !ValidCoord(x + w - 1, y + h - 1)) {
+    throw std::out_of_range("Crop: region (" + std::to_string(x) + ", " +
+                            std::to_string(y) + ", " + std::to_string(w) +
+                            "x" + std::to_string(h) + ") is out of bounds (" +
+                            std::to_string(width) + "x" +
+                            std::to_string(height) + ")");
   }
-  return new_img;
+  return ImageView{Row(y) + x, w, h, stride};
 }
 
 void Image::AddNoise(double factor) {
@@ -305,48 +756,37 @@ void Image::AddNoise(double factor) {
 // thanks to
 // https://www.dfstudios.co.uk/articles/programming/image-programming-algorithms/image-processing-algorithms-part-5-contrast-adjustment/
 //
+// Both run on the gray-lerp kernels of luma.h, a row at a time
 void Image::ChangeContrast(double factor) {
-  int x, y;
-  double avg = 0.0f;
-  for (x = 0; x < Width(); x++) {
-    for (y = 0; y < Height(); y++) {
-      Pixel p = GetPixel(x, y);
-      avg += 0.3 * p.r + 0.59 * p.g + 0.11 * p.b;
-    }
-  }
-  avg /= num_pixels;
-  // printf("avg: %f\n", avg);
-  // printf("avg: %d\n", (int)avg);
-  double f = (259 * (factor + 255)) / (255 * (259 - factor));
-  // printf("f: %f\n", f);
+  TuneScope tune("contrast");
+  ImageView view = View();
+  // Per row, so the sum does not depend on the thread count
+  std::vector<double> row_sums(view.height);
+  ParallelFor(0, view.height, [&](int b, int e) {
+    for (int y = b; y < e; y++)
+      row_sums[y] = GraySum(view.Row(y), view.width);
+  }, tune.Rows(1));
+  double sum = 0;
+  for (double s : row_sums)
+    sum += s;
+  uint64_t pixels = (uint64_t)view.width * view.height;
+  double avg = pixels ? sum / pixels : 0;
 
-  for (x = 0; x < Width(); x++) {
-    for (y = 0; y < Height(); y++) {
-      Pixel p = GetPixel(x, y);
-      Pixel new_pixel = Pixel();
-      new_pixel.SetClamp((int)(avg + f * (p.r - avg)),
-                         (int)(avg + f * (p.g - avg)),
-                         (int)(avg + f * (p.b - avg)));
-      // printf("scale %d, %d %d\n", new_pixel.r, new_pixel.g, new_pixel.b);
-      GetPixel(x, y) = new_pixel;
-    }
-  }
+  double f = (259 * (factor + 255)) / (255 * (259 - factor));
+  ParallelFor(0, view.height, [&](int b, int e) {
+    for (int y = b; y < e; y++)
+      ContrastSpan(view.Row(y), view.width, avg, f);
+  }, tune.Rows(1));
 }
 
 void Image::ChangeSaturation(double factor) {
+  TuneScope tune("saturation");
+  ImageView view = View();
   double f = (259 * (factor + 255)) / (255 * (259 - factor));
-  int x, y;
-  for (x = 0; x < Width(); x++) {
-    for (y = 0; y < Height(); y++) {
-      Pixel p = GetPixel(x, y);
-      Pixel new_pixel = Pixel();
-      float grayscale = 0.3 * p.r + 0.59 * p.g + 0.11 * p.b;
-      new_pixel.SetClamp((int)(grayscale + f * (p.r - grayscale)),
-                         (int)(grayscale + f * (p.g - grayscale)),
-                         (int)(grayscale + f * (p.b - grayscale)));
-      GetPixel(x, y) = new_pixel;
-    }
-  }
+  ParallelFor(0, view.height, [&](int b, int e) {
+    for (int y = b; y < e; y++)
+      SaturateSpan(view.Row(y), view.width, f);
+  }, tune.Rows(1));
 }
 
 // For full credit, check that your dithers aren't making the pictures
@@ -359,6 +799,7 @@ void Image::RandomDither(int nbits) {
   int maximum = (1 << nbits) - 1;
   double step = 255.0 / maximum;
   std::uniform_real_distribution<double> dist(-step/2.0f, step/2.0f);
+  PackedPixels *out = PackedTarget(*this, nbits, step);
   for (int x = 0; x < Width(); x++) {
     for (int y = 0; y < Height(); y++) {
       Pixel p = GetPixel(x, y);
@@ -375,11 +816,20 @@ void Image::RandomDither(int nbits) {
       // new_pixel.SetClamp(r, g, b);
       // GetPixel(x, y) = new_pixel;
 
+      if (out) {
+        out->Set(x, y, 0, level_r);
+        out->Set(x, y, 1, level_g);
+        out->Set(x, y, 2, level_b);
+        continue;
+      }
+
       Pixel new_pixel = Pixel();
       new_pixel.SetClamp(level_r * step, level_g * step, level_b * step);
       this->SetPixel(x, y, new_pixel);
     }
   }
+  if (out)
+    AdoptPacked(out);
 }
 // This bayer method gives the quantization thresholds for an ordered dither.
 // This is a 4x4 dither pattern, assumes the values are quantized to 16 levels.
@@ -463,6 +913,7 @@ void Image::FloydSteinbergDither(int nbits) {
   this->export_depth = nbits;
   int maximum = (1 << nbits) - 1;
   double step = 255.0 / maximum;
+  PackedPixels *out = PackedTarget(*this, nbits, step);
 
   for (int y = 0; y < Height(); y++) {
     if (y % 2 == 0) {
@@ -480,6 +931,13 @@ void Image::FloydSteinbergDither(int nbits) {
 
         propogate_error(x, y, err, f_image, true);
 
+        if (out) {
+          out->Set(x, y, 0, level_r);
+          out->Set(x, y, 1, level_g);
+          out->Set(x, y, 2, level_b);
+          continue;
+        }
+
         Pixel new_pixel = Pixel();
         new_pixel.SetClamp(level_r * step, level_g * step, level_b * step);
         // printf("pixel: %d %d %d : ", new_pixel.r, new_pixel.g, new_pixel.b);
@@ -502,6 +960,13 @@ void Image::FloydSteinbergDither(int nbits) {
 
         propogate_error(x, y, err, f_image, false);
 
+        if (out) {
+          out->Set(x, y, 0, level_r);
+          out->Set(x, y, 1, level_g);
+          out->Set(x, y, 2, level_b);
+          continue;
+        }
+
         Pixel new_pixel = Pixel();
         new_pixel.SetClamp(level_r * step, level_g * step, level_b * step);
         // printf("pixel: %d %d %d : ", new_pixel.r, new_pixel.g, new_pixel.b);
@@ -511,40 +976,315 @@ void Image::FloydSteinbergDither(int nbits) {
       }
     }
   }
+  if (out)
+    AdoptPacked(out);
 }
 
-/* modifies the dst with the kernel*/
-void Convolve(Image *src, Image *dst, std::vector<std::vector<double>> kernel,
-              int edge_pattern) {
+/**
+ * FFT convolution
+ **/
+// Time of one unit of TransformCost relative to one tap of the direct loop
+const double FFT_POINT_COST = 1.7;
+
+// Work of a forward or inverse 2D transform of a t x t block: t real row
+// transforms (half-length complex ones) and t / 2 + 1 column transforms
+static double TransformCost2D(int t) {
+  return t * TransformCost(t / 2) + (t / 2 + 1) * TransformCost(t);
+}
+
+// FFT tile size for a kernel, minimizing transform work per output pixel
+static int FFTTileSize(int kernel_size) {
+  int best = 0;
+  double best_cost = DBL_MAX;
+  int limit = std::max(4 * kernel_size, 256);
+  for (int t = NextFastSize(2 * kernel_size); t <= limit;
+       t = NextFastSize(t + 1)) {
+    if (t % 2)
+      continue;
+    double out = t - kernel_size + 1;
+    double cost = TransformCost2D(t) / (out * out);
+    if (cost < best_cost) {
+      best_cost = cost;
+      best = t;
+    }
+  }
+  return best;
+}
+
+// Whether the FFT path is expected to beat the direct loop
+static bool PreferFFT(int width, int height, int kernel_size) {
+  if (kernel_size < 9)
+    return false;
+  int t = FFTTileSize(kernel_size);
+  int b = t - kernel_size + 1;
+  double tiles = (double)((width + b - 1) / b) * ((height + b - 1) / b);
+  // 3 channels, each a forward and an inverse 2D transform
+  double fft = tiles * 6 * TransformCost2D(t) * FFT_POINT_COST;
+  double direct = (double)width * height * kernel_size * kernel_size * 3;
+  return fft < direct;
+}
+
+// 2D real transform of a t x t block into t rows of t / 2 + 1 coefficients
+static void Forward2D(const RealFFTPlan &rows, const FFTPlan &cols,
+                      const double *in, Complex *out) {
+  int t = rows.Size(), c = t / 2 + 1;
+  for (int y = 0; y < t; y++)
+    rows.Forward(in + y * t, out + y * c);
+
+  thread_local std::vector<Complex> col;
+  col.resize(t);
+  for (int x = 0; x < c; x++) {
+    for (int y = 0; y < t; y++)
+      col[y] = out[y * c + x];
+    cols.Forward(col.data());
+    for (int y = 0; y < t; y++)
+      out[y * c + x] = col[y];
+  }
+}
+
+static void Inverse2D(const RealFFTPlan &rows, const FFTPlan &cols,
+                      Complex *in, double *out) {
+  int t = rows.Size(), c = t / 2 + 1;
+  thread_local std::vector<Complex> col;
+  col.resize(t);
+  for (int x = 0; x < c; x++) {
+    for (int y = 0; y < t; y++)
+      col[y] = in[y * c + x];
+    cols.Inverse(col.data());
+    for (int y = 0; y < t; y++)
+      in[y * c + x] = col[y];
+  }
+
+  for (int y = 0; y < t; y++)
+    rows.Inverse(in + y * c, out + y * t);
+}
+
+// Overlap-save: every output tile reads a block of the source that is 2n
+// pixels larger (clamped at the borders like the direct loop), multiplies
+// its spectrum by the kernel's and keeps the samples that the circular
+// wrap-around does not reach. Tiles are independent, so they run in
+// parallel.
+static void ConvolveFFT(const Image *src, Image *dst,
+                        const std::vector<std::vector<double>> &kernel) {
+  int size = kernel.size();
+  int n = size / 2;
+  int t = FFTTileSize(size);
+  int b = t - 2 * n;
+  int c = t / 2 + 1;
+  int w = src->Width(), h = src->Height();
+
+  RealFFTPlan rows(t);
+  FFTPlan cols(t);
+
+  // The direct loop correlates, so convolve with the flipped kernel
+  std::vector<double> block((size_t)t * t, 0.0);
+  for (int i = 0; i < size; i++)
+    for (int j = 0; j < size; j++)
+      block[(size_t)(2 * n - j) * t + (2 * n - i)] = kernel[i][j];
+  std::vector<Complex> kernel_spectrum((size_t)t * c);
+  Forward2D(rows, cols, block.data(), kernel_spectrum.data());
+
+  double norm = 1.0 / ((double)t * t);
+  ParallelForTiles(w, h, b, b, [&](int x0, int y0, int x1, int y1) {
+    std::vector<double> channels[3];
+    std::vector<Complex> spectrum((size_t)t * c);
+    for (int ch = 0; ch < 3; ch++) {
+      std::vector<double> &in = channels[ch];
+      in.resize((size_t)t * t);
+      for (int ty = 0; ty < t; ty++) {
+        const Pixel *row = src->Row(std::min(std::max(y0 + ty - n, 0), h - 1));
+        for (int tx = 0; tx < t; tx++) {
+          const Pixel &p = row[std::min(std::max(x0 + tx - n, 0), w - 1)];
+          in[(size_t)ty * t + tx] = ch == 0 ? p.r : ch == 1 ? p.g : p.b;
+        }
+      }
+      Forward2D(rows, cols, in.data(), spectrum.data());
+      for (size_t k = 0; k < spectrum.size(); k++)
+        spectrum[k] *= kernel_spectrum[k] * norm;
+      Inverse2D(rows, cols, spectrum.data(), in.data());
+    }
+
+    for (int y = y0; y < y1; y++) {
+      Pixel *out = dst->Row(y);
+      size_t base = (size_t)(y - y0 + 2 * n) * t + 2 * n - x0;
+      for (int x = x0; x < x1; x++) {
+        double v[3];
+        for (int ch = 0; ch < 3; ch++) {
+          // Snap round-off so exact integer sums truncate like the direct loop
+          v[ch] = channels[ch][base + x];
+          double nearest = floor(v[ch] + 0.5);
+          if (fabs(v[ch] - nearest) < 1e-6)
+            v[ch] = nearest;
+        }
+        Pixel new_p = Pixel();
+        new_p.SetClamp(v[0], v[1], v[2]);
+        out[x] = new_p;
+      }
+    }
+  });
+}
+
+/**
+ * Direct convolution
+ **/
+typedef std::vector<std::vector<double>> Kernel;
+
+// Clamped loop for the pixels in [x0, x1) x [y0, y1) near the borders, in
+// tasks of at least "grain" rows
+static void ConvolveClamped(const Image *src, Image *dst, const Kernel &kernel,
+                            int x0, int y0, int x1, int y1, int grain) {
   int n = kernel.size() / 2;
-  // Loop over
-  for (int x = 0; x < src->Width(); x++) {
-    for (int y = 0; y < src->Height(); y++) {
-      double r = 0, g = 0, b = 0;
-
-      // Loop over kernel
-      for (int i = -n; i <= n; i++) {
-        for (int j = -n; j <= n; j++) {
-          int xx = std::min(std::max(x + i, 0), src->Width() - 1);
-          int yy = std::min(std::max(y + j, 0), src->Height() - 1);
-
-          Pixel p = src->GetPixel(xx, yy);
-          double weight = kernel[i + n][j + n];
-          r += weight * p.r;
-          g += weight * p.g;
-          b += weight * p.b;
+  ParallelFor(y0, y1, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      for (int x = x0; x < x1; x++) {
+        double r = 0, g = 0, b = 0;
+
+        // Loop over kernel
+        for (int i = -n; i <= n; i++) {
+          for (int j = -n; j <= n; j++) {
+            int xx = std::min(std::max(x + i, 0), src->Width() - 1);
+            int yy = std::min(std::max(y + j, 0), src->Height() - 1);
+
+            const Pixel &p = src->Row(yy)[xx];
+            double weight = kernel[i + n][j + n];
+            r += weight * p.r;
+            g += weight * p.g;
+            b += weight * p.b;
+          }
         }
+
+        Pixel new_p = Pixel();
+        new_p.SetClamp(r, g, b);
+        dst->Row(y)[x] = new_p;
       }
+    }
+  }, grain);
+}
 
-      Pixel new_p = Pixel();
-      new_p.SetClamp(r, g, b);
-      dst->SetPixel(x, y, new_p);
+// Adds up all SIZE x SIZE taps for the pixel at column x. The fold expands
+// to straight-line code, visiting taps in the same order as the clamped
+// loop (x offset outer, y offset inner) so both give identical sums.
+template <int SIZE, int... TAP>
+static inline void AccumulateTaps(const double *k, const Pixel *const *rows,
+                                  int x, double &r, double &g, double &b,
+                                  std::integer_sequence<int, TAP...>) {
+  ((r += k[TAP] * rows[TAP % SIZE][x + TAP / SIZE].r,
+    g += k[TAP] * rows[TAP % SIZE][x + TAP / SIZE].g,
+    b += k[TAP] * rows[TAP % SIZE][x + TAP / SIZE].b),
+   ...);
+}
+
+// Interior pixels, whose whole window lies inside the image, for kernels
+// whose size is known at compile time
+template <int SIZE>
+static void ConvolveInterior(const Image *src, Image *dst, const Kernel &kernel,
+                             int x0, int y0, int x1, int y1, int grain) {
+  const int n = SIZE / 2;
+  double k[SIZE * SIZE];
+  for (int i = 0; i < SIZE; i++)
+    for (int j = 0; j < SIZE; j++)
+      k[i * SIZE + j] = kernel[i][j];
+
+  ParallelFor(y0, y1, [&](int begin, int end) {
+    const Pixel *rows[SIZE];
+    for (int y = begin; y < end; y++) {
+      for (int j = 0; j < SIZE; j++)
+        rows[j] = src->Row(y - n + j) - n;
+      Pixel *out = dst->Row(y);
+      for (int x = x0; x < x1; x++) {
+        double r = 0, g = 0, b = 0;
+        AccumulateTaps<SIZE>(k, rows, x, r, g, b,
+                             std::make_integer_sequence<int, SIZE * SIZE>());
+        Pixel new_p = Pixel();
+        new_p.SetClamp(r, g, b);
+        out[x] = new_p;
+      }
+    }
+  }, grain);
+}
+
+// Interior pixels for any other kernel size
+static void ConvolveInteriorAnySize(const Image *src, Image *dst,
+                                    const Kernel &kernel, int x0, int y0,
+                                    int x1, int y1, int grain) {
+  int size = kernel.size(), n = size / 2;
+  std::vector<double> k(size * size);
+  for (int i = 0; i < size; i++)
+    for (int j = 0; j < size; j++)
+      k[i * size + j] = kernel[i][j];
+
+  ParallelFor(y0, y1, [&](int begin, int end) {
+    std::vector<const Pixel *> rows(size);
+    for (int y = begin; y < end; y++) {
+      for (int j = 0; j < size; j++)
+        rows[j] = src->Row(y - n + j) - n;
+      Pixel *out = dst->Row(y);
+      for (int x = x0; x < x1; x++) {
+        double r = 0, g = 0, b = 0;
+        const double *weight = k.data();
+        for (int i = 0; i < size; i++) {
+          for (int j = 0; j < size; j++, weight++) {
+            const Pixel &p = rows[j][x + i];
+            r += *weight * p.r;
+            g += *weight * p.g;
+            b += *weight * p.b;
+          }
+        }
+        Pixel new_p = Pixel();
+        new_p.SetClamp(r, g, b);
+        out[x] = new_p;
+      }
     }
+  }, grain);
+}
+
+/* modifies the dst with the kernel*/
+void Convolve(Image *src, Image *dst, const Kernel &kernel, int edge_pattern) {
+  TuneScope tune("convolve");
+  if (PreferFFT(src->Width(), src->Height(), kernel.size())) {
+    ConvolveFFT(src, dst, kernel);
+    return;
   }
+
+  int w = src->Width(), h = src->Height();
+  int n = kernel.size() / 2;
+  int grain = tune.Rows(1);
+
+  // The interior needs no clamping; an image smaller than the kernel is
+  // all border
+  int x0 = std::min(n, w), x1 = std::max(w - n, x0);
+  int y0 = std::min(n, h), y1 = std::max(h - n, y0);
+  if (x0 < x1 && y0 < y1) {
+    switch (kernel.size()) {
+    case 3:
+      ConvolveInterior<3>(src, dst, kernel, x0, y0, x1, y1, grain);
+      break;
+    case 5:
+      ConvolveInterior<5>(src, dst, kernel, x0, y0, x1, y1, grain);
+      break;
+    case 7:
+      ConvolveInterior<7>(src, dst, kernel, x0, y0, x1, y1, grain);
+      break;
+    default:
+      ConvolveInteriorAnySize(src, dst, kernel, x0, y0, x1, y1, grain);
+    }
+  } else {
+    x0 = x1 = 0;
+    y0 = y1 = 0;
+  }
+
+  ConvolveClamped(src, dst, kernel, 0, 0, w, y0, grain);   // top
+  ConvolveClamped(src, dst, kernel, 0, y1, w, h, grain);   // bottom
+  ConvolveClamped(src, dst, kernel, 0, y0, x0, y1, grain); // left
+  ConvolveClamped(src, dst, kernel, x1, y0, w, y1, grain); // right
 }
 
 // Gaussian blur with size nxn filter
 void Image::Blur(int n) {
+  // The convolution reads the copy from parallel rows, so it must not be
+  // left packed
+  if (IsPacked())
+    Unpack();
   Image *img_copy =
       new Image(*this); // This is will copying the image, so you can read the
                         // original values for filtering
@@ -576,6 +1316,8 @@ void Image::Blur(int n) {
 }
 
 void Image::Sharpen(int n) {
+  if (IsPacked())
+    Unpack();
   Image *blurred_image = new Image(*this);
   blurred_image->Blur(2);
   for (int x = 0; x < this->Width(); x++) {
@@ -615,6 +1357,8 @@ void Image::Sharpen(int n) {
 // delete img_copy;
 
 void Image::EdgeDetect() {
+  if (IsPacked())
+    Unpack();
   Image *img_copy = new Image(*this);
   int n = 1;
   int size = 3;
@@ -634,135 +1378,446 @@ void Image::EdgeDetect() {
   delete img_copy;
 }
 
-Image *Image::Scale(double sx, double sy) {
-  Image *img_copy = new Image(Width() * sx, Height() * sy);
-
-  float src_cx = Width() / 2.0f;
-  float src_cy = Height() / 2.0f;
-  float dst_cx = img_copy->Width() / 2.0f;
-  float dst_cy = img_copy->Height() / 2.0f;
-
-  for (int x = 0; x < img_copy->Width(); x++) {
-    for (int y = 0; y < img_copy->Height(); y++) {
-      float dx = x - dst_cx;
-      float dy = y - dst_cy;
-
-      float u = dx / sx + src_cx;
-      float v = dy / sy + src_cy;
+/**
+ * Median (Perreault-Hebert constant time median filter)
+ **/
+namespace {
+const int MEDIAN_TILE = 128;
+// Column histograms count up to 2r + 1 pixels in 16 bits
+const int MEDIAN_MAX_RADIUS = 32767;
+
+// Histogram of one image column inside the filter window, split into 16
+// coarse buckets of 16 fine bins each
+struct ColumnHist {
+  uint16_t coarse[16];
+  uint16_t fine[256];
+};
 
-      img_copy->GetPixel(x, y) = Sample(u, v);
-    }
-  }
-  return img_copy;
+inline void HistAdd(ColumnHist &hist, int value, int delta) {
+  hist.coarse[value >> 4] += delta;
+  hist.fine[value] += delta;
 }
 
-Image *Image::Rotate(double angle) {
-  Image *img_copy = new Image(*this);
-
-  float cx = Width() / 2.0f;
-  float cy = Height() / 2.0f;
-
-  double cos_a = cos(angle);
-  double sin_a = sin(angle);
-
-  for (int x = 0; x < Width(); x++) {
-    for (int y = 0; y < Height(); y++) {
-      float dx = x - cx;
-      float dy = y - cy;
+inline int Clamp(int v, int lo, int hi) { return std::min(std::max(v, lo), hi); }
+} // namespace
+
+// Each tile keeps one column histogram per channel and slides the window
+// down the rows, so updating a column costs two histogram writes. The
+// window histogram only keeps its coarse level up to date; the fine bins of
+// a bucket are refreshed lazily, when the median falls into that bucket.
+// Tiles grow with r, so that building their column histograms stays a
+// constant cost per pixel.
+void Image::Median(int r) {
+  if (r <= 0)
+    return;
+
+  TuneScope tune("median");
+  // Unpack before copying, so the workers never touch packed pixels
+  if (IsPacked())
+    Unpack();
+  Image src(*this);
+  int w = Width(), h = Height();
+  // From r = max(w, h) on, every window already covers the whole image and
+  // a larger one only adds copies of the border
+  r = std::min({r, std::max(w, h), MEDIAN_MAX_RADIUS});
+  int diam = 2 * r + 1;
+  uint32_t rank = (uint32_t)((uint64_t)diam * diam / 2);
+
+  // A tile builds (width + 2r) column histograms of 2r + 1 pixels, and
+  // slides all of them down each of its rows
+  int tile_w = std::max(tune.TileW(MEDIAN_TILE), 2 * r);
+  int tile_h = std::max(tune.TileH(MEDIAN_TILE), 8 * r);
+  ParallelForTiles(w, h, tile_w, tile_h,
+                   [&](int x0, int y0, int x1, int y1) {
+    // Local column j holds image column x0 - r + j (clamped to the image)
+    int cols = x1 - x0 + 2 * r;
+    std::vector<ColumnHist> hist(cols * 3, ColumnHist());
+    std::vector<int> col_x(cols);
+    for (int j = 0; j < cols; j++) {
+      col_x[j] = Clamp(x0 - r + j, 0, w - 1);
+      for (int dy = -r; dy <= r; dy++) {
+        const Pixel &p = src.Row(Clamp(y0 + dy, 0, h - 1))[col_x[j]];
+        HistAdd(hist[j * 3 + 0], p.r, 1);
+        HistAdd(hist[j * 3 + 1], p.g, 1);
+        HistAdd(hist[j * 3 + 2], p.b, 1);
+      }
+    }
 
-      float u = dx * cos_a + dy * sin_a;
-      float v = -dx * sin_a + dy * cos_a;
+    uint32_t coarse[3][16];
+    uint32_t fine[3][256];
+    int fresh[3][16]; // column at which each fine bucket was last refreshed
+
+    for (int y = y0; y < y1; y++) {
+      if (y > y0) {
+        const Pixel *old_row = src.Row(Clamp(y - r - 1, 0, h - 1));
+        const Pixel *new_row = src.Row(Clamp(y + r, 0, h - 1));
+        for (int j = 0; j < cols; j++) {
+          const Pixel &o = old_row[col_x[j]];
+          const Pixel &n = new_row[col_x[j]];
+          HistAdd(hist[j * 3 + 0], o.r, -1);
+          HistAdd(hist[j * 3 + 0], n.r, 1);
+          HistAdd(hist[j * 3 + 1], o.g, -1);
+          HistAdd(hist[j * 3 + 1], n.g, 1);
+          HistAdd(hist[j * 3 + 2], o.b, -1);
+          HistAdd(hist[j * 3 + 2], n.b, 1);
+        }
+      }
 
-      u += cx;
-      v += cy;
+      memset(coarse, 0, sizeof(coarse));
+      for (int j = 0; j < diam; j++)
+        for (int c = 0; c < 3; c++)
+          for (int k = 0; k < 16; k++)
+            coarse[c][k] += hist[j * 3 + c].coarse[k];
+      for (int c = 0; c < 3; c++)
+        for (int k = 0; k < 16; k++)
+          fresh[c][k] = INT_MIN;
+
+      for (int x = x0; x < x1; x++) {
+        // The window covers local columns j .. j + 2r
+        int j = x - x0;
+        if (j > 0) {
+          for (int c = 0; c < 3; c++) {
+            const ColumnHist &in = hist[(j + 2 * r) * 3 + c];
+            const ColumnHist &out = hist[(j - 1) * 3 + c];
+            for (int k = 0; k < 16; k++)
+              coarse[c][k] += in.coarse[k] - out.coarse[k];
+          }
+        }
 
-      // printf("u,v %f %f\n", u, v);
+        Component median[3];
+        for (int c = 0; c < 3; c++) {
+          uint32_t sum = 0;
+          int k = 0;
+          while (sum + coarse[c][k] <= rank)
+            sum += coarse[c][k++];
+
+          uint32_t *bins = fine[c] + k * 16;
+          if (fresh[c][k] != INT_MIN && j - fresh[c][k] <= 2 * r) {
+            for (int jj = fresh[c][k] + 1; jj <= j; jj++) {
+              const uint16_t *in = hist[(jj + 2 * r) * 3 + c].fine + k * 16;
+              const uint16_t *out = hist[(jj - 1) * 3 + c].fine + k * 16;
+              for (int b = 0; b < 16; b++)
+                bins[b] += in[b] - out[b];
+            }
+          } else {
+            memset(bins, 0, 16 * sizeof(uint32_t));
+            for (int jj = j; jj <= j + 2 * r; jj++) {
+              const uint16_t *in = hist[jj * 3 + c].fine + k * 16;
+              for (int b = 0; b < 16; b++)
+                bins[b] += in[b];
+            }
+          }
+          fresh[c][k] = j;
+
+          int b = 0;
+          while (sum + bins[b] <= rank)
+            sum += bins[b++];
+          median[c] = k * 16 + b;
+        }
 
-      img_copy->GetPixel(x, y) = Sample(u, v);
+        Pixel &p = Row(y)[x];
+        p.r = median[0];
+        p.g = median[1];
+        p.b = median[2];
+      }
     }
-  }
-
-  return img_copy;
+  });
 }
 
-void Image::Fun() { /* WORK HERE */ }
-
 /**
- * Image Sample
+ * Bilateral (bilateral grid approximation)
  **/
-void Image::SetSamplingMethod(int method) {
-  assert((method >= 0) && (method < IMAGE_N_SAMPLING_METHODS));
-  sampling_method = method;
+namespace {
+// Below this spatial sigma the grid has about as many cells as the image,
+// so the filter is evaluated directly over a window instead
+const double BILATERAL_GRID_MIN_SIGMA = 4;
+// The range axis is sampled at least this coarsely; finer sampling only
+// adds memory
+const int BILATERAL_MAX_RANGE_CELLS = 64;
+const size_t BILATERAL_MAX_GRID_BYTES = (size_t)1 << 30;
+
+// Exact bilateral filter of each channel over a window of 2 sigma_s. Reads
+// src and writes dst, which must not share pixels.
+void BilateralDirect(const Image &src, const Image &dst, double sigma_s,
+                     double sigma_r, TuneScope &tune) {
+  int w = src.Width(), h = src.Height();
+  int r = (int)ceil(2 * sigma_s), diam = 2 * r + 1;
+  std::vector<float> spatial(diam * diam), range(256);
+  for (int dy = -r; dy <= r; dy++)
+    for (int dx = -r; dx <= r; dx++)
+      spatial[(dy + r) * diam + dx + r] =
+          exp(-(dx * dx + dy * dy) / (2 * sigma_s * sigma_s));
+  for (int d = 0; d < 256; d++)
+    range[d] = exp(-d * d / (2 * sigma_r * sigma_r));
+
+  ParallelForTiles(w, h, tune.TileW(256), tune.TileH(64),
+                   [&](int x0, int y0, int x1, int y1) {
+    for (int y = y0; y < y1; y++) {
+      Pixel *out = dst.Row(y);
+      for (int x = x0; x < x1; x++) {
+        const Pixel &center = src.Row(y)[x];
+        float value[3] = {0, 0, 0}, weight[3] = {0, 0, 0};
+        for (int yy = std::max(y - r, 0); yy <= std::min(y + r, h - 1); yy++) {
+          const Pixel *row = src.Row(yy);
+          const float *ws = &spatial[(yy - y + r) * diam + r - x];
+          for (int xx = std::max(x - r, 0); xx <= std::min(x + r, w - 1);
+               xx++) {
+            const Pixel &p = row[xx];
+            float t[3] = {ws[xx] * range[std::abs(p.r - center.r)],
+                          ws[xx] * range[std::abs(p.g - center.g)],
+                          ws[xx] * range[std::abs(p.b - center.b)]};
+            value[0] += t[0] * p.r, weight[0] += t[0];
+            value[1] += t[1] * p.g, weight[1] += t[1];
+            value[2] += t[2] * p.b, weight[2] += t[2];
+          }
+        }
+        // The center itself has weight 1, so no weight is zero
+        out[x].r = ComponentClamp((int)(value[0] / weight[0] + 0.5f));
+        out[x].g = ComponentClamp((int)(value[1] / weight[1] + 0.5f));
+        out[x].b = ComponentClamp((int)(value[2] / weight[2] + 0.5f));
+      }
+    }
+  });
 }
 
-Pixel GaussianSample(int x, int y, Image &image) {
-  int n = 2;
-  int size = 2 * n + 1;
-  double sigma = n / 2.0;
-  double sum = 0.0;
+// Blurs every line of the grid along one axis with a [1 2 1] / 4 tent.
+// Lines start at base(line) and have len cells spaced stride apart; each
+// cell holds a (weighted value, weight) pair.
+void BlurGridAxis(std::vector<float> &grid, int num_lines, int len,
+                  size_t stride, const std::function<size_t(int)> &base) {
+  ParallelFor(0, num_lines, [&](int b, int e) {
+    std::vector<float> line(2 * (len + 2), 0.0f);
+    for (int l = b; l < e; l++) {
+      size_t start = base(l);
+      for (int i = 0; i < len; i++) {
+        line[2 * (i + 1)] = grid[2 * (start + i * stride)];
+        line[2 * (i + 1) + 1] = grid[2 * (start + i * stride) + 1];
+      }
+      for (int i = 0; i < len; i++) {
+        for (int k = 0; k < 2; k++) {
+          grid[2 * (start + i * stride) + k] =
+              0.25f * line[2 * i + k] + 0.5f * line[2 * (i + 1) + k] +
+              0.25f * line[2 * (i + 2) + k];
+        }
+      }
+    }
+  });
+}
+} // namespace
+
+// Follows Paris & Durand: each channel is splatted into a coarse
+// (x, y, value) grid with one cell per sigma, the grid is blurred, and the
+// output is read back with trilinear interpolation. The grid size, not the
+// spatial sigma, sets the blur cost. Small spatial sigmas, whose grid would
+// be as large as the image times the range cells, are filtered directly.
+void Image::Bilateral(double sigma_s, double sigma_r) {
+  TuneScope tune("bilateral");
+  if (IsPacked())
+    Unpack();
+  sigma_s = std::max(sigma_s, 1.0);
+  sigma_r = std::max(sigma_r, 1.0);
+
+  if (sigma_s < BILATERAL_GRID_MIN_SIGMA) {
+    Image src(*this);
+    BilateralDirect(src, *this, sigma_s, sigma_r, tune);
+    return;
+  }
 
-  if (not image.ValidCoord(x, y)) {
-    return Pixel();
+  int w = Width(), h = Height();
+  double range_step = std::max(sigma_r, 255.0 / BILATERAL_MAX_RANGE_CELLS);
+  // One padding cell on each side keeps the blur and the slice in range
+  int gw = (int)((w - 1) / sigma_s + 0.5) + 3;
+  int gh = (int)((h - 1) / sigma_s + 0.5) + 3;
+  int gd = (int)(255 / range_step + 0.5) + 3;
+  size_t cells = (size_t)gw * gh * gd;
+  if (2 * cells * sizeof(float) > BILATERAL_MAX_GRID_BYTES)
+    throw std::runtime_error("Bilateral: a " + std::to_string(w) + "x" +
+                             std::to_string(h) +
+                             " image needs a larger spatial sigma");
+  auto cell = [&](int gx, int gy, int gz) {
+    return ((size_t)gy * gw + gx) * gd + gz;
+  };
+
+  // Grid row of every image row, so each grid row is splatted by one thread
+  std::vector<int> row_cell(h);
+  for (int y = 0; y < h; y++)
+    row_cell[y] = (int)(y / sigma_s + 0.5) + 1;
+
+  std::vector<float> grid(2 * cells);
+  for (int c = 0; c < 3; c++) {
+    std::fill(grid.begin(), grid.end(), 0.0f);
+
+    ParallelFor(1, gh - 1, [&](int b, int e) {
+      int y = std::lower_bound(row_cell.begin(), row_cell.end(), b) -
+              row_cell.begin();
+      for (; y < h && row_cell[y] < e; y++) {
+        const Component *row = &Row(y)->r + c;
+        for (int x = 0; x < w; x++) {
+          int v = row[4 * x];
+          size_t i = cell((int)(x / sigma_s + 0.5) + 1, row_cell[y],
+                          (int)(v / range_step + 0.5) + 1);
+          grid[2 * i] += v;
+          grid[2 * i + 1] += 1.0f;
+        }
+      }
+    });
+
+    BlurGridAxis(grid, gh * gd, gw, gd, [&](int l) {
+      return cell(0, l / gd, l % gd);
+    });
+    BlurGridAxis(grid, gw * gd, gh, (size_t)gw * gd, [&](int l) {
+      return cell(l / gd, 0, l % gd);
+    });
+    BlurGridAxis(grid, gw * gh, gd, 1, [&](int l) {
+      return cell(l % gw, l / gw, 0);
+    });
+
+    ParallelForTiles(w, h, tune.TileW(256), tune.TileH(64),
+                     [&](int x0, int y0, int x1, int y1) {
+      for (int y = y0; y < y1; y++) {
+        float fy = y / sigma_s + 1;
+        int iy = (int)fy;
+        float ty = fy - iy;
+        Component *row = &Row(y)->r + c;
+        for (int x = x0; x < x1; x++) {
+          float fx = x / sigma_s + 1;
+          int ix = (int)fx;
+          float tx = fx - ix;
+          float fz = row[4 * x] / range_step + 1;
+          int iz = (int)fz;
+          float tz = fz - iz;
+
+          float value = 0, weight = 0;
+          for (int corner = 0; corner < 8; corner++) {
+            int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+            float t = (dx ? tx : 1 - tx) * (dy ? ty : 1 - ty) *
+                      (dz ? tz : 1 - tz);
+            size_t i = cell(ix + dx, iy + dy, iz + dz);
+            value += t * grid[2 * i];
+            weight += t * grid[2 * i + 1];
+          }
+          if (weight > 0)
+            row[4 * x] = ComponentClamp((int)(value / weight + 0.5f));
+        }
+      }
+    });
   }
+}
 
-  std::vector<std::vector<double>> kernel(size, std::vector<double>(size));
-  for (int i = -n; i <= n; i++) {
-    for (int j = -n; j <= n; j++) {
-      double exponent = -(i * i + j * j) / (2 * sigma * sigma);
-      double value = exp(exponent);
-      kernel[i + n][j + n] = value;
-      sum += value;
+/**
+ * Resampling
+ **/
+namespace {
+// Output tiles are small enough that the source pixels they sample, at any
+// rotation, stay in cache while the tile is filled
+const int RESAMPLE_TILE = 64;
+
+const int GAUSSIAN_SAMPLE_RADIUS = 1;
+// Taps per axis: the radius on either side of a sample position, which
+// falls between the third and fourth tap
+const int GAUSSIAN_SAMPLE_TAPS = 2 * GAUSSIAN_SAMPLE_RADIUS + 2;
+// Sample positions are rounded to 1/64 of a pixel
+const int GAUSSIAN_SAMPLE_PHASES = 64;
+
+// The Gaussian is separable, so each axis takes a 1D table per phase:
+// w[p][k] weighs tap x0 - radius + k of a sample at x0 + p / phases. Sigma
+// is radius / 2, and each phase is normalized. Built once.
+struct GaussianSampleWeights {
+  float w[GAUSSIAN_SAMPLE_PHASES][GAUSSIAN_SAMPLE_TAPS];
+
+  GaussianSampleWeights() {
+    double sigma = GAUSSIAN_SAMPLE_RADIUS / 2.0;
+    for (int p = 0; p < GAUSSIAN_SAMPLE_PHASES; p++) {
+      double k[GAUSSIAN_SAMPLE_TAPS], sum = 0.0;
+      for (int i = 0; i < GAUSSIAN_SAMPLE_TAPS; i++) {
+        double d =
+            i - GAUSSIAN_SAMPLE_RADIUS - (double)p / GAUSSIAN_SAMPLE_PHASES;
+        k[i] = exp(-d * d / (2 * sigma * sigma));
+        sum += k[i];
+      }
+      for (int i = 0; i < GAUSSIAN_SAMPLE_TAPS; i++)
+        w[p][i] = k[i] / sum;
     }
   }
+};
+const GaussianSampleWeights gaussian_sample_weights;
+
+// Gaussian-weighted average around (u, v), clamped at the borders. Rows
+// are filtered with the horizontal weights first, then the row sums with
+// the vertical ones.
+Pixel SampleGaussian(const ImageView &src, double u, double v) {
+  int x0 = (int)floor(u), y0 = (int)floor(v);
+  if (x0 < 0 || x0 >= src.width || y0 < 0 || y0 >= src.height)
+    return Pixel();
 
-  // Normalize
-  double t = 0;
-  for (int i = 0; i < size; i++) {
-    for (int j = 0; j < size; j++) {
-      kernel[i][j] /= sum;
-      t += kernel[i][j];
+  // A phase that rounds up to a whole pixel starts at the next one
+  int px = (int)((u - x0) * GAUSSIAN_SAMPLE_PHASES + 0.5);
+  int py = (int)((v - y0) * GAUSSIAN_SAMPLE_PHASES + 0.5);
+  if (px == GAUSSIAN_SAMPLE_PHASES)
+    px = 0, x0++;
+  if (py == GAUSSIAN_SAMPLE_PHASES)
+    py = 0, y0++;
+  const float *wx = gaussian_sample_weights.w[px];
+  const float *wy = gaussian_sample_weights.w[py];
+
+  int cols[GAUSSIAN_SAMPLE_TAPS];
+  for (int i = 0; i < GAUSSIAN_SAMPLE_TAPS; i++)
+    cols[i] = std::min(std::max(x0 - GAUSSIAN_SAMPLE_RADIUS + i, 0),
+                       src.width - 1);
+
+  float r = 0, g = 0, b = 0;
+#ifdef __SSE2__
+  // One pixel per register, as floats
+  const __m128i zero = _mm_setzero_si128();
+  __m128 sum = _mm_setzero_ps();
+  for (int j = 0; j < GAUSSIAN_SAMPLE_TAPS; j++) {
+    int y = std::min(std::max(y0 - GAUSSIAN_SAMPLE_RADIUS + j, 0),
+                     src.height - 1);
+    const Pixel *row = src.Row(y);
+    __m128 row_sum = _mm_setzero_ps();
+    for (int i = 0; i < GAUSSIAN_SAMPLE_TAPS; i++) {
+      __m128i p = _mm_cvtsi32_si128(*(const int *)&row[cols[i]]);
+      p = _mm_unpacklo_epi16(_mm_unpacklo_epi8(p, zero), zero);
+      row_sum = _mm_add_ps(row_sum,
+                           _mm_mul_ps(_mm_cvtepi32_ps(p), _mm_set1_ps(wx[i])));
     }
+    sum = _mm_add_ps(sum, _mm_mul_ps(row_sum, _mm_set1_ps(wy[j])));
   }
-
-  double r = 0, g = 0, b = 0;
-  for (int i = -n; i <= n; i++) {
-    for (int j = -n; j <= n; j++) {
-      int xx = std::min(std::max(x + i, 0), image.Width() - 1);
-      int yy = std::min(std::max(y + j, 0), image.Height() - 1);
-
-      // will fail if not valid
-      Pixel p;
-
-      try {
-        p = image.GetPixel(xx, yy);
-      } catch (const std::out_of_range &e) {
-        return Pixel();
-      }
-
-      double weight = kernel[i + n][j + n];
-      r += weight * p.r;
-      g += weight * p.g;
-      b += weight * p.b;
+  float rgba[4];
+  _mm_storeu_ps(rgba, sum);
+  r = rgba[0], g = rgba[1], b = rgba[2];
+#else
+  for (int j = 0; j < GAUSSIAN_SAMPLE_TAPS; j++) {
+    int y = std::min(std::max(y0 - GAUSSIAN_SAMPLE_RADIUS + j, 0),
+                     src.height - 1);
+    const Pixel *row = src.Row(y);
+    float rr = 0, rg = 0, rb = 0;
+    for (int i = 0; i < GAUSSIAN_SAMPLE_TAPS; i++) {
+      const Pixel &p = row[cols[i]];
+      rr += wx[i] * p.r;
+      rg += wx[i] * p.g;
+      rb += wx[i] * p.b;
     }
+    r += wy[j] * rr;
+    g += wy[j] * rg;
+    b += wy[j] * rb;
   }
+#endif
+  // Rounded, so flat areas keep their value despite float round-off
   Pixel p = Pixel();
-  p.SetClamp(r, g, b);
+  p.SetClamp(r + 0.5f, g + 0.5f, b + 0.5f);
   return p;
 }
 
-Pixel Image::Sample(double u, double v) {
-  if (sampling_method == IMAGE_SAMPLING_POINT) { // Nearest Neighbor
-    // printf("samp %d %d\n", (int)u , (int)v );
-    try {
-      Pixel p = GetPixel((int)u, (int)v);
-      // printf("found %d %d %d\n", p.r, p.g, p.b);
-      return p;
-    } catch (const std::out_of_range &e) {
-      // printf("nope %d %d\n", (int)u , (int)v );
+// Samples src at (u, v) with the given method; points outside are black
+Pixel SampleAt(const ImageView &src, int method, double u, double v) {
+  if (method == IMAGE_SAMPLING_POINT) { // Nearest Neighbor
+    int x = (int)u, y = (int)v;
+    if (x < 0 || x >= src.width || y < 0 || y >= src.height)
       return Pixel();
-    }
+    return src.At(x, y);
 
-  } else if (sampling_method == IMAGE_SAMPLING_BILINEAR) { // Bilinear
+  } else if (method == IMAGE_SAMPLING_BILINEAR) { // Bilinear
     // Get the integer and fractional parts
     int x0 = (int)floor(u);
     int y0 = (int)floor(v);
@@ -771,18 +1826,16 @@ Pixel Image::Sample(double u, double v) {
 
     float fx = u - x0; // Fractional part in x
     float fy = v - y0; // Fractional part in y
-    //
-    static int count;
 
     // Check bounds and get the 4 neighboring pixels
-    if (x0 < 0 || x1 >= Width() || y0 < 0 || y1 >= Height()) {
+    if (x0 < 0 || x1 >= src.width || y0 < 0 || y1 >= src.height) {
       return Pixel(); // Out of bounds
     }
 
-    Pixel p00 = GetPixel(x0, y0); // Top-left
-    Pixel p10 = GetPixel(x1, y0); // Top-right
-    Pixel p01 = GetPixel(x0, y1); // Bottom-left
-    Pixel p11 = GetPixel(x1, y1); // Bottom-right
+    const Pixel &p00 = src.At(x0, y0); // Top-left
+    const Pixel &p10 = src.At(x1, y0); // Top-right
+    const Pixel &p01 = src.At(x0, y1); // Bottom-left
+    const Pixel &p11 = src.At(x1, y1); // Bottom-right
 
     // Bilinear interpolation formula
     double r = (1 - fx) * (1 - fy) * p00.r + fx * (1 - fy) * p10.r +
@@ -797,9 +1850,687 @@ Pixel Image::Sample(double u, double v) {
     Pixel result = Pixel();
     result.SetClamp(r, g, b);
     return result;
-  } else if (sampling_method == IMAGE_SAMPLING_GAUSSIAN) { // Gaussian
-    // return the gaussian-weighted average
-    return GaussianSample(u, v, *this);
+  } else if (method == IMAGE_SAMPLING_GAUSSIAN) { // Gaussian
+    return SampleGaussian(src, u, v);
   }
   return Pixel(); // we should never be here
 }
+
+// Fills dst with img sampled at map(x, y) -> (u, v), using img's sampling
+// method. Tiles of dst are filled in parallel. A rotation walks the source
+// at an angle, so filling whole output rows would cross a source row every
+// few pixels and touch a new cache line per sample; a tile reuses the
+// lines it brings in.
+template <class Map>
+void Resample(const Image &img, const ImageView &dst, const Map &map) {
+  TuneScope tune("resample");
+  ImageView src = img.View();
+  ParallelForTiles(dst.width, dst.height, tune.TileW(RESAMPLE_TILE),
+                   tune.TileH(RESAMPLE_TILE),
+                   [&](int x0, int y0, int x1, int y1) {
+                     for (int y = y0; y < y1; y++) {
+                       Pixel *out = dst.Row(y);
+                       for (int x = x0; x < x1; x++) {
+                         float u, v;
+                         map(x, y, u, v);
+                         out[x] = SampleAt(src, img.sampling_method, u, v);
+                       }
+                     }
+                   });
+}
+} // namespace
+
+Image *Image::Scale(double sx, double sy) {
+  Image *img_copy = new Image(Width() * sx, Height() * sy);
+
+  float src_cx = Width() / 2.0f;
+  float src_cy = Height() / 2.0f;
+  float dst_cx = img_copy->Width() / 2.0f;
+  float dst_cy = img_copy->Height() / 2.0f;
+
+  auto map = [&](int x, int y, float &u, float &v) {
+    float dx = x - dst_cx;
+    float dy = y - dst_cy;
+
+    u = dx / sx + src_cx;
+    v = dy / sy + src_cy;
+  };
+  Resample(*this, img_copy->View(), map);
+  return img_copy;
+}
+
+Image *Image::Rotate(double angle) {
+  Image *img_copy = new Image(*this);
+
+  float cx = Width() / 2.0f;
+  float cy = Height() / 2.0f;
+
+  double cos_a = cos(angle);
+  double sin_a = sin(angle);
+
+  auto map = [&](int x, int y, float &u, float &v) {
+    float dx = x - cx;
+    float dy = y - cy;
+
+    u = dx * cos_a + dy * sin_a;
+    v = -dx * sin_a + dy * cos_a;
+
+    u += cx;
+    v += cy;
+  };
+  Resample(*this, img_copy->View(), map);
+  return img_copy;
+}
+
+/**
+ * Morphology (van Herk / Gil-Werman)
+ **/
+namespace {
+const int MORPH_STRIP = 64; // pixels per column strip of the vertical pass
+const int MORPH_BAND = 16;  // rows per band of the horizontal pass
+
+struct MinOp {
+  static const uint8_t identity = 255;
+  uint8_t operator()(uint8_t a, uint8_t b) const { return a < b ? a : b; }
+};
+
+struct MaxOp {
+  static const uint8_t identity = 0;
+  uint8_t operator()(uint8_t a, uint8_t b) const { return a > b ? a : b; }
+};
+
+// Combines windows of k elements along a sequence of n elements, each a run
+// of span bytes that is processed bytewise. Element i starts at
+// data + i * step; output i covers inputs [i - anchor, i - anchor + k),
+// ignoring positions outside the sequence. Inputs are all read before any
+// output is written, so this works in place.
+//
+// The padded sequence is cut into blocks of k. g holds running results
+// from the start of each block and h from its end, so any window, which
+// spans at most two blocks, is op(h[start], g[end]): three operations per
+// element whatever k is.
+template <class Op>
+void VanHerkGilWerman(uint8_t *data, size_t step, int n, int span, int k,
+                      int anchor, std::vector<uint8_t> &g,
+                      std::vector<uint8_t> &h) {
+  Op op;
+  int padded = (n + k - 1 + k - 1) / k * k;
+  g.resize((size_t)padded * span);
+  h.resize((size_t)padded * span);
+  auto input = [&](int p) -> const uint8_t * {
+    int i = p - anchor;
+    return i >= 0 && i < n ? data + i * step : NULL;
+  };
+
+  for (int b = 0; b < padded; b += k) {
+    for (int p = b; p < b + k; p++) {
+      uint8_t *gp = &g[(size_t)p * span];
+      const uint8_t *in = input(p);
+      if (p == b) {
+        if (in)
+          memcpy(gp, in, span);
+        else
+          memset(gp, Op::identity, span);
+      } else if (in) {
+        const uint8_t *prev = gp - span;
+        for (int j = 0; j < span; j++)
+          gp[j] = op(prev[j], in[j]);
+      } else {
+        memcpy(gp, gp - span, span);
+      }
+    }
+    for (int p = b + k - 1; p >= b; p--) {
+      uint8_t *hp = &h[(size_t)p * span];
+      const uint8_t *in = input(p);
+      if (p == b + k - 1) {
+        if (in)
+          memcpy(hp, in, span);
+        else
+          memset(hp, Op::identity, span);
+      } else if (in) {
+        const uint8_t *next = hp + span;
+        for (int j = 0; j < span; j++)
+          hp[j] = op(next[j], in[j]);
+      } else {
+        memcpy(hp, hp + span, span);
+      }
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    const uint8_t *hs = &h[(size_t)i * span];
+    const uint8_t *ge = &g[(size_t)(i + k - 1) * span];
+    uint8_t *out = data + i * step;
+    for (int j = 0; j < span; j++)
+      out[j] = op(hs[j], ge[j]);
+  }
+}
+
+// Applies op over a kw x kh rectangle, as a horizontal then a vertical
+// pass. The vertical pass runs on strips of columns, combining whole row
+// spans at once. The horizontal pass transposes bands of rows (in 8x8
+// tiles) so that it can do the same with one pixel from every row of the
+// band.
+template <class Op>
+void Morph(Image &img, int kw, int kh, bool reflect) {
+  // Erode, Dilate, Open and Close all get here. Both passes read rows from
+  // parallel bands and strips, so a packed image is unpacked up front.
+  if (img.IsPacked())
+    img.Unpack();
+  int w = img.Width(), h = img.Height();
+  // A reflected element mirrors the anchor, which matters for even sizes
+  int ax = reflect ? kw / 2 : (kw - 1) / 2;
+  int ay = reflect ? kh / 2 : (kh - 1) / 2;
+  TuneScope tune("morph");
+  int band_rows = tune.TileH(MORPH_BAND), strip_cols = tune.TileW(MORPH_STRIP);
+
+  if (kw > 1) {
+    int bands = (h + band_rows - 1) / band_rows;
+    ParallelFor(0, bands, [&](int b, int e) {
+      std::vector<Pixel> cols;
+      std::vector<uint8_t> g, hbuf;
+      for (int band = b; band < e; band++) {
+        int y0 = band * band_rows, rows = std::min(band_rows, h - y0);
+        int span = rows * sizeof(Pixel);
+        cols.resize((size_t)w * rows);
+        Transpose(img.Row(y0), img.stride, cols.data(), rows, rows, w);
+        VanHerkGilWerman<Op>((uint8_t *)cols.data(), span, w, span, kw, ax, g,
+                             hbuf);
+        Transpose(cols.data(), rows, img.Row(y0), img.stride, w, rows);
+      }
+    });
+  }
+
+  if (kh > 1) {
+    int strips = (w + strip_cols - 1) / strip_cols;
+    ImageView view = img.View();
+    ParallelFor(0, strips, [&](int b, int e) {
+      std::vector<uint8_t> g, hbuf;
+      for (int s = b; s < e; s++) {
+        int x0 = s * strip_cols, cols = std::min(strip_cols, w - x0);
+        VanHerkGilWerman<Op>((uint8_t *)view.Row(0) + x0 * sizeof(Pixel),
+                             view.stride * sizeof(Pixel), h,
+                             cols * sizeof(Pixel), kh, ay, g, hbuf);
+      }
+    });
+  }
+}
+} // namespace
+
+void Image::Erode(int kw, int kh) { Morph<MinOp>(*this, kw, kh, false); }
+
+void Image::Dilate(int kw, int kh) { Morph<MaxOp>(*this, kw, kh, true); }
+
+void Image::Open(int kw, int kh) {
+  Erode(kw, kh);
+  Dilate(kw, kh);
+}
+
+void Image::Close(int kw, int kh) {
+  Dilate(kw, kh);
+  Erode(kw, kh);
+}
+
+/**
+ * Kuwahara
+ **/
+namespace {
+const int KUWAHARA_TILE = 128;
+const int FUN_RADIUS = 5;
+} // namespace
+
+// Generalized Kuwahara filter (Papari et al.): instead of copying the mean
+// of the quadrant with the lowest variance, the four quadrant means are
+// blended with weights 1 / (1 + (variance / 255)^4), which avoids the
+// blockiness of the hard choice. Each tile builds summed-area tables of the
+// values and squared values of the area it reads, so every quadrant's mean
+// and variance take a handful of lookups. Quadrants are clipped to the
+// image.
+void Image::Kuwahara(int r) {
+  if (r <= 0)
+    return;
+
+  TuneScope tune("kuwahara");
+  // A packed copy would be unpacked by the tile workers on first touch
+  if (IsPacked())
+    Unpack();
+  Image src(*this);
+  int w = Width(), h = Height();
+
+  ParallelForTiles(w, h, tune.TileW(KUWAHARA_TILE), tune.TileH(KUWAHARA_TILE),
+                   [&](int x0, int y0, int x1, int y1) {
+    // Entry (i, j) holds the sums of r, g, b, r^2, g^2, b^2 over image
+    // pixels [ax, ax + i) x [ay, ay + j)
+    int ax = std::max(x0 - r, 0), ay = std::max(y0 - r, 0);
+    int sw = std::min(x1 + r, w) - ax + 1, sh = std::min(y1 + r, h) - ay + 1;
+    std::vector<int64_t> sat((size_t)sw * sh * 6, 0);
+    for (int j = 1; j < sh; j++) {
+      const Pixel *row = src.Row(ay + j - 1);
+      int64_t run[6] = {0};
+      int64_t *above = &sat[(size_t)(j - 1) * sw * 6];
+      int64_t *cur = &sat[(size_t)j * sw * 6];
+      for (int i = 1; i < sw; i++) {
+        const Pixel &p = row[ax + i - 1];
+        run[0] += p.r, run[1] += p.g, run[2] += p.b;
+        run[3] += p.r * p.r, run[4] += p.g * p.g, run[5] += p.b * p.b;
+        for (int c = 0; c < 6; c++)
+          cur[i * 6 + c] = above[i * 6 + c] + run[c];
+      }
+    }
+
+    for (int y = y0; y < y1; y++) {
+      Pixel *out = Row(y);
+      for (int x = x0; x < x1; x++) {
+        double num[3] = {0, 0, 0}, den = 0;
+        for (int q = 0; q < 4; q++) {
+          int qx0 = std::max(q & 1 ? x : x - r, 0) - ax;
+          int qx1 = std::min(q & 1 ? x + r : x, w - 1) + 1 - ax;
+          int qy0 = std::max(q & 2 ? y : y - r, 0) - ay;
+          int qy1 = std::min(q & 2 ? y + r : y, h - 1) + 1 - ay;
+          const int64_t *s00 = &sat[((size_t)qy0 * sw + qx0) * 6];
+          const int64_t *s01 = &sat[((size_t)qy0 * sw + qx1) * 6];
+          const int64_t *s10 = &sat[((size_t)qy1 * sw + qx0) * 6];
+          const int64_t *s11 = &sat[((size_t)qy1 * sw + qx1) * 6];
+          double inv_n = 1.0 / ((qx1 - qx0) * (qy1 - qy0));
+
+          double mean[3], var = 0;
+          for (int c = 0; c < 3; c++) {
+            mean[c] = (s11[c] - s01[c] - s10[c] + s00[c]) * inv_n;
+            double sq = (s11[c + 3] - s01[c + 3] - s10[c + 3] + s00[c + 3]) *
+                        inv_n;
+            var += std::max(sq - mean[c] * mean[c], 0.0);
+          }
+          double s = var / 255, s2 = s * s;
+          double weight = 1 / (1 + s2 * s2);
+          for (int c = 0; c < 3; c++)
+            num[c] += weight * mean[c];
+          den += weight;
+        }
+        out[x].SetClamp(num[0] / den + 0.5, num[1] / den + 0.5,
+                        num[2] / den + 0.5);
+      }
+    }
+  });
+}
+
+void Image::Fun() { Kuwahara(FUN_RADIUS); }
+
+/**
+ * Seam carving
+ **/
+namespace {
+// The cost rows are filled in bands of SEAM_BAND rows, split into tiles of
+// SEAM_TILE columns. Tiles must be at least twice as wide as bands are tall.
+const int SEAM_BAND = 32;
+const int SEAM_TILE = 256;
+
+// Removes the cheapest vertical seam from a w x h buffer, whose rows are
+// stride pixels apart, until it is target pixels wide. Energy is the
+// gradient magnitude |dL/dx| + |dL/dy| of the luminance.
+//
+// The cumulative cost is rebuilt for every seam, one row at a time with
+// the row split across threads. Energy is only recomputed where removing
+// the seam changed a pixel's neighbours: next to the seam, and between
+// the seam's columns in adjacent rows.
+void CarveColumns(Pixel *pixels, int stride, int w, int h, int target) {
+  std::vector<uint8_t> luma((size_t)stride * h);
+  std::vector<uint16_t> energy((size_t)stride * h); // at most 2 * 255
+  std::vector<int> cost((size_t)stride * h);
+  std::vector<int> seam(h);
+
+  // Gradient magnitude of the luma at (x, y) in an image width pixels wide
+  auto energy_at = [&](int x, int y, int width) {
+    const uint8_t *row = &luma[(size_t)y * stride];
+    int left = row[std::max(x - 1, 0)];
+    int right = row[std::min(x + 1, width - 1)];
+    int up = luma[(size_t)std::max(y - 1, 0) * stride + x];
+    int down = luma[(size_t)std::min(y + 1, h - 1) * stride + x];
+    return std::abs(right - left) + std::abs(down - up);
+  };
+
+  ParallelFor(0, h, [&](int b, int e) {
+    for (int y = b; y < e; y++) {
+      Pixel *row = pixels + (size_t)y * stride;
+      for (int x = 0; x < w; x++)
+        luma[(size_t)y * stride + x] = row[x].Luminance();
+    }
+  });
+  ParallelFor(0, h, [&](int b, int e) {
+    for (int y = b; y < e; y++)
+      for (int x = 0; x < w; x++)
+        energy[(size_t)y * stride + x] = energy_at(x, y, w);
+  });
+
+  // Cheapest seam cost for columns [x0, x1) of row y, from row y - 1
+  auto relax = [&](int y, int x0, int x1) {
+    const int *prev = &cost[(size_t)(y - 1) * stride];
+    const uint16_t *e = &energy[(size_t)y * stride];
+    int *cur = &cost[(size_t)y * stride];
+    for (int x = x0; x < x1; x++) {
+      int best = prev[x];
+      if (x > 0)
+        best = std::min(best, prev[x - 1]);
+      if (x + 1 < w)
+        best = std::min(best, prev[x + 1]);
+      cur[x] = e[x] + best;
+    }
+  };
+
+  for (; w > target; w--) {
+    std::copy(&energy[0], &energy[w], &cost[0]);
+    // Trapezoid tiling: in each band, a tile's rows shrink by one column
+    // per row at its inner edges, so it only needs the band above and its
+    // own rows. The triangles left between neighbouring tiles then only
+    // need the finished tiles. That is two parallel loops per band rather
+    // than one per row, which was too fine to pay off.
+    int tiles = (w + SEAM_TILE - 1) / SEAM_TILE;
+    for (int y0 = 1; y0 < h; y0 += SEAM_BAND) {
+      int y1 = std::min(y0 + SEAM_BAND, h);
+      ParallelFor(0, tiles, [&](int begin, int end) {
+        for (int t = begin; t < end; t++) {
+          int x0 = t * SEAM_TILE, x1 = std::min(x0 + SEAM_TILE, w);
+          for (int y = y0; y < y1; y++)
+            relax(y, x0 > 0 ? x0 + (y - y0) : 0, x1 < w ? x1 - (y - y0) : w);
+        }
+      });
+      ParallelFor(1, tiles, [&](int begin, int end) {
+        for (int t = begin; t < end; t++) {
+          int edge = t * SEAM_TILE;
+          for (int y = y0; y < y1; y++)
+            relax(y, edge - (y - y0), std::min(edge + (y - y0), w));
+        }
+      });
+    }
+
+    // Walk back up from the cheapest end, preferring to go straight
+    const int *last = &cost[(size_t)(h - 1) * stride];
+    int x = std::min_element(last, last + w) - last;
+    for (int y = h - 1; y >= 0; y--) {
+      seam[y] = x;
+      if (y == 0)
+        break;
+      const int *prev = &cost[(size_t)(y - 1) * stride];
+      int next = x;
+      if (x > 0 && prev[x - 1] < prev[next])
+        next = x - 1;
+      if (x + 1 < w && prev[x + 1] < prev[next])
+        next = x + 1;
+      x = next;
+    }
+
+    ParallelFor(0, h, [&](int b, int e) {
+      for (int y = b; y < e; y++) {
+        size_t row = (size_t)y * stride;
+        int s = seam[y], tail = w - s - 1;
+        memmove(pixels + row + s, pixels + row + s + 1, tail * sizeof(Pixel));
+        memmove(&luma[row + s], &luma[row + s + 1], tail);
+        memmove(&energy[row + s], &energy[row + s + 1],
+                tail * sizeof(uint16_t));
+      }
+    });
+
+    // A pixel's horizontal neighbours changed if it was next to the seam,
+    // its vertical ones if the seam passes it in only one of the two rows
+    const int cur_w = w - 1;
+    ParallelFor(0, h, [&](int b, int e) {
+      for (int y = b; y < e; y++) {
+        int lo = seam[y], hi = seam[y];
+        if (y > 0)
+          lo = std::min(lo, seam[y - 1]), hi = std::max(hi, seam[y - 1]);
+        if (y + 1 < h)
+          lo = std::min(lo, seam[y + 1]), hi = std::max(hi, seam[y + 1]);
+        for (int x = std::max(lo - 1, 0); x <= std::min(hi, cur_w - 1); x++)
+          energy[(size_t)y * stride + x] = energy_at(x, y, cur_w);
+      }
+    });
+  }
+}
+} // namespace
+
+Image *Image::SeamCarve(int new_width, int new_height) {
+  assert(new_width >= 1 && new_width <= Width());
+  assert(new_height >= 1 && new_height <= Height());
+  int w = Width(), h = Height();
+  Image *result = new Image(new_width, new_height);
+
+  std::vector<Pixel> buf((size_t)w * h);
+  for (int y = 0; y < h; y++)
+    memcpy(&buf[(size_t)y * w], Row(y), w * sizeof(Pixel));
+  CarveColumns(buf.data(), w, w, h, new_width);
+
+  // Rows are carved as the columns of the transposed image
+  if (new_height < h) {
+    std::vector<Pixel> transposed((size_t)new_width * h);
+    Transpose(buf.data(), w, transposed.data(), h, h, new_width);
+    CarveColumns(transposed.data(), h, h, new_width, new_height);
+    Transpose(transposed.data(), h, result->Row(0), result->stride, new_width,
+              new_height);
+  } else {
+    for (int y = 0; y < h; y++)
+      memcpy(result->Row(y), &buf[(size_t)y * w], new_width * sizeof(Pixel));
+  }
+  return result;
+}
+
+/**
+ * Multi-band blending (Burt-Adelson pyramids)
+ **/
+namespace {
+const int BLEND_ROWS = 8; // output rows per task
+
+// One pyramid level of floats, "channels" per pixel, in a pooled buffer
+struct PyramidLevel {
+  int width, height, channels;
+  float *data;
+
+  PyramidLevel(int w, int h, int c) : width(w), height(h), channels(c) {
+    data = (float *)AllocPixels(Bytes());
+  }
+  ~PyramidLevel() { FreePixels((uint8_t *)data, Bytes()); }
+  PyramidLevel(const PyramidLevel &) = delete;
+  PyramidLevel &operator=(const PyramidLevel &) = delete;
+
+  size_t Bytes() const {
+    return (size_t)width * height * channels * sizeof(float);
+  }
+  float *Row(int y) const { return data + (size_t)y * width * channels; }
+};
+
+typedef std::vector<std::unique_ptr<PyramidLevel>> Pyramid;
+
+// Loads row y of a level as floats; level 0 is read from the 8-bit image
+typedef std::function<void(int y, float *out)> RowLoader;
+
+RowLoader LevelRows(const PyramidLevel &level) {
+  return [&level](int y, float *out) {
+    memcpy(out, level.Row(y), level.width * level.channels * sizeof(float));
+  };
+}
+
+// RGB of an image, or the mean of RGB scaled to 0..1 for a mask
+RowLoader ImageRows(const ImageView &view, bool mask) {
+  return [view, mask](int y, float *out) {
+    const Pixel *row = view.Row(y);
+    for (int x = 0; x < view.width; x++) {
+      if (mask) {
+        out[x] = (row[x].r + row[x].g + row[x].b) * (1.0f / (3 * 255));
+      } else {
+        out[3 * x] = row[x].r;
+        out[3 * x + 1] = row[x].g;
+        out[3 * x + 2] = row[x].b;
+      }
+    }
+  };
+}
+
+// Blurs a w x h level with the 5-tap binomial kernel and drops every other
+// row and column. Each output row filters five input rows vertically, then
+// the result horizontally. Input rows are kept in a ring, since consecutive
+// output rows share three of them.
+template <int C>
+void Reduce(const RowLoader &load, int w, int h, PyramidLevel &dst) {
+  ParallelFor(0, dst.height, [&](int b, int e) {
+    std::vector<float> rows(5 * (size_t)w * C), sum((size_t)w * C);
+    int loaded[5] = {-1, -1, -1, -1, -1};
+    for (int y = b; y < e; y++) {
+      const float *r[5];
+      for (int k = 0; k < 5; k++) {
+        int sy = std::min(std::max(2 * y + k - 2, 0), h - 1);
+        float *slot = &rows[(sy % 5) * (size_t)w * C];
+        if (loaded[sy % 5] != sy) {
+          load(sy, slot);
+          loaded[sy % 5] = sy;
+        }
+        r[k] = slot;
+      }
+      for (int i = 0; i < w * C; i++)
+        sum[i] = (r[0][i] + 4 * r[1][i] + 6 * r[2][i] + 4 * r[3][i] + r[4][i]) *
+                 0.0625f;
+
+      float *out = dst.Row(y);
+      for (int x = 0; x < dst.width; x++) {
+        int x0 = std::max(2 * x - 2, 0), x1 = std::max(2 * x - 1, 0);
+        int x3 = std::min(2 * x + 1, w - 1), x4 = std::min(2 * x + 2, w - 1);
+        for (int c = 0; c < C; c++)
+          out[x * C + c] = (sum[x0 * C + c] + 4 * sum[x1 * C + c] +
+                            6 * sum[2 * x * C + c] + 4 * sum[x3 * C + c] +
+                            sum[x4 * C + c]) *
+                           0.0625f;
+      }
+    }
+  }, BLEND_ROWS);
+}
+
+// Row y of src upsampled to twice its size (cropped to w pixels) with the
+// same kernel: even samples take 1-6-1 of their neighbours, odd ones the
+// mean of the two on either side
+template <int C>
+void ExpandRow(const PyramidLevel &src, int y, int w, float *tmp, float *out) {
+  int sw = src.width, i = y / 2;
+  const float *mid = src.Row(std::min(i, src.height - 1));
+  if (y % 2 == 0) {
+    const float *up = src.Row(std::max(i - 1, 0));
+    const float *down = src.Row(std::min(i + 1, src.height - 1));
+    for (int k = 0; k < sw * C; k++)
+      tmp[k] = (up[k] + 6 * mid[k] + down[k]) * 0.125f;
+  } else {
+    const float *down = src.Row(std::min(i + 1, src.height - 1));
+    for (int k = 0; k < sw * C; k++)
+      tmp[k] = (mid[k] + down[k]) * 0.5f;
+  }
+  for (int j = 0; 2 * j < w; j++) {
+    int left = std::max(j - 1, 0), right = std::min(j + 1, sw - 1);
+    for (int c = 0; c < C; c++)
+      out[2 * j * C + c] =
+          (tmp[left * C + c] + 6 * tmp[j * C + c] + tmp[right * C + c]) *
+          0.125f;
+    if (2 * j + 1 < w)
+      for (int c = 0; c < C; c++)
+        out[(2 * j + 1) * C + c] = (tmp[j * C + c] + tmp[right * C + c]) * 0.5f;
+  }
+}
+
+// Gaussian pyramid levels 1 .. levels - 1 of a w x h source
+Pyramid GaussianPyramid(const RowLoader &base, int w, int h, int channels,
+                        int levels) {
+  Pyramid pyramid;
+  for (int l = 1; l < levels; l++) {
+    pyramid.emplace_back(new PyramidLevel((w + 1) / 2, (h + 1) / 2, channels));
+    const RowLoader &load = l == 1 ? base : LevelRows(*pyramid[l - 2]);
+    if (channels == 3)
+      Reduce<3>(load, w, h, *pyramid.back());
+    else
+      Reduce<1>(load, w, h, *pyramid.back());
+    w = pyramid.back()->width;
+    h = pyramid.back()->height;
+  }
+  return pyramid;
+}
+} // namespace
+
+// The Laplacian levels of both images are never stored. Collapsing from the
+// top, each level of the result is
+//   R[l] = (1 - M[l]) (A[l] - E(A[l+1])) + M[l] (B[l] - E(B[l+1])) + E(R[l+1])
+// where A, B and M are Gaussian pyramids and E expands a level, so one pass
+// per level computes the three expansions row by row and blends them.
+void Image::Blend(const Image &other, const Image &mask, int levels) {
+  assert(other.Width() == Width() && other.Height() == Height());
+  assert(mask.Width() == Width() && mask.Height() == Height());
+  int w = Width(), h = Height();
+  // Stop once the coarsest level is down to one pixel
+  int count = 1;
+  for (int lw = w, lh = h; count < levels && (lw > 1 || lh > 1); count++)
+    lw = (lw + 1) / 2, lh = (lh + 1) / 2;
+  levels = count;
+
+  ImageView view = View();
+  RowLoader base_a = ImageRows(view, false);
+  RowLoader base_b = ImageRows(other.View(), false);
+  RowLoader base_m = ImageRows(mask.View(), true);
+  Pyramid a = GaussianPyramid(base_a, w, h, 3, levels);
+  Pyramid b = GaussianPyramid(base_b, w, h, 3, levels);
+  Pyramid m = GaussianPyramid(base_m, w, h, 1, levels);
+
+  // Blend at the coarsest level, then collapse towards level 0, which is
+  // written straight into this image
+  std::unique_ptr<PyramidLevel> result;
+  for (int l = levels - 1; l >= 0; l--) {
+    int lw = l ? a[l - 1]->width : w, lh = l ? a[l - 1]->height : h;
+    RowLoader load_a = l ? LevelRows(*a[l - 1]) : base_a;
+    RowLoader load_b = l ? LevelRows(*b[l - 1]) : base_b;
+    RowLoader load_m = l ? LevelRows(*m[l - 1]) : base_m;
+    bool top = l == levels - 1;
+    std::unique_ptr<PyramidLevel> next(l ? new PyramidLevel(lw, lh, 3) : NULL);
+
+    ParallelFor(0, lh, [&](int begin, int end) {
+      std::vector<float> ga(3 * lw), gb(3 * lw), gm(lw);
+      std::vector<float> ea(3 * lw), eb(3 * lw), er(3 * lw), tmp(3 * lw);
+      for (int y = begin; y < end; y++) {
+        load_a(y, ga.data());
+        load_b(y, gb.data());
+        load_m(y, gm.data());
+        if (!top) {
+          ExpandRow<3>(*a[l], y, lw, tmp.data(), ea.data());
+          ExpandRow<3>(*b[l], y, lw, tmp.data(), eb.data());
+          ExpandRow<3>(*result, y, lw, tmp.data(), er.data());
+          for (int i = 0; i < 3 * lw; i++)
+            ga[i] -= ea[i], gb[i] -= eb[i];
+        }
+        // The blend, plus the expanded result of the level above
+        float *out = l ? next->Row(y) : ga.data();
+        for (int x = 0; x < lw; x++) {
+          float t = gm[x];
+          for (int c = 0; c < 3; c++) {
+            int i = 3 * x + c;
+            out[i] = (1 - t) * ga[i] + t * gb[i] + (top ? 0 : er[i]);
+          }
+        }
+        if (l == 0) {
+          Pixel *row = view.Row(y);
+          for (int x = 0; x < lw; x++)
+            row[x].Set(ComponentClamp((int)lrintf(out[3 * x])),
+                       ComponentClamp((int)lrintf(out[3 * x + 1])),
+                       ComponentClamp((int)lrintf(out[3 * x + 2])));
+        }
+      }
+    }, BLEND_ROWS);
+    result = std::move(next);
+  }
+}
+
+/**
+ * Image Sample
+ **/
+void Image::SetPNGLevel(int level) {
+  assert(level >= 0 && level <= 9);
+  png_level = level;
+}
+
+void Image::SetSamplingMethod(int method) {
+  assert((method >= 0) && (method < IMAGE_N_SAMPLING_METHODS));
+  sampling_method = method;
+}
+
+Pixel Image::Sample(double u, double v) {
+  return SampleAt(View(), sampling_method, u, v);
+}
@@ -8,8 +8,10 @@
 #ifndef IMAGE_INCLUDED
 #define IMAGE_INCLUDED
 
+#include "packed.h"
 #include "pixel.h"
 #include <assert.h>
+#include <atomic>
 #include <stdexcept>
 #include <stdio.h>
 
@@ -34,6 +36,19 @@ enum {
   IMAGE_N_CHANNELS
 };
 
+/**
+ * ImageView
+ **/
+// A non-owning window into the pixels of another image. Rows are "stride"
+// pixels apart, so a view can cover a sub-rectangle without copying it.
+struct ImageView {
+  Pixel *pixels;
+  int width, height, stride;
+
+  Pixel &At(int x, int y) const { return pixels[y * stride + x]; }
+  Pixel *Row(int y) const { return pixels + y * stride; }
+};
+
 /**
  * Image
  **/
@@ -48,12 +63,20 @@ public:
     uint8_t *raw;
   };
 
-  PixelData data;
+  // Both are mutable so that const pixel access can unpack a packed image.
+  // packed is atomic because that first access may come from several
+  // threads at once; Unpack serializes them.
+  mutable PixelData data;
+  mutable std::atomic<PackedPixels *> packed{nullptr}; // set while packed
   // PixelInfo *pixels; //pixel array
   // uint8_t *pixelData;
   int width, height, num_pixels;
+  int stride;             // pixels between the starts of consecutive rows
+  bool owns_data = true;  // false when wrapping another image's pixels
+  bool cache_mapped = false; // pixels are a private map of a cache entry
   int sampling_method;
   int export_depth = 8;
+  int png_level = 6; // zlib level of PNG output
 
 public:
   // Creates a blank image with the given dimensions
@@ -65,6 +88,10 @@ public:
   // Make image from file
   Image(char *fname);
 
+  // Wraps the pixels of a view without copying them. The view's owner must
+  // outlive this image.
+  explicit Image(const ImageView &view);
+
   // Destructor
   ~Image();
 
@@ -73,8 +100,10 @@ public:
     return x >= 0 && x < width && y >= 0 && y < height;
   }
   Pixel &GetPixel(int x, int y) const {
+    if (packed)
+      Unpack();
     if (ValidCoord(x, y)) {
-      return data.pixels[y * width + x];
+      return data.pixels[y * stride + x];
     } else {
       throw std::out_of_range("GetPixel: coordinates (" + std::to_string(x) +
                               ", " + std::to_string(y) +
@@ -83,10 +112,33 @@ public:
     }
   }
   void SetPixel(int x, int y, Pixel p) const {
+    if (packed)
+      Unpack();
     assert(ValidCoord(x, y));
-    data.pixels[y * width + x] = p;
+    data.pixels[y * stride + x] = p;
   }
 
+  // Row access, honoring the stride of cropped views
+  Pixel *Row(int y) const {
+    if (packed)
+      Unpack();
+    return data.pixels + y * stride;
+  }
+
+  // A view of the whole image
+  ImageView View() const { return ImageView{Row(0), width, height, stride}; }
+
+  // Quantize and the dithers keep images with at most PACKED_MAX_BITS per
+  // channel bit-packed. Pixel access unpacks them back to 8 bits.
+  bool IsPacked() const { return packed != nullptr; }
+  void Unpack() const;
+
+  // Switches to the given packed pixels, freeing the 8-bit buffer
+  void AdoptPacked(PackedPixels *p);
+
+  // Frees the 8-bit buffer, or unmaps it when it came from the image cache
+  void FreeData();
+
   // Dimension access
   int Width() const { return width; }
   int Height() const { return height; }
@@ -95,6 +147,9 @@ public:
   // Make file from image
   void Write(char *fname);
 
+  // Sets the zlib compression level (0..9) used when writing PNG files
+  void SetPNGLevel(int level);
+
   // Adds noise to an image.  The amount of noise is given by the factor
   // in the range [0.0..1.0].  0.0 adds no noise.  1.0 adds a lot of noise.
   void AddNoise(double factor);
@@ -120,9 +175,10 @@ public:
 
   /**
    * Extracts a sub image from the image, at position (x, y), width w,
-   * and height h.
+   * and height h. The result shares this image's pixels; wrap it in an
+   * Image to filter it in place, or copy that Image to materialize it.
    **/
-  Image *Crop(int x, int y, int w, int h);
+  ImageView Crop(int x, int y, int w, int h) const;
 
   /**
    * Extracts a channel of an image.  Leaves the specified channel
@@ -135,6 +191,10 @@ public:
    **/
   void Quantize(int nbits);
 
+  // Reduces the image to an adaptive palette of at most ncolors colors,
+  // optionally with Floyd-Steinberg error diffusion against the palette.
+  void PaletteQuantize(int ncolors, bool dither);
+
   // Converts and image to nbits per channel using random dither.
   void RandomDither(int nbits);
 
@@ -148,6 +208,28 @@ public:
   // Detects edges in an image.
   void EdgeDetect();
 
+  // Replaces each pixel with the per-channel median of the (2r+1) x (2r+1)
+  // window around it. Runs in constant time per pixel for any radius.
+  void Median(int r);
+
+  // Edge-preserving smoothing with spatial sigma sigma_s (pixels) and range
+  // sigma sigma_r (intensity levels), approximated with a bilateral grid.
+  void Bilateral(double sigma_s, double sigma_r);
+
+  // Grayscale morphology with a kw x kh rectangle centered on each pixel,
+  // applied to every channel. Erode takes the minimum over the rectangle
+  // and Dilate the maximum; Open erodes then dilates, Close the reverse.
+  // The cost per pixel does not depend on the rectangle size.
+  void Erode(int kw, int kh);
+  void Dilate(int kw, int kh);
+  void Open(int kw, int kh);
+  void Close(int kw, int kh);
+
+  // Painterly smoothing: blends the means of the four (r+1) x (r+1)
+  // quadrants meeting at each pixel, favoring the flattest ones. Runs in
+  // constant time per pixel for any radius.
+  void Kuwahara(int r);
+
   /**
    * Converts an image to nbits per channel using ordered dither, with a
    * 4x4 Bayer's pattern matrix.
@@ -166,7 +248,20 @@ public:
   // Rotates an image by the given angle.
   Image *Rotate(double angle);
 
-  // An extra function of your choice (e.g., non-photorealistic)
+  // Multi-band blend of other into this image, both the same size: where
+  // mask (its mean of RGB) is white the result is other, where it is black
+  // it stays this image. Each of the given number of Laplacian pyramid
+  // levels is blended with a correspondingly blurred mask, so seams are
+  // smooth at every scale.
+  void Blend(const Image &other, const Image &mask, int levels);
+
+  // Content-aware resize: shrinks the image to new_width x new_height, at
+  // most its current size, by removing the connected paths of pixels
+  // (seams) with the least gradient energy, columns first and then rows.
+  Image *SeamCarve(int new_width, int new_height);
+
+  // An extra function of your choice (e.g., non-photorealistic). Applies a
+  // Kuwahara filter for a painted look.
   void Fun();
 
   // Sets the sampling method.
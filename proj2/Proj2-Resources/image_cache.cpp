@@ -0,0 +1,240 @@
+#include "image_cache.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char CACHE_MAGIC[8] = {'I', 'M', 'G', 'C', 'A', 'C', 'H', '2'};
+
+// The header and the source path fit in the first HEADER_SIZE bytes. The
+// pixels start at the next page boundary, so they can be mapped directly.
+const size_t HEADER_SIZE = 4096;
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t width, height;
+  uint64_t source_size;
+  int64_t source_mtime_ns;
+  uint64_t pixel_offset; // a multiple of the writer's page size
+  uint32_t path_len;     // the source path follows the header
+};
+
+size_t PageSize() {
+  static size_t page = std::max<long>(sysconf(_SC_PAGESIZE), 1);
+  return page;
+}
+
+// Where the pixels of a new entry start
+size_t PixelOffset() {
+  return (HEADER_SIZE + PageSize() - 1) / PageSize() * PageSize();
+}
+
+struct CacheKey {
+  std::string path; // absolute path of the source
+  uint64_t size;
+  int64_t mtime_ns;
+  std::string entry; // cache file holding it
+};
+
+const char *CacheDir() {
+  const char *dir = getenv("IMAGE_CACHE_DIR");
+  return dir && *dir ? dir : NULL;
+}
+
+uint64_t MaxCacheBytes() {
+  const char *env = getenv("IMAGE_CACHE_MAX_MB");
+  long long mb = env ? atoll(env) : 2048;
+  return (uint64_t)std::max(mb, 0LL) << 20;
+}
+
+// FNV-1a
+uint64_t Hash(const std::string &s) {
+  uint64_t h = 1469598103934665603ULL;
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+bool MakeKey(const char *fname, CacheKey &key) {
+  const char *dir = CacheDir();
+  char resolved[PATH_MAX];
+  struct stat st;
+  if (!dir || !realpath(fname, resolved) || stat(resolved, &st) != 0)
+    return false;
+  if (strlen(resolved) > HEADER_SIZE - sizeof(CacheHeader))
+    return false;
+
+  key.path = resolved;
+  key.size = st.st_size;
+  key.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+  char name[64];
+  snprintf(name, sizeof(name), "/%016llx.rgba",
+           (unsigned long long)Hash(key.path + "|" + std::to_string(key.size) +
+                                    "|" + std::to_string(key.mtime_ns)));
+  key.entry = std::string(dir) + name;
+  return true;
+}
+
+// Removes the least recently used entries until the cache fits its cap.
+// Hits refresh an entry's mtime, so mtime order is use order.
+void Evict(const char *dir) {
+  struct Entry {
+    std::string path;
+    off_t size;
+    timespec used;
+  };
+  std::vector<Entry> entries;
+  uint64_t total = 0;
+
+  DIR *d = opendir(dir);
+  if (!d)
+    return;
+  while (dirent *ent = readdir(d)) {
+    size_t len = strlen(ent->d_name);
+    if (len < 5 || strcmp(ent->d_name + len - 5, ".rgba") != 0)
+      continue;
+    std::string path = std::string(dir) + "/" + ent->d_name;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+      entries.push_back({path, st.st_size, st.st_mtim});
+      total += st.st_size;
+    }
+  }
+  closedir(d);
+
+  uint64_t cap = MaxCacheBytes();
+  if (total <= cap)
+    return;
+  std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+    return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec
+                                          : a.used.tv_nsec < b.used.tv_nsec;
+  });
+  for (const Entry &e : entries) {
+    if (total <= cap)
+      break;
+    if (unlink(e.path.c_str()) == 0)
+      total -= e.size;
+  }
+}
+
+} // namespace
+
+/**
+ * Cache lookup
+ **/
+uint8_t *ImageCacheLoad(const char *fname, int &width, int &height) {
+  CacheKey key;
+  if (!MakeKey(fname, key))
+    return NULL;
+
+  int fd = open(key.entry.c_str(), O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  // Check the entry really is this version of this file
+  std::vector<uint8_t> page(HEADER_SIZE);
+  struct stat st;
+  CacheHeader header;
+  bool valid = fstat(fd, &st) == 0 &&
+               pread(fd, page.data(), HEADER_SIZE, 0) == (ssize_t)HEADER_SIZE;
+  if (valid)
+    memcpy(&header, page.data(), sizeof(header));
+  size_t pixel_bytes =
+      valid ? (size_t)header.width * header.height * 4 : 0;
+  valid = valid && memcmp(header.magic, CACHE_MAGIC, 8) == 0 &&
+          header.source_size == key.size &&
+          header.source_mtime_ns == key.mtime_ns &&
+          header.path_len == key.path.size() &&
+          memcmp(page.data() + sizeof(header), key.path.data(),
+                 header.path_len) == 0 &&
+          header.pixel_offset >= HEADER_SIZE &&
+          header.pixel_offset % PageSize() == 0 &&
+          (uint64_t)st.st_size == header.pixel_offset + pixel_bytes &&
+          pixel_bytes > 0;
+
+  // The pixels are page-aligned in the entry, so they map as the image's
+  // own buffer. MAP_PRIVATE makes filters that write them copy the touched
+  // pages instead of changing the entry.
+  void *map = MAP_FAILED;
+  if (valid)
+    map = mmap(NULL, pixel_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+               header.pixel_offset);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  width = header.width;
+  height = header.height;
+  utimensat(AT_FDCWD, key.entry.c_str(), NULL, 0); // mark as recently used
+  return (uint8_t *)map;
+}
+
+void ImageCacheRelease(uint8_t *pixels, size_t bytes) {
+  if (pixels)
+    munmap(pixels, bytes);
+}
+
+/**
+ * Cache insertion
+ **/
+void ImageCacheStore(const char *fname, int width, int height,
+                     const uint8_t *rgba) {
+  CacheKey key;
+  if (!MakeKey(fname, key))
+    return;
+
+  size_t pixel_bytes = (size_t)width * height * 4;
+  size_t offset = PixelOffset();
+  if (offset + pixel_bytes > MaxCacheBytes())
+    return;
+
+  std::vector<uint8_t> header_page(offset, 0);
+  CacheHeader header;
+  memcpy(header.magic, CACHE_MAGIC, 8);
+  header.width = width;
+  header.height = height;
+  header.source_size = key.size;
+  header.source_mtime_ns = key.mtime_ns;
+  header.pixel_offset = offset;
+  header.path_len = key.path.size();
+  memcpy(header_page.data(), &header, sizeof(header));
+  memcpy(header_page.data() + sizeof(header), key.path.data(), key.path.size());
+
+  // Write under a temporary name and rename, so concurrent readers never
+  // see a partial entry. The name is unique even between threads of one
+  // server process.
+  std::string tmp = key.entry + ".tmpXXXXXX";
+  int fd = mkstemp(&tmp[0]);
+  if (fd < 0)
+    return;
+  fchmod(fd, 0644); // mkstemp makes the file private to its owner
+  FILE *f = fdopen(fd, "wb");
+  if (!f) {
+    close(fd);
+    unlink(tmp.c_str());
+    return;
+  }
+  bool ok = fwrite(header_page.data(), 1, offset, f) == offset &&
+            fwrite(rgba, 1, pixel_bytes, f) == pixel_bytes;
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tmp.c_str(), key.entry.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return;
+  }
+
+  Evict(CacheDir());
+}
@@ -0,0 +1,29 @@
+// image_cache.h
+//
+// Optional on-disk cache of decoded images, so loading the same JPEG or PNG
+// again maps the decoded pixels instead of decoding the file. Entries are raw
+// RGBA files keyed by the source's path, size and modification time.
+//
+// Set IMAGE_CACHE_DIR to enable it. IMAGE_CACHE_MAX_MB caps the cache size
+// (default 2048); the least recently used entries are evicted past it.
+
+#ifndef IMAGE_CACHE_INCLUDED
+#define IMAGE_CACHE_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Returns the cached RGBA pixels of fname, or NULL on a miss or when the
+// cache is disabled. The pixels are a private, writable map of the entry:
+// pages are read in on first touch, and writes never reach the file. Free
+// them with ImageCacheRelease.
+uint8_t *ImageCacheLoad(const char *fname, int &width, int &height);
+
+// Unmaps pixels returned by ImageCacheLoad
+void ImageCacheRelease(uint8_t *pixels, size_t bytes);
+
+// Records the decoded RGBA pixels of fname
+void ImageCacheStore(const char *fname, int width, int height,
+                     const uint8_t *rgba);
+
+#endif
@@ -0,0 +1,209 @@
+#include "labeling.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+namespace {
+
+const int BAND_ROWS = 64;
+
+// parent[i] links pixel i into a union-find forest, or is -1 for the
+// background. Roots are always the smallest index of their set, so each
+// root is the first pixel of its component in scan order.
+int Find(std::vector<int> &parent, int i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]]; // path halving
+    i = parent[i];
+  }
+  return i;
+}
+
+// Find without path compression, safe while other threads read the forest
+int FindRoot(const std::vector<int> &parent, int i) {
+  while (parent[i] != i)
+    i = parent[i];
+  return i;
+}
+
+void Union(std::vector<int> &parent, int a, int b) {
+  a = Find(parent, a);
+  b = Find(parent, b);
+  if (a < b)
+    parent[b] = a;
+  else if (b < a)
+    parent[a] = b;
+}
+
+struct Accumulator {
+  long long area = 0, sum_x = 0, sum_y = 0;
+  int min_x = INT_MAX, min_y = INT_MAX, max_x = -1, max_y = -1;
+
+  void Add(int x, int y) {
+    area++;
+    sum_x += x, sum_y += y;
+    min_x = std::min(min_x, x), max_x = std::max(max_x, x);
+    min_y = std::min(min_y, y), max_y = std::max(max_y, y);
+  }
+
+  void Merge(const Accumulator &o) {
+    area += o.area;
+    sum_x += o.sum_x, sum_y += o.sum_y;
+    min_x = std::min(min_x, o.min_x), max_x = std::max(max_x, o.max_x);
+    min_y = std::min(min_y, o.min_y), max_y = std::max(max_y, o.max_y);
+  }
+};
+
+} // namespace
+
+std::vector<BlobStats> LabelComponents(const ImageView &src, int threshold,
+                                       std::vector<int> &labels) {
+  int w = src.width, h = src.height;
+  int bands = (h + BAND_ROWS - 1) / BAND_ROWS;
+  std::vector<int> parent((size_t)w * h);
+  labels.assign((size_t)w * h, 0);
+
+  // First pass, per band: link every foreground pixel to its west and, below
+  // the band's first row, its northern neighbours
+  ParallelFor(0, bands, [&](int b, int e) {
+    for (int y = b * BAND_ROWS; y < std::min(e * BAND_ROWS, h); y++) {
+      const Pixel *row = src.Row(y);
+      bool first = y % BAND_ROWS == 0;
+      for (int x = 0; x < w; x++) {
+        int i = y * w + x;
+        const Pixel &p = row[x];
+        if (((p.r * 76 + p.g * 150 + p.b * 29) >> 8) <= threshold) {
+          parent[i] = -1;
+          continue;
+        }
+        parent[i] = i;
+        if (x > 0 && parent[i - 1] >= 0)
+          Union(parent, i, i - 1);
+        if (first)
+          continue;
+        for (int dx = -1; dx <= 1; dx++)
+          if (x + dx >= 0 && x + dx < w && parent[i - w + dx] >= 0)
+            Union(parent, i, i - w + dx);
+      }
+    }
+  });
+
+  // Join the bands across their boundaries
+  for (int b = 1; b < bands; b++) {
+    int y = b * BAND_ROWS;
+    for (int x = 0; x < w; x++) {
+      int i = y * w + x;
+      if (parent[i] < 0)
+        continue;
+      for (int dx = -1; dx <= 1; dx++)
+        if (x + dx >= 0 && x + dx < w && parent[i - w + dx] >= 0)
+          Union(parent, i, i - w + dx);
+    }
+  }
+
+  // Point every pixel at its root and count the roots of each band
+  std::vector<int> first_label(bands + 1, 0);
+  ParallelFor(0, bands, [&](int b, int e) {
+    for (int band = b; band < e; band++) {
+      int roots = 0;
+      int end = std::min((band + 1) * BAND_ROWS, h) * w;
+      for (int i = band * BAND_ROWS * w; i < end; i++) {
+        labels[i] = parent[i] < 0 ? -1 : FindRoot(parent, i);
+        roots += labels[i] == i;
+      }
+      first_label[band + 1] = roots;
+    }
+  });
+  for (int b = 0; b < bands; b++)
+    first_label[b + 1] += first_label[b];
+  int count = first_label[bands];
+
+  // Number the roots in scan order, keeping each label in its root's
+  // parent entry, then look the labels up
+  ParallelFor(0, bands, [&](int b, int e) {
+    for (int band = b; band < e; band++) {
+      int next = first_label[band];
+      int end = std::min((band + 1) * BAND_ROWS, h) * w;
+      for (int i = band * BAND_ROWS * w; i < end; i++)
+        if (labels[i] == i)
+          parent[i] = ++next;
+    }
+  });
+  ParallelFor(0, bands, [&](int b, int e) {
+    int end = std::min(e * BAND_ROWS, h) * w;
+    for (int i = b * BAND_ROWS * w; i < end; i++)
+      labels[i] = labels[i] < 0 ? 0 : parent[labels[i]];
+  });
+
+  // Stats per band. Components whose first pixel is in the band have its
+  // range of labels and are written directly; the few reaching in from
+  // above are merged afterwards.
+  std::vector<Accumulator> acc(count);
+  std::vector<std::unordered_map<int, Accumulator>> spill(bands);
+  ParallelFor(0, bands, [&](int b, int e) {
+    for (int band = b; band < e; band++) {
+      int lo = first_label[band], hi = first_label[band + 1];
+      for (int y = band * BAND_ROWS; y < std::min((band + 1) * BAND_ROWS, h);
+           y++) {
+        const int *row = &labels[(size_t)y * w];
+        for (int x = 0; x < w; x++) {
+          int l = row[x];
+          if (l == 0)
+            continue;
+          if (l > lo && l <= hi)
+            acc[l - 1].Add(x, y);
+          else
+            spill[band][l].Add(x, y);
+        }
+      }
+    }
+  });
+  for (const auto &band : spill)
+    for (const auto &entry : band)
+      acc[entry.first - 1].Merge(entry.second);
+
+  std::vector<BlobStats> stats(count);
+  for (int l = 0; l < count; l++) {
+    const Accumulator &a = acc[l];
+    stats[l] = BlobStats{a.area,
+                         a.min_x,
+                         a.min_y,
+                         a.max_x,
+                         a.max_y,
+                         (double)a.sum_x / a.area,
+                         (double)a.sum_y / a.area};
+  }
+  return stats;
+}
+
+void DrawLabels(const std::vector<int> &labels, const ImageView &out) {
+  assert(labels.size() == (size_t)out.width * out.height);
+  ParallelFor(0, out.height, [&](int begin, int end) {
+    for (int y = begin; y < end; y++) {
+      const int *l = &labels[(size_t)y * out.width];
+      Pixel *row = out.Row(y);
+      for (int x = 0; x < out.width; x++)
+        row[x].Set(l[x] & 0xff, (l[x] >> 8) & 0xff, (l[x] >> 16) & 0xff, 255);
+    }
+  }, BAND_ROWS);
+}
+
+void WriteBlobStats(const char *fname, const std::vector<BlobStats> &stats) {
+  FILE *f = fopen(fname, "w");
+  if (!f)
+    throw std::runtime_error(std::string("ERROR: Could not write file '") +
+                             fname + "'");
+  fprintf(f, "label,area,min_x,min_y,max_x,max_y,centroid_x,centroid_y\n");
+  for (size_t l = 0; l < stats.size(); l++) {
+    const BlobStats &s = stats[l];
+    fprintf(f, "%zu,%lld,%d,%d,%d,%d,%.3f,%.3f\n", l + 1, s.area, s.min_x,
+            s.min_y, s.max_x, s.max_y, s.cx, s.cy);
+  }
+  if (fclose(f) != 0)
+    throw std::runtime_error(std::string("ERROR: Could not write file '") +
+                             fname + "'");
+}
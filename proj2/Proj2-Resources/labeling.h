@@ -0,0 +1,38 @@
+// labeling.h
+//
+// Connected-component labeling of thresholded images. Bands of rows are
+// labeled in parallel with a two-pass scan over a union-find forest of
+// pixel indices. The forest is then joined across band boundaries and
+// flattened into consecutive labels, and per-component stats are
+// gathered band by band.
+
+#ifndef LABELING_INCLUDED
+#define LABELING_INCLUDED
+
+#include "image.h"
+#include <vector>
+
+struct BlobStats {
+  long long area;                 // pixels
+  int min_x, min_y, max_x, max_y; // bounding box, inclusive
+  double cx, cy;                  // centroid
+};
+
+// Labels the 8-connected components of pixels whose luminance is above
+// threshold. labels receives one entry per pixel, row by row: 0 for the
+// background and 1..n for the components, numbered in the order their
+// first pixels appear. Returns the stats of component i at index i - 1.
+std::vector<BlobStats> LabelComponents(const ImageView &src, int threshold,
+                                       std::vector<int> &labels);
+
+// Stores each label in the pixel at its position of out, which has the
+// labeled image's size, as r + 256 g + 65536 b with alpha 255, so the
+// background is black and up to 2^24 - 1 components survive a PPM/PNG
+// round trip.
+void DrawLabels(const std::vector<int> &labels, const ImageView &out);
+
+// Writes the stats as CSV, one component per line. Throws
+// std::runtime_error if the file cannot be written.
+void WriteBlobStats(const char *fname, const std::vector<BlobStats> &stats);
+
+#endif
@@ -0,0 +1,167 @@
+#include "luma.h"
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// A factor this large moves any channel more than 1/256 from its gray to 0
+// or 255, so larger ones are clamped to keep the products finite
+const double LERP_MAX_FACTOR = 256 * 256;
+
+double LerpFactor(double f) {
+  return std::min(std::max(f, -LERP_MAX_FACTOR), LERP_MAX_FACTOR);
+}
+
+#ifdef __SSE2__
+// Luminance of the 8 pixels in two registers, in 16-bit lanes. The
+// weighted sum of each pixel stays below 2^16, so unsigned 16-bit
+// arithmetic is exact.
+inline __m128i Luma8(__m128i v0, __m128i v1) {
+  const __m128i mask = _mm_set1_epi32(0xff);
+  __m128i r = _mm_packs_epi32(_mm_and_si128(v0, mask), _mm_and_si128(v1, mask));
+  __m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(v0, 8), mask),
+                              _mm_and_si128(_mm_srli_epi32(v1, 8), mask));
+  __m128i b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(v0, 16), mask),
+                              _mm_and_si128(_mm_srli_epi32(v1, 16), mask));
+  __m128i sum = _mm_add_epi16(
+      _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(LUMA_R)),
+                    _mm_mullo_epi16(g, _mm_set1_epi16(LUMA_G))),
+      _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(LUMA_B)),
+                    _mm_set1_epi16(128)));
+  return _mm_srli_epi16(sum, 8);
+}
+
+// Luminance of 16 pixels, one byte each
+inline __m128i Luma16(const Pixel *p) {
+  const __m128i *v = (const __m128i *)p;
+  return _mm_packus_epi16(
+      Luma8(_mm_loadu_si128(v), _mm_loadu_si128(v + 1)),
+      Luma8(_mm_loadu_si128(v + 2), _mm_loadu_si128(v + 3)));
+}
+
+// Channel of the 4 pixels in v that sits shift bits up, as floats
+inline __m128 Channel4(__m128i v, int shift) {
+  __m128i c = _mm_srl_epi32(v, _mm_cvtsi32_si128(shift));
+  return _mm_cvtepi32_ps(_mm_and_si128(c, _mm_set1_epi32(0xff)));
+}
+
+// 0.3 r + 0.59 g + 0.11 b of the 4 pixels in v, rounded once: the weighted
+// sum in hundredths is an exact integer, and only the divide rounds
+inline __m128 Gray4(__m128i v) {
+  __m128 rg = _mm_add_ps(_mm_mul_ps(Channel4(v, 0), _mm_set1_ps(30)),
+                         _mm_mul_ps(Channel4(v, 8), _mm_set1_ps(59)));
+  __m128 sum = _mm_add_ps(rg, _mm_mul_ps(Channel4(v, 16), _mm_set1_ps(11)));
+  return _mm_div_ps(sum, _mm_set1_ps(100));
+}
+
+// Lerps the 4 pixels in v from their gray levels as f c + keep gray, with
+// keep = 1 - f, so that factors of 0 and 1 give the gray and the channel
+// exactly. Clamped and truncated the way the (int) casts of the old code
+// were. Alpha is kept.
+inline __m128i Lerp4(__m128i v, __m128 gray, __m128 f, __m128 keep) {
+  const __m128 zero = _mm_setzero_ps(), top = _mm_set1_ps(255);
+  __m128i out = _mm_and_si128(v, _mm_set1_epi32((int)0xff000000));
+  for (int shift = 0; shift < 24; shift += 8) {
+    __m128 c = Channel4(v, shift);
+    __m128 x = _mm_add_ps(_mm_mul_ps(f, c), _mm_mul_ps(keep, gray));
+    x = _mm_max_ps(_mm_min_ps(x, top), zero);
+    out = _mm_or_si128(out, _mm_sll_epi32(_mm_cvttps_epi32(x),
+                                          _mm_cvtsi32_si128(shift)));
+  }
+  return out;
+}
+#else
+inline float Gray(const Pixel &p) {
+  return (float)(30 * p.r + 59 * p.g + 11 * p.b) / 100;
+}
+
+inline Component LerpChannel(int c, float gray, float f, float keep) {
+  float x = f * c + keep * gray;
+  return (Component)std::min(std::max(x, 0.0f), 255.0f);
+}
+#endif
+
+// Lerps n pixels toward their own gray, or toward a fixed gray
+template <bool OWN_GRAY>
+void LerpSpan(Pixel *pixels, int n, float gray, double f) {
+  float keep = (float)(1 - f);
+#ifdef __SSE2__
+  const __m128 factor = _mm_set1_ps((float)f), rest = _mm_set1_ps(keep);
+  const __m128 fixed = _mm_set1_ps(gray);
+  auto lerp = [&](Pixel *p) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    _mm_storeu_si128((__m128i *)p,
+                     Lerp4(v, OWN_GRAY ? Gray4(v) : fixed, factor, rest));
+  };
+  int x = 0;
+  for (; x + 4 <= n; x += 4)
+    lerp(pixels + x);
+  // The last few go through a padded copy, so that every pixel takes the
+  // same arithmetic whatever its position in the row
+  if (x < n) {
+    Pixel tail[4];
+    std::copy(pixels + x, pixels + n, tail);
+    lerp(tail);
+    std::copy(tail, tail + (n - x), pixels + x);
+  }
+#else
+  for (int x = 0; x < n; x++) {
+    Pixel &p = pixels[x];
+    float g = OWN_GRAY ? Gray(p) : gray;
+    p.Set(LerpChannel(p.r, g, (float)f, keep),
+          LerpChannel(p.g, g, (float)f, keep),
+          LerpChannel(p.b, g, (float)f, keep));
+  }
+#endif
+}
+
+} // namespace
+
+void LumaSpan(const Pixel *src, uint8_t *out, int n) {
+  int x = 0;
+#ifdef __SSE2__
+  for (; x + 16 <= n; x += 16)
+    _mm_storeu_si128((__m128i *)(out + x), Luma16(src + x));
+#endif
+  for (; x < n; x++)
+    out[x] = Luma(src[x]);
+}
+
+double GraySum(const Pixel *src, int n) {
+  uint64_t sums[3] = {0, 0, 0};
+  int x = 0;
+#ifdef __SSE2__
+  // psadbw against zero sums the bytes that each mask leaves
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc[3] = {zero, zero, zero};
+  for (; x + 4 <= n; x += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + x));
+    for (int c = 0; c < 3; c++)
+      acc[c] = _mm_add_epi64(
+          acc[c], _mm_sad_epu8(_mm_and_si128(v, _mm_set1_epi32(0xff << 8 * c)),
+                               zero));
+  }
+  for (int c = 0; c < 3; c++) {
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc[c]);
+    sums[c] = lanes[0] + lanes[1];
+  }
+#endif
+  for (; x < n; x++) {
+    sums[0] += src[x].r;
+    sums[1] += src[x].g;
+    sums[2] += src[x].b;
+  }
+  return 0.3 * sums[0] + 0.59 * sums[1] + 0.11 * sums[2];
+}
+
+void SaturateSpan(Pixel *pixels, int n, double f) {
+  LerpSpan<true>(pixels, n, 0, LerpFactor(f));
+}
+
+void ContrastSpan(Pixel *pixels, int n, double gray, double f) {
+  LerpSpan<false>(pixels, n, (float)gray, LerpFactor(f));
+}
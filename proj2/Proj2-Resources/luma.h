@@ -0,0 +1,40 @@
+// luma.h
+//
+// Luminance and the gray-lerp color adjustments, for Image::ChangeSaturation
+// and Image::ChangeContrast. The luminance kernel weighs the channels by
+// 0.3, 0.59 and 0.11 in 8-bit fixed point (77, 151 and 28 out of 256), so a
+// gray pixel is its own luminance. The lerps cannot use it: those weights
+// are up to 0.2 off, and a lerp multiplies any error in its gray by f - 1.
+// They weigh and lerp in single-precision lanes instead, and match the old
+// double-precision code to within 1 per channel for any factor, exactly for
+// all but values that land within float rounding of an integer. The SSE2
+// luminance kernel takes 16 pixels per iteration, the lerps 4.
+
+#ifndef LUMA_INCLUDED
+#define LUMA_INCLUDED
+
+#include "pixel.h"
+#include <stdint.h>
+
+const int LUMA_R = 77, LUMA_G = 151, LUMA_B = 28;
+
+inline int Luma(const Pixel &p) {
+  return (p.r * LUMA_R + p.g * LUMA_G + p.b * LUMA_B + 128) >> 8;
+}
+
+// Luminance of n pixels
+void LumaSpan(const Pixel *src, uint8_t *out, int n);
+
+// Sum of 0.3 r + 0.59 g + 0.11 b over n pixels, from exact channel sums
+double GraySum(const Pixel *src, int n);
+
+// Moves the RGB channels c of n pixels to gray + f (c - gray), truncated
+// and clamped, where gray is each pixel's own 0.3 r + 0.59 g + 0.11 b: 0
+// gives grayscale, 1 keeps the pixels and larger factors saturate. Alpha is
+// kept. Grayscale and lerp run fused, in one pass over the pixels.
+void SaturateSpan(Pixel *pixels, int n, double f);
+
+// The same toward one gray level for all pixels
+void ContrastSpan(Pixel *pixels, int n, double gray, double f);
+
+#endif
@@ -8,10 +8,26 @@
 //  modified by Stephen J. Guy, 2010-2025
 
 #include "image.h"
+#include "compare.h"
+#include "composite.h"
+#include "labeling.h"
+#include "parallel.h"
+#include "server.h"
+#include "stream.h"
+#include "tiled.h"
+#include "trace.h"
+#include "tune.h"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
 
 
 #define STB_IMAGE_IMPLEMENTATION //only place once in one .cpp file
@@ -27,12 +43,38 @@ using namespace std;
 /**
  * prototypes
  **/
+// Thrown for a malformed chain of flags. The CLI prints the usage, the
+// server reports it to the client.
+struct UsageError : runtime_error {
+	using runtime_error::runtime_error;
+};
+
+// The image being processed by one chain of flags
+struct OpChain {
+	Image *img = NULL;
+	std::vector<Image *> cropped_from; // owners of the pixels that crops share
+	bool did_output = false;
+	int client = -1; // socket replies go to in server mode
+
+	~OpChain() {
+		delete img;
+		for (Image *parent : cropped_from)
+			delete parent;
+	}
+};
+
+static void RunOps(int argc, char **argv, OpChain &chain);
+static void SendImage(int client, Image *img, const char *ext);
+static void RunStream(int argc, char **argv);
+static void RunTiled(int argc, char **argv);
+static int RunCompare(int argc, char **argv);
+static void RunTune(int argc, char **argv);
 static void ShowUsage(void);
 static void CheckOption(char *option, int argc, int minargc);
+static void CheckImageSize(const char *option, double width, double height);
 
 int main( int argc, char* argv[] ){
-	Image *img = NULL;
-	bool did_output = false;
+	OpChain chain;
 
 	// first argument is program name
 	argv++, argc--;
@@ -49,9 +91,130 @@ int main( int argc, char* argv[] ){
 		ShowUsage();
 	}
 
+	// daemon mode
+	if (!strcmp(argv[0], "-serve")) {
+		if (argc < 3) {
+			fprintf(stderr, "Too few arguments for %s\n", argv[0]);
+			ShowUsage();
+		}
+		Serve(argv[1], atoi(argv[2]), [](int argc, char **argv, int client) {
+			OpChain chain;
+			chain.client = client;
+			RunOps(argc, argv, chain);
+		});
+	}
+
+	// video mode
+	if (!strcmp(argv[0], "-stream")) {
+		try {
+			RunStream(argc, argv);
+		}
+		catch (const UsageError &e) {
+			fprintf(stderr, "image: %s\n", e.what());
+			ShowUsage();
+		}
+		catch (const std::exception &e) {
+			fprintf(stderr, "%s\n", e.what());
+			exit(EXIT_FAILURE);
+		}
+		return EXIT_SUCCESS;
+	}
+
+	// out-of-core mode
+	if (!strcmp(argv[0], "-tiled")) {
+		try {
+			RunTiled(argc, argv);
+		}
+		catch (const UsageError &e) {
+			fprintf(stderr, "image: %s\n", e.what());
+			ShowUsage();
+		}
+		catch (const std::exception &e) {
+			fprintf(stderr, "%s\n", e.what());
+			exit(EXIT_FAILURE);
+		}
+		return EXIT_SUCCESS;
+	}
+
+	// regression check
+	if (!strcmp(argv[0], "-compare")) {
+		try {
+			return RunCompare(argc, argv);
+		}
+		catch (const UsageError &e) {
+			fprintf(stderr, "image: %s\n", e.what());
+			ShowUsage();
+		}
+		catch (const std::exception &e) {
+			fprintf(stderr, "%s\n", e.what());
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// tuning mode
+	if (!strcmp(argv[0], "-tune")) {
+		try {
+			RunTune(argc, argv);
+		}
+		catch (const UsageError &e) {
+			fprintf(stderr, "image: %s\n", e.what());
+			ShowUsage();
+		}
+		catch (const std::exception &e) {
+			fprintf(stderr, "%s\n", e.what());
+			exit(EXIT_FAILURE);
+		}
+		return EXIT_SUCCESS;
+	}
+
+	// start tracing before the first operation, wherever the flag appears
+	for (int i = 0; i + 1 < argc; i++) {
+		if (!strcmp(argv[i], "-trace")) {
+			TraceEnable(argv[i + 1]);
+		}
+	}
+
+	try {
+		RunOps(argc, argv, chain);
+	}
+	catch (const UsageError &e) {
+		fprintf(stderr, "image: %s\n", e.what());
+		ShowUsage();
+	}
+	catch (const std::exception &e) {
+		fprintf(stderr, "%s\n", e.what());
+		exit(EXIT_FAILURE);
+	}
+
+	if (!chain.did_output){
+		fprintf( stderr, "WARNING: No output specified!\n" );
+	}
+
+	TraceFinish();
+	return EXIT_SUCCESS;
+}
+
+
+/**
+ * RunOps
+ **/
+static void RunOps(int argc, char **argv, OpChain &chain){
+	Image *&img = chain.img;
+	std::vector<Image *> &cropped_from = chain.cropped_from;
+
 	// parse arguments
 	while (argc > 0){
-		if (**argv == '-'){
+		if (!strcmp(*argv, "-trace")){
+			// already enabled above
+			CheckOption(*argv, argc, 2);
+			argv += 2, argc -= 2;
+		}
+		else if (**argv == '-'){
+			const char *op = *argv;
+			long long pixels_before = img ? img->NumPixels() : 0;
+			auto op_start = chrono::steady_clock::now();
+			TraceBegin(op);
+
 			if (!strcmp(*argv, "-input"))
 			{
 				CheckOption(*argv, argc, 2);
@@ -64,9 +227,9 @@ int main( int argc, char* argv[] ){
 			else if (!strcmp(*argv, "-output"))
 			{
 				CheckOption(*argv, argc, 2);
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 				img->Write(argv[1]);
-				did_output = true;
+				chain.did_output = true;
 				argv += 2, argc -= 2;
 			}
 
@@ -74,7 +237,7 @@ int main( int argc, char* argv[] ){
 			{
 				double factor;
 				CheckOption(*argv, argc, 2);
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 
 				factor = atof(argv[1]);
 				img->AddNoise(factor);
@@ -85,7 +248,7 @@ int main( int argc, char* argv[] ){
 			{
 				double factor;
 				CheckOption(*argv, argc, 2);
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 
 				factor = atof(argv[1]);
 				img->Brighten(factor);
@@ -96,7 +259,7 @@ int main( int argc, char* argv[] ){
 			{
 				double factor;
 				CheckOption(*argv, argc, 2);
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 
 				factor = atof(argv[1]);
 				img->ChangeContrast(factor);
@@ -107,7 +270,7 @@ int main( int argc, char* argv[] ){
 			{
 				double factor;
 				CheckOption(*argv, argc, 2);
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 
 				factor = atof(argv[1]);
 				img->ChangeSaturation(factor);
@@ -118,15 +281,16 @@ int main( int argc, char* argv[] ){
 			{
 				int x, y, w, h;
 				CheckOption(*argv, argc, 5);
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 
 				x = atoi(argv[1]);
 				y = atoi(argv[2]);
 				w = atoi(argv[3]);
 				h = atoi(argv[4]);
 
-				Image *dst = img->Crop(x, y, w, h);
-				delete img;
+				// The crop is a view into img, which has to stay alive
+				Image *dst = new Image(img->Crop(x, y, w, h));
+				cropped_from.push_back(img);
 				img = dst;
 
 				argv += 5, argc -= 5;
@@ -136,7 +300,7 @@ int main( int argc, char* argv[] ){
 			{
 				int channel;
 				CheckOption(*argv, argc, 2);
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 
 				channel = atoi(argv[1]);
 				img->ExtractChannel(channel);
@@ -147,18 +311,30 @@ int main( int argc, char* argv[] ){
 			{
 				int nbits;
 				CheckOption(*argv, argc, 2);
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 
 				nbits = atoi(argv[1]);
 				img->Quantize(nbits);
 				argv += 2, argc -= 2;
 			}
 
+			else if (!strcmp(*argv, "-palette"))
+			{
+				int ncolors, dither;
+				CheckOption(*argv, argc, 3);
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
+
+				ncolors = atoi(argv[1]);
+				dither = atoi(argv[2]);
+				img->PaletteQuantize(ncolors, dither != 0);
+				argv += 3, argc -= 3;
+			}
+
 			else if (!strcmp(*argv, "-randomDither"))
 			{
 				int nbits;
 				CheckOption(*argv, argc, 2);
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 
 				nbits = atoi(argv[1]);
 				img->RandomDither(nbits);
@@ -169,9 +345,11 @@ int main( int argc, char* argv[] ){
 			{
 				int n;
 				CheckOption(*argv, argc, 2);
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 
 				n = atoi(argv[1]);
+				if (n < 1 || n > max(img->Width(), img->Height()))
+					throw UsageError("-blur needs a radius from 1 to the image size");
 				img->Blur(n);
 				argv += 2, argc -= 2;
 			}
@@ -179,7 +357,7 @@ int main( int argc, char* argv[] ){
 			{
 				int n;
 				CheckOption(*argv, argc, 2);
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 
 				n = atoi(argv[1]);
 				img->Sharpen(n);
@@ -188,17 +366,99 @@ int main( int argc, char* argv[] ){
 
 			else if (!strcmp(*argv, "-edgeDetect"))
 			{
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 
 				img->EdgeDetect();
 				argv++, argc--;
 			}
 
+			else if (!strcmp(*argv, "-median"))
+			{
+				int r;
+				CheckOption(*argv, argc, 2);
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
+
+				r = atoi(argv[1]);
+				img->Median(r);
+				argv += 2, argc -= 2;
+			}
+
+			else if (!strcmp(*argv, "-bilateral"))
+			{
+				double sigma_s, sigma_r;
+				CheckOption(*argv, argc, 3);
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
+
+				sigma_s = atof(argv[1]);
+				sigma_r = atof(argv[2]);
+				img->Bilateral(sigma_s, sigma_r);
+				argv += 3, argc -= 3;
+			}
+
+			else if (!strcmp(*argv, "-erode"))
+			{
+				int kw, kh;
+				CheckOption(*argv, argc, 3);
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
+
+				kw = atoi(argv[1]);
+				kh = atoi(argv[2]);
+				img->Erode(kw, kh);
+				argv += 3, argc -= 3;
+			}
+
+			else if (!strcmp(*argv, "-dilate"))
+			{
+				int kw, kh;
+				CheckOption(*argv, argc, 3);
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
+
+				kw = atoi(argv[1]);
+				kh = atoi(argv[2]);
+				img->Dilate(kw, kh);
+				argv += 3, argc -= 3;
+			}
+
+			else if (!strcmp(*argv, "-open"))
+			{
+				int kw, kh;
+				CheckOption(*argv, argc, 3);
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
+
+				kw = atoi(argv[1]);
+				kh = atoi(argv[2]);
+				img->Open(kw, kh);
+				argv += 3, argc -= 3;
+			}
+
+			else if (!strcmp(*argv, "-close"))
+			{
+				int kw, kh;
+				CheckOption(*argv, argc, 3);
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
+
+				kw = atoi(argv[1]);
+				kh = atoi(argv[2]);
+				img->Close(kw, kh);
+				argv += 3, argc -= 3;
+			}
+
+			else if (!strcmp(*argv, "-kuwahara"))
+			{
+				int radius;
+				CheckOption(*argv, argc, 2);
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
+
+				radius = atoi(argv[1]);
+				img->Kuwahara(radius);
+				argv += 2, argc -= 2;
+			}
+
 			else if (!strcmp(*argv, "-orderedDither"))
 			{
 				int nbits;
 				CheckOption(*argv, argc, 2);
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 
 				nbits = atoi(argv[1]);
 				img->OrderedDither(nbits);
@@ -209,7 +469,7 @@ int main( int argc, char* argv[] ){
 			{
 				int nbits;
 				CheckOption(*argv, argc, 2);
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 
 				nbits = atoi(argv[1]);
 				img->FloydSteinbergDither(nbits);
@@ -219,10 +479,11 @@ int main( int argc, char* argv[] ){
 			else if (!strcmp(*argv, "-scale"))
 			{
 				CheckOption(*argv, argc, 3);
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 
 				double sx = atof(argv[1]);
 				double sy = atof(argv[2]);
+				CheckImageSize(*argv, img->Width() * sx, img->Height() * sy);
 
 				Image *dst = img->Scale(sx, sy);
 				delete img;
@@ -231,14 +492,98 @@ int main( int argc, char* argv[] ){
 				argv += 3, argc -= 3;
 			}
 
+			else if (!strcmp(*argv, "-blend"))
+			{
+				CheckOption(*argv, argc, 4);
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
+
+				Image other(argv[1]);
+				Image mask(argv[2]);
+				int levels = atoi(argv[3]);
+				if (levels < 1) throw UsageError("-blend needs at least one level");
+				if (other.Width() != img->Width() || other.Height() != img->Height() ||
+				    mask.Width() != img->Width() || mask.Height() != img->Height())
+					throw UsageError("-blend needs an image and a mask of the input's size");
+
+				img->Blend(other, mask, levels);
+				argv += 4, argc -= 4;
+			}
+
+			else if (!strcmp(*argv, "-flatten"))
+			{
+				CheckOption(*argv, argc, 2);
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
+
+				int count = atoi(argv[1]);
+				if (count < 1) throw UsageError("-flatten needs at least one layer");
+				CheckOption(*argv, argc, 2 + 3 * count);
+
+				// The input is the bottom layer
+				std::vector<Image *> images;
+				std::vector<Layer> layers(1, Layer{img->View(), BLEND_NORMAL, 255});
+				try {
+					for (int i = 0; i < count; i++) {
+						char **layer = argv + 2 + 3 * i;
+						images.push_back(new Image(layer[0]));
+						BlendMode mode;
+						int opacity = atoi(layer[2]);
+						if (!ParseBlendMode(layer[1], mode))
+							throw UsageError(string("Unknown blend mode ") + layer[1]);
+						if (opacity < 0 || opacity > 255)
+							throw UsageError("-flatten opacity must be 0..255");
+						if (images.back()->Width() != img->Width() || images.back()->Height() != img->Height())
+							throw UsageError("-flatten needs layers of the input's size");
+						layers.push_back(Layer{images.back()->View(), mode, opacity});
+					}
+					FlattenLayers(layers, img->View());
+				} catch (...) {
+					for (Image *layer : images) delete layer;
+					throw;
+				}
+				for (Image *layer : images) delete layer;
+				argv += 2 + 3 * count, argc -= 2 + 3 * count;
+			}
+
+			else if (!strcmp(*argv, "-components"))
+			{
+				CheckOption(*argv, argc, 3);
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
+
+				int threshold = atoi(argv[1]);
+				std::vector<int> labels;
+				std::vector<BlobStats> stats = LabelComponents(img->View(), threshold, labels);
+				WriteBlobStats(argv[2], stats);
+				DrawLabels(labels, img->View());
+				fprintf(stderr, "%zu components\n", stats.size());
+				argv += 3, argc -= 3;
+			}
+
+			else if (!strcmp(*argv, "-seamCarve"))
+			{
+				CheckOption(*argv, argc, 3);
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
+
+				int w = atoi(argv[1]);
+				int h = atoi(argv[2]);
+				if (w < 1 || w > img->Width() || h < 1 || h > img->Height())
+					throw UsageError("-seamCarve can only shrink the image");
+
+				Image *dst = img->SeamCarve(w, h);
+				delete img;
+
+				img = dst;
+				argv += 3, argc -= 3;
+			}
+
 			else if (!strcmp(*argv, "-rotate"))
 			{
 				double angle;
 				Image *dst;
 				CheckOption(*argv, argc, 2);
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 
 				angle = atof(argv[1]);
+				if (!isfinite(angle)) throw UsageError("-rotate needs a finite angle");
 				dst = img->Rotate(angle);
 				delete img;
 				img = dst;
@@ -248,7 +593,7 @@ int main( int argc, char* argv[] ){
 
 			else if (!strcmp(*argv, "-fun"))
 			{
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 
 				img->Fun();
 				argv++, argc--;
@@ -256,33 +601,292 @@ int main( int argc, char* argv[] ){
 
 			else if (!strcmp(*argv, "-sampling"))
 			{
-				if (img == NULL) ShowUsage();
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
 
 				int method;
 				CheckOption(*argv, argc, 2);
 				method = atoi(argv[1]);
+				if (method < 0 || method >= IMAGE_N_SAMPLING_METHODS)
+					throw UsageError("-sampling takes a method from 0 to " + to_string(IMAGE_N_SAMPLING_METHODS - 1));
 				img->SetSamplingMethod(method);
 				argv += 2, argc -= 2;
 			}
 
+			else if (!strcmp(*argv, "-pngLevel"))
+			{
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
+
+				int level;
+				CheckOption(*argv, argc, 2);
+				level = atoi(argv[1]);
+				if (level < 0 || level > 9) throw UsageError("-pngLevel takes a level from 0 to 9");
+				img->SetPNGLevel(level);
+				argv += 2, argc -= 2;
+			}
+
+			else if (!strcmp(*argv, "-send"))
+			{
+				CheckOption(*argv, argc, 2);
+				if (img == NULL) throw UsageError(string(*argv) + " needs an input image");
+				if (chain.client < 0) throw UsageError("-send is only available with -serve");
+
+				SendImage(chain.client, img, argv[1]);
+				chain.did_output = true;
+				argv += 2, argc -= 2;
+			}
+
 			else
 			{
-				fprintf(stderr, "image: invalid option: %s\n", *argv);
-				ShowUsage();
+				throw UsageError(string("invalid option: ") + *argv);
+			}
+
+			long long pixels_after = img ? img->NumPixels() : 0;
+			TraceEnd(max(pixels_before, pixels_after));
+
+			if (chain.client >= 0) {
+				double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - op_start).count();
+				SendLine(chain.client, "op %s %.3f", op, ms);
 			}
 		} 
 		else {
-			fprintf(stderr, "image: invalid option: %s\n", *argv);
-			ShowUsage();
+			throw UsageError(string("invalid option: ") + *argv);
 		}
 	}
+}
 
-	if (!did_output){
-		fprintf( stderr, "WARNING: No output specified!\n" );
+
+/**
+ * RunStream
+ **/
+// Filters the frames of stdin into stdout, running the remaining flags on
+// each frame as if it had been loaded with -input
+static void RunStream(int argc, char **argv){
+	StreamFormat format;
+	int width = 0, height = 0;
+	CheckOption(argv[0], argc, 2);
+	if (!strcmp(argv[1], "y4m")) {
+		format = STREAM_Y4M;
+		argv += 2, argc -= 2;
+	}
+	else if (!strcmp(argv[1], "rgb")) {
+		CheckOption(argv[0], argc, 4);
+		format = STREAM_RGB;
+		width = atoi(argv[2]);
+		height = atoi(argv[3]);
+		argv += 4, argc -= 4;
 	}
+	else {
+		throw UsageError(string("unknown stream format: ") + argv[1]);
+	}
+
+	StreamFrames(stdin, stdout, format, width, height, [&](Image *frame) {
+		OpChain chain;
+		chain.img = frame;
+		RunOps(argc, argv, chain);
+		// Crops share their parent's pixels, which die with the chain
+		Image *result = chain.cropped_from.empty() ? chain.img : new Image(*chain.img);
+		if (result == chain.img) chain.img = NULL;
+		return result;
+	});
+}
+
+
+/**
+ * RunTiled
+ **/
+// Filters a PPM file that may not fit in memory, tile by tile. Point ops run
+// on each tile in place; neighbourhood ops run on each tile padded by the
+// pixels they can reach, into a fresh tiled image.
+static void RunTiled(int argc, char **argv){
+	CheckOption(argv[0], argc, 3);
+	TiledImage *img = TiledImage::Load(argv[1]);
+	const char *out = argv[2];
+	argv += 3, argc -= 3;
+
+	// Swaps in the result of a neighbourhood op
+	auto map = [&](int halo, const function<void(Image &)> &op) {
+		TiledImage *dst = MapWithHalo(*img, halo, op);
+		delete img;
+		img = dst;
+	};
+
+	try {
+		while (argc > 0) {
+			if (!strcmp(*argv, "-noise"))
+			{
+				CheckOption(*argv, argc, 2);
+				double factor = atof(argv[1]);
+				ForEachTile(*img, [&](Image &tile) { tile.AddNoise(factor); });
+				argv += 2, argc -= 2;
+			}
+
+			else if (!strcmp(*argv, "-brightness"))
+			{
+				CheckOption(*argv, argc, 2);
+				double factor = atof(argv[1]);
+				ForEachTile(*img, [&](Image &tile) { tile.Brighten(factor); });
+				argv += 2, argc -= 2;
+			}
+
+			else if (!strcmp(*argv, "-saturation"))
+			{
+				CheckOption(*argv, argc, 2);
+				double factor = atof(argv[1]);
+				ForEachTile(*img, [&](Image &tile) { tile.ChangeSaturation(factor); });
+				argv += 2, argc -= 2;
+			}
+
+			else if (!strcmp(*argv, "-extractChannel"))
+			{
+				CheckOption(*argv, argc, 2);
+				int channel = atoi(argv[1]);
+				ForEachTile(*img, [&](Image &tile) { tile.ExtractChannel(channel); });
+				argv += 2, argc -= 2;
+			}
+
+			else if (!strcmp(*argv, "-quantize"))
+			{
+				CheckOption(*argv, argc, 2);
+				int nbits = atoi(argv[1]);
+				ForEachTile(*img, [&](Image &tile) { tile.Quantize(nbits); });
+				argv += 2, argc -= 2;
+			}
+
+			else if (!strcmp(*argv, "-blur"))
+			{
+				CheckOption(*argv, argc, 2);
+				int n = atoi(argv[1]);
+				map(max(n, 0), [&](Image &tile) { tile.Blur(n); });
+				argv += 2, argc -= 2;
+			}
+
+			else if (!strcmp(*argv, "-sharpen"))
+			{
+				CheckOption(*argv, argc, 2);
+				int n = atoi(argv[1]);
+				// Sharpen subtracts a radius 2 blur
+				map(2, [&](Image &tile) { tile.Sharpen(n); });
+				argv += 2, argc -= 2;
+			}
+
+			else if (!strcmp(*argv, "-edgeDetect"))
+			{
+				map(1, [](Image &tile) { tile.EdgeDetect(); });
+				argv++, argc--;
+			}
 
+			else if (!strcmp(*argv, "-median"))
+			{
+				CheckOption(*argv, argc, 2);
+				int r = atoi(argv[1]);
+				map(max(r, 0), [&](Image &tile) { tile.Median(r); });
+				argv += 2, argc -= 2;
+			}
+
+			else if (!strcmp(*argv, "-erode") || !strcmp(*argv, "-dilate") ||
+			         !strcmp(*argv, "-open") || !strcmp(*argv, "-close"))
+			{
+				CheckOption(*argv, argc, 3);
+				int kw = atoi(argv[1]);
+				int kh = atoi(argv[2]);
+				int halo = max(max(kw, kh), 0);
+				auto erode = [&](Image &tile) { tile.Erode(kw, kh); };
+				auto dilate = [&](Image &tile) { tile.Dilate(kw, kh); };
+				// Opening and closing run as two passes, so the second one
+				// never sees the first one's output past the image edge
+				if (!strcmp(*argv, "-erode") || !strcmp(*argv, "-open"))
+					map(halo, erode);
+				if (strcmp(*argv, "-erode"))
+					map(halo, dilate);
+				if (!strcmp(*argv, "-close"))
+					map(halo, erode);
+				argv += 3, argc -= 3;
+			}
+
+			else
+			{
+				throw UsageError(string(*argv) + " is not supported with -tiled");
+			}
+		}
+
+		img->Save(out);
+	}
+	catch (...) {
+		delete img;
+		throw;
+	}
 	delete img;
-	return EXIT_SUCCESS;
+}
+
+
+/**
+ * RunCompare
+ **/
+// Prints how far two images are apart and optionally writes a heatmap of
+// the differences. Exits with 0 only when every pixel matches, so it can
+// gate regression runs directly.
+static int RunCompare(int argc, char **argv){
+	CheckOption(argv[0], argc, 3);
+	Image a(argv[1]), b(argv[2]);
+	if (a.Width() != b.Width() || a.Height() != b.Height()) {
+		printf("size     %dx%d vs %dx%d\n", a.Width(), a.Height(), b.Width(), b.Height());
+		return EXIT_FAILURE;
+	}
+
+	ImageDiff diff = CompareImages(a.View(), b.View());
+	printf("mse      %.6f (r %.6f g %.6f b %.6f)\n", diff.mse_total, diff.mse[0], diff.mse[1], diff.mse[2]);
+	printf("psnr     %.2f dB\n", diff.psnr);
+	printf("ssim     %.6f\n", diff.ssim);
+	printf("maxdiff  r %d g %d b %d\n", diff.max_diff[0], diff.max_diff[1], diff.max_diff[2]);
+
+	if (argc > 3) {
+		Image heatmap(a.Width(), a.Height());
+		DiffHeatmap(a.View(), b.View(), heatmap.View());
+		heatmap.Write(argv[3]);
+	}
+
+	bool same = diff.max_diff[0] == 0 && diff.max_diff[1] == 0 && diff.max_diff[2] == 0;
+	return same ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/**
+ * RunTune
+ **/
+// Benchmarks the tunable operations on this machine and writes the fastest
+// settings to the tuning file, which later runs read at startup
+static void RunTune(int argc, char **argv){
+	CheckOption(argv[0], argc, 2);
+	Image *sample = argc > 2 ? new Image(argv[2]) : NULL;
+	AutoTune(sample, stderr);
+	delete sample;
+
+	if (!SaveTuneFile(argv[1]))
+		throw runtime_error(string("ERROR: Could not write file '") + argv[1] + "'");
+	fprintf(stderr, "Wrote %s (used when IMAGE_TUNE_FILE names it)\n", argv[1]);
+}
+
+
+/**
+ * SendImage
+ **/
+// Encodes through Image::Write into a temporary file, so every output format
+// works, and streams the file back to the client
+static void SendImage(int client, Image *img, const char *ext){
+	string path = string("/tmp/image-send-XXXXXX.") + ext;
+	int fd = mkstemps(&path[0], strlen(ext) + 1);
+	if (fd < 0) throw runtime_error("could not create a temporary file");
+	close(fd);
+
+	try {
+		img->Write(&path[0]);
+		SendFile(client, path.c_str());
+	}
+	catch (...) {
+		unlink(path.c_str());
+		throw;
+	}
+	unlink(path.c_str());
 }
 
 
@@ -291,6 +895,13 @@ int main( int argc, char* argv[] ){
  **/
 static char options[] =
 "-help\n"
+"-serve <socket> <maxConcurrentRequests>\n"
+"-send <format> (with -serve)\n"
+"-stream y4m | rgb <width> <height> (frames from stdin to stdout, before other flags)\n"
+"-tiled <in.ppm> <out.ppm> (out-of-core filtering, before other flags)\n"
+"-compare <file> <file> [<heatmap file>] (exits nonzero if they differ)\n"
+"-tune <config file> [<sample image>] (tunes tiles and threads for IMAGE_TUNE_FILE)\n"
+"-trace <file>\n"
 "-input <file>\n"
 "-output <file>\n"
 "-noise <factor>\n"
@@ -300,16 +911,29 @@ static char options[] =
 "-crop <x> <y> <width> <height>\n"
 "-extractChannel <channel no>\n"
 "-quantize <nbits>\n"
+"-palette <ncolors> <dither 0|1>\n"
 "-randomDither <nbits>\n"
 "-blur <maskSize>\n"
 "-sharpen <maskSize>\n"
 "-edgeDetect\n"
+"-median <radius>\n"
+"-bilateral <sigmaSpatial> <sigmaRange>\n"
+"-erode <width> <height>\n"
+"-dilate <width> <height>\n"
+"-open <width> <height>\n"
+"-close <width> <height>\n"
+"-kuwahara <radius>\n"
 "-orderedDither <nbits>\n"
 "-FloydSteinbergDither <nbits>\n"
 "-scale <sx> <sy>\n"
 "-rotate <angle>\n"
+"-seamCarve <width> <height>\n"
+"-blend <image> <mask> <levels>\n"
+"-components <threshold> <stats.csv>\n"
+"-flatten <count> {<image> <normal|multiply|screen|darken|lighten|add> <opacity>}\n"
 "-fun\n"
 "-sampling <method no>\n"
+"-pngLevel <0-9>\n"
 ;
 
 static void ShowUsage(void)
@@ -325,7 +949,20 @@ static void ShowUsage(void)
  **/
 static void CheckOption(char *option, int argc, int minargc){
 	if (argc < minargc){
-		fprintf(stderr, "Too few arguments for %s\n", option);
-		ShowUsage();
+		throw UsageError(string("Too few arguments for ") + option);
+	}
+}
+
+// Images of more pixels than this are refused rather than allocated
+static const double MAX_IMAGE_PIXELS = 1 << 30;
+
+// The arguments of a flag come from the client in server mode, so the size
+// of the image it makes is checked here instead of asserted in Image
+static void CheckImageSize(const char *option, double width, double height){
+	if (!(width >= 1 && height >= 1)){ // NaN fails too
+		throw UsageError(string(option) + " would make an empty image");
+	}
+	if (width * height > MAX_IMAGE_PIXELS){
+		throw UsageError(string(option) + " would make an image too large to hold");
 	}
 }
@@ -0,0 +1,18 @@
+#include "packed.h"
+
+PackedPixels::PackedPixels(int width_, int height_, int nbits_)
+    : width(width_), height(height_), nbits(nbits_), mask((1 << nbits_) - 1) {
+  // One spare byte per row lets Get/Set always touch two bytes of their own
+  // row, even when a 3-bit level straddles a byte boundary
+  row_bytes = ((size_t)width * 3 * nbits + 7) / 8 + 1;
+  bits.assign(row_bytes * height, 0);
+  for (int l = 0; l < (1 << PACKED_MAX_BITS); l++)
+    level_value[l] = 0;
+}
+
+void PackedPixels::UnpackRow(int y, Pixel *out) const {
+  for (int x = 0; x < width; x++) {
+    out[x] = Pixel(level_value[Get(x, y, 0)], level_value[Get(x, y, 1)],
+                   level_value[Get(x, y, 2)]);
+  }
+}
@@ -0,0 +1,59 @@
+// packed.h
+//
+// Bit-packed RGB storage for images with at most 4 bits per channel, as
+// produced by Quantize and the dithers. Each pixel takes 3 * nbits bits and
+// alpha is implicitly 255. Rows start on a byte boundary, so different rows
+// can be written from different threads.
+
+#ifndef PACKED_INCLUDED
+#define PACKED_INCLUDED
+
+#include "pixel.h"
+#include <stddef.h>
+#include <vector>
+
+const int PACKED_MAX_BITS = 4;
+
+class PackedPixels {
+public:
+  PackedPixels(int width, int height, int nbits);
+
+  int Width() const { return width; }
+  int Height() const { return height; }
+  int Bits() const { return nbits; }
+  int Levels() const { return 1 << nbits; }
+  size_t Bytes() const { return bits.size(); }
+
+  // The 8-bit value each level decodes to, filled in by whoever quantized
+  // the image so unpacking reproduces its rounding exactly
+  Component level_value[1 << PACKED_MAX_BITS];
+
+  // Level of channel c (0..2) at (x, y)
+  int Get(int x, int y, int c) const {
+    size_t bit = (size_t)(x * 3 + c) * nbits;
+    const uint8_t *p = &bits[y * row_bytes + bit / 8];
+    return ((p[0] | p[1] << 8) >> (bit % 8)) & mask;
+  }
+
+  // Stores a level, clamped to the representable range
+  void Set(int x, int y, int c, int level) {
+    level = level < 0 ? 0 : level > mask ? mask : level;
+    size_t bit = (size_t)(x * 3 + c) * nbits;
+    uint8_t *p = &bits[y * row_bytes + bit / 8];
+    int shift = bit % 8;
+    int word = (p[0] | p[1] << 8) & ~(mask << shift);
+    word |= level << shift;
+    p[0] = word & 0xff;
+    p[1] = word >> 8;
+  }
+
+  // Decodes row y into 8-bit RGBA pixels
+  void UnpackRow(int y, Pixel *out) const;
+
+private:
+  int width, height, nbits, mask;
+  size_t row_bytes;
+  std::vector<uint8_t> bits;
+};
+
+#endif
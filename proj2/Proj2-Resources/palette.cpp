@@ -0,0 +1,244 @@
+#include "palette.h"
+#include "parallel.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <mutex>
+
+namespace {
+
+const int CELL_BITS = 5;
+const int CELLS = 1 << (3 * CELL_BITS);
+const int SIDE = 1 << CELL_BITS;
+
+// About this many pixels are sampled into the histogram
+const long long SAMPLE_PIXELS = 1 << 20;
+const int KMEANS_PASSES = 4;
+
+struct Bin {
+  uint64_t count;
+  uint64_t sum[3];
+};
+
+inline int CellIndex(int r, int g, int b) { return r << 10 | g << 5 | b; }
+
+// A box of cells [lo, hi] (inclusive) of the histogram
+struct Box {
+  int lo[3], hi[3];
+  uint64_t count;
+};
+
+// Shrinks the box to the cells that hold samples and counts them
+void Fit(const std::vector<Bin> &hist, Box &box) {
+  int lo[3] = {SIDE, SIDE, SIDE}, hi[3] = {-1, -1, -1};
+  box.count = 0;
+  for (int r = box.lo[0]; r <= box.hi[0]; r++)
+    for (int g = box.lo[1]; g <= box.hi[1]; g++)
+      for (int b = box.lo[2]; b <= box.hi[2]; b++) {
+        uint64_t n = hist[CellIndex(r, g, b)].count;
+        if (n == 0)
+          continue;
+        box.count += n;
+        int c[3] = {r, g, b};
+        for (int k = 0; k < 3; k++) {
+          lo[k] = std::min(lo[k], c[k]);
+          hi[k] = std::max(hi[k], c[k]);
+        }
+      }
+  if (box.count > 0)
+    for (int k = 0; k < 3; k++) {
+      box.lo[k] = lo[k];
+      box.hi[k] = hi[k];
+    }
+}
+
+// Splits box at the median of its longest side. Returns false if the box
+// is a single cell.
+bool Split(const std::vector<Bin> &hist, Box &box, Box &other) {
+  int axis = 0;
+  for (int k = 1; k < 3; k++)
+    if (box.hi[k] - box.lo[k] > box.hi[axis] - box.lo[axis])
+      axis = k;
+  if (box.hi[axis] == box.lo[axis])
+    return false;
+
+  // Population of each slice along the axis
+  uint64_t slice[SIDE] = {0};
+  for (int r = box.lo[0]; r <= box.hi[0]; r++)
+    for (int g = box.lo[1]; g <= box.hi[1]; g++)
+      for (int b = box.lo[2]; b <= box.hi[2]; b++) {
+        int c[3] = {r, g, b};
+        slice[c[axis]] += hist[CellIndex(r, g, b)].count;
+      }
+  // Cut after the slice that reaches half the population, leaving at least
+  // one slice on each side
+  int cut = box.lo[axis];
+  uint64_t below = slice[cut];
+  while (cut + 1 < box.hi[axis] && below * 2 < box.count)
+    below += slice[++cut];
+
+  other = box;
+  box.hi[axis] = cut;
+  other.lo[axis] = cut + 1;
+  Fit(hist, box);
+  Fit(hist, other);
+  return true;
+}
+
+inline double Distance2(const double *a, const Pixel &p) {
+  double dr = a[0] - p.r, dg = a[1] - p.g, db = a[2] - p.b;
+  return dr * dr + dg * dg + db * db;
+}
+
+inline int Distance2(int r, int g, int b, const Pixel &p) {
+  int dr = r - p.r, dg = g - p.g, db = b - p.b;
+  return dr * dr + dg * dg + db * db;
+}
+
+} // namespace
+
+/**
+ * Palette construction
+ **/
+std::vector<Pixel> BuildPalette(const ImageView &view, int ncolors) {
+  ncolors = std::min(std::max(ncolors, 1), PALETTE_MAX_COLORS);
+
+  // Histogram of a regular grid of samples
+  long long pixels = (long long)view.width * view.height;
+  int step =
+      std::max(1, (int)std::ceil(std::sqrt(pixels / (double)SAMPLE_PIXELS)));
+  std::vector<Bin> hist(CELLS, Bin());
+  std::mutex merge;
+  int rows = (view.height + step - 1) / step;
+  ParallelFor(0, rows, [&](int b, int e) {
+    std::vector<Bin> local(CELLS, Bin());
+    for (int i = b; i < e; i++) {
+      const Pixel *row = view.Row(i * step);
+      for (int x = 0; x < view.width; x += step) {
+        const Pixel &p = row[x];
+        Bin &bin = local[CellIndex(p.r >> 3, p.g >> 3, p.b >> 3)];
+        bin.count++;
+        bin.sum[0] += p.r, bin.sum[1] += p.g, bin.sum[2] += p.b;
+      }
+    }
+    std::lock_guard<std::mutex> lock(merge);
+    for (int c = 0; c < CELLS; c++) {
+      hist[c].count += local[c].count;
+      for (int k = 0; k < 3; k++)
+        hist[c].sum[k] += local[c].sum[k];
+    }
+  }, 64);
+
+  // Median cut, always splitting the box with the most samples times the
+  // length of its longest side
+  std::vector<Box> boxes(1, Box{{0, 0, 0}, {SIDE - 1, SIDE - 1, SIDE - 1}, 0});
+  Fit(hist, boxes[0]);
+  std::vector<bool> done(1, false);
+  while ((int)boxes.size() < ncolors) {
+    int best = -1;
+    double best_score = 0;
+    for (size_t i = 0; i < boxes.size(); i++) {
+      const Box &bx = boxes[i];
+      int side = std::max({bx.hi[0] - bx.lo[0], bx.hi[1] - bx.lo[1],
+                           bx.hi[2] - bx.lo[2]});
+      double score = (double)bx.count * side;
+      if (!done[i] && side > 0 && score > best_score) {
+        best = i;
+        best_score = score;
+      }
+    }
+    if (best < 0)
+      break;
+    Box other;
+    if (!Split(hist, boxes[best], other)) {
+      done[best] = true;
+      continue;
+    }
+    boxes.push_back(other);
+    done.push_back(false);
+  }
+
+  // Box means seed k-means over the occupied cells, each weighted by its
+  // sample count and placed at the mean of its samples
+  std::vector<int> occupied;
+  for (int c = 0; c < CELLS; c++)
+    if (hist[c].count > 0)
+      occupied.push_back(c);
+
+  std::vector<Pixel> palette;
+  for (const Box &bx : boxes) {
+    if (bx.count == 0)
+      continue;
+    uint64_t sum[3] = {0, 0, 0};
+    for (int r = bx.lo[0]; r <= bx.hi[0]; r++)
+      for (int g = bx.lo[1]; g <= bx.hi[1]; g++)
+        for (int b = bx.lo[2]; b <= bx.hi[2]; b++)
+          for (int k = 0; k < 3; k++)
+            sum[k] += hist[CellIndex(r, g, b)].sum[k];
+    palette.push_back(Pixel(lround(sum[0] / (double)bx.count),
+                            lround(sum[1] / (double)bx.count),
+                            lround(sum[2] / (double)bx.count)));
+  }
+
+  std::vector<int> owner(occupied.size());
+  for (int pass = 0; pass < KMEANS_PASSES; pass++) {
+    ParallelFor(0, occupied.size(), [&](int b, int e) {
+      for (int i = b; i < e; i++) {
+        const Bin &bin = hist[occupied[i]];
+        double mean[3];
+        for (int k = 0; k < 3; k++)
+          mean[k] = bin.sum[k] / (double)bin.count;
+        int nearest = 0;
+        double nearest_d = 1e30;
+        for (size_t j = 0; j < palette.size(); j++) {
+          double d = Distance2(mean, palette[j]);
+          if (d < nearest_d) {
+            nearest_d = d;
+            nearest = j;
+          }
+        }
+        owner[i] = nearest;
+      }
+    }, 256);
+
+    std::vector<Bin> cluster(palette.size(), Bin());
+    for (size_t i = 0; i < occupied.size(); i++) {
+      const Bin &bin = hist[occupied[i]];
+      Bin &cl = cluster[owner[i]];
+      cl.count += bin.count;
+      for (int k = 0; k < 3; k++)
+        cl.sum[k] += bin.sum[k];
+    }
+    for (size_t j = 0; j < palette.size(); j++) {
+      const Bin &cl = cluster[j];
+      if (cl.count > 0)
+        palette[j] = Pixel(lround(cl.sum[0] / (double)cl.count),
+                           lround(cl.sum[1] / (double)cl.count),
+                           lround(cl.sum[2] / (double)cl.count));
+    }
+  }
+  return palette;
+}
+
+/**
+ * Inverse colormap
+ **/
+InverseColormap::InverseColormap(const std::vector<Pixel> &palette)
+    : map(CELLS) {
+  ParallelFor(0, CELLS, [&](int b, int e) {
+    for (int c = b; c < e; c++) {
+      // Compare palette entries against the center of the cell
+      int r = (c >> 10 << 3) + 4, g = ((c >> 5 & 31) << 3) + 4,
+          bl = ((c & 31) << 3) + 4;
+      int nearest = 0, nearest_d = INT_MAX;
+      for (size_t j = 0; j < palette.size(); j++) {
+        int d = Distance2(r, g, bl, palette[j]);
+        if (d < nearest_d) {
+          nearest_d = d;
+          nearest = j;
+        }
+      }
+      map[c] = nearest;
+    }
+  }, 1024);
+}
@@ -0,0 +1,33 @@
+// palette.h
+//
+// Adaptive palettes for Image::PaletteQuantize. The palette comes from a
+// median cut of a sampled 5-bit-per-channel histogram, refined with a few
+// k-means passes over the histogram. Pixels are mapped through an inverse
+// colormap that caches the nearest palette entry of every 5-bit cell.
+
+#ifndef PALETTE_INCLUDED
+#define PALETTE_INCLUDED
+
+#include "image.h"
+#include <stdint.h>
+#include <vector>
+
+const int PALETTE_MAX_COLORS = 256;
+
+// Builds a palette of at most ncolors entries for the view's colors
+std::vector<Pixel> BuildPalette(const ImageView &view, int ncolors);
+
+class InverseColormap {
+public:
+  explicit InverseColormap(const std::vector<Pixel> &palette);
+
+  // Index of the palette entry nearest to the color's 5-bit cell
+  int Nearest(int r, int g, int b) const {
+    return map[(r >> 3) << 10 | (g >> 3) << 5 | b >> 3];
+  }
+
+private:
+  std::vector<uint8_t> map;
+};
+
+#endif
@@ -0,0 +1,241 @@
+#include "parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Worker pool
+ **/
+namespace {
+
+// One parallel loop. Chunks are claimed with an atomic counter by the
+// workers and by the calling thread, which then waits for them to finish.
+struct Job {
+  std::function<void(int)> run_chunk;
+  int num_chunks;
+  int max_helpers; // workers allowed to join the calling thread
+  int helpers = 0; // workers that joined, guarded by the pool mutex
+  std::atomic<int> next{0};
+  std::atomic<int> done{0};
+  std::mutex mutex;
+  std::condition_variable finished;
+};
+
+thread_local bool in_worker = false;
+
+class Pool {
+public:
+  explicit Pool(int n) {
+    for (int i = 0; i < n - 1; i++)
+      workers.emplace_back([this] { WorkerLoop(); });
+  }
+
+  ~Pool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &t : workers)
+      t.join();
+  }
+
+  void Run(const std::shared_ptr<Job> &job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      jobs.push_back(job);
+    }
+    wake.notify_all();
+
+    RunChunks(*job);
+
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->finished.wait(lock,
+                       [&] { return job->done.load() == job->num_chunks; });
+  }
+
+private:
+  static void RunChunks(Job &job) {
+    int c;
+    while ((c = job.next.fetch_add(1)) < job.num_chunks) {
+      job.run_chunk(c);
+      if (job.done.fetch_add(1) + 1 == job.num_chunks) {
+        std::lock_guard<std::mutex> lock(job.mutex);
+        job.finished.notify_all();
+      }
+    }
+  }
+
+  void WorkerLoop() {
+    in_worker = true;
+    for (;;) {
+      std::shared_ptr<Job> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&] { return stopping || !jobs.empty(); });
+        if (stopping)
+          return;
+        job = jobs.front();
+        // Every chunk is claimed, or the job has all the threads it may
+        // use; whoever is still running a chunk finishes it
+        if (job->next.load() >= job->num_chunks ||
+            job->helpers >= job->max_helpers) {
+          jobs.pop_front();
+          continue;
+        }
+        job->helpers++;
+      }
+      RunChunks(*job);
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::deque<std::shared_ptr<Job>> jobs;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping = false;
+};
+
+Pool &GetPool() {
+  static Pool pool(NumThreads());
+  return pool;
+}
+
+} // namespace
+
+int NumThreads() {
+  static int n = [] {
+    const char *env = getenv("IMAGE_THREADS");
+    int t = env ? atoi(env) : (int)std::thread::hardware_concurrency();
+    return std::max(t, 1);
+  }();
+  return n;
+}
+
+/**
+ * Parallel loops
+ **/
+void ParallelFor(int begin, int end, const std::function<void(int, int)> &fn,
+                 int grain) {
+  int count = end - begin;
+  if (count <= 0)
+    return;
+  grain = std::max(grain, 1);
+  int threads = TuneScope::Threads();
+
+  // Several chunks per thread so uneven rows still balance out
+  int num_chunks = std::min((count + grain - 1) / grain, threads * 4);
+  if (num_chunks <= 1 || threads == 1 || in_worker) {
+    fn(begin, end);
+    return;
+  }
+
+  auto job = std::make_shared<Job>();
+  job->num_chunks = num_chunks;
+  job->max_helpers = threads - 1;
+  job->run_chunk = [&](int c) {
+    int b = begin + (int)((long long)count * c / num_chunks);
+    int e = begin + (int)((long long)count * (c + 1) / num_chunks);
+    fn(b, e);
+  };
+  GetPool().Run(job);
+}
+
+void ParallelForTiles(int width, int height, int tile_w, int tile_h,
+                      const std::function<void(int, int, int, int)> &fn) {
+  tile_w = std::max(tile_w, 1);
+  tile_h = std::max(tile_h, 1);
+  int tiles_x = (width + tile_w - 1) / tile_w;
+  int tiles_y = (height + tile_h - 1) / tile_h;
+
+  ParallelFor(0, tiles_x * tiles_y, [&](int b, int e) {
+    for (int t = b; t < e; t++) {
+      int x0 = (t % tiles_x) * tile_w;
+      int y0 = (t / tiles_x) * tile_h;
+      fn(x0, y0, std::min(x0 + tile_w, width), std::min(y0 + tile_h, height));
+    }
+  });
+}
+
+/**
+ * Tuning
+ **/
+namespace {
+
+thread_local TuneScope *current_scope = NULL;
+
+std::map<std::string, TuneParams> LoadTuneFile(const char *fname) {
+  std::map<std::string, TuneParams> table;
+  FILE *f = fopen(fname, "r");
+  if (!f)
+    return table;
+  char line[256];
+  for (int n = 1; fgets(line, sizeof(line), f); n++) {
+    if (char *comment = strchr(line, '#'))
+      *comment = '\0';
+    char op[128];
+    TuneParams p;
+    int fields = sscanf(line, "%127s %d %d %d", op, &p.threads, &p.tile_w,
+                        &p.tile_h);
+    if (fields <= 0)
+      continue;
+    if (fields != 4 || p.threads < 0 || p.tile_w < 0 || p.tile_h < 0) {
+      fprintf(stderr, "Ignoring line %d of %s\n", n, fname);
+      continue;
+    }
+    table[op] = p;
+  }
+  fclose(f);
+  return table;
+}
+
+std::map<std::string, TuneParams> &TuneTable() {
+  static std::map<std::string, TuneParams> table = [] {
+    const char *env = getenv("IMAGE_TUNE_FILE");
+    return LoadTuneFile(env ? env : "image_tune.conf");
+  }();
+  return table;
+}
+
+} // namespace
+
+TuneParams GetTuneParams(const std::string &op) {
+  auto it = TuneTable().find(op);
+  return it == TuneTable().end() ? TuneParams() : it->second;
+}
+
+void SetTuneParams(const std::string &op, const TuneParams &params) {
+  TuneTable()[op] = params;
+}
+
+bool SaveTuneFile(const char *fname) {
+  FILE *f = fopen(fname, "w");
+  if (!f)
+    return false;
+  fprintf(f, "# operation threads tile_w tile_h (0 = default)\n");
+  for (const auto &entry : TuneTable())
+    fprintf(f, "%s %d %d %d\n", entry.first.c_str(), entry.second.threads,
+            entry.second.tile_w, entry.second.tile_h);
+  return fclose(f) == 0;
+}
+
+TuneScope::TuneScope(const std::string &op)
+    : params(GetTuneParams(op)), outer(current_scope) {
+  current_scope = this;
+}
+
+TuneScope::~TuneScope() { current_scope = outer; }
+
+int TuneScope::Threads() {
+  int n = current_scope ? current_scope->params.threads : 0;
+  return n > 0 ? std::min(n, NumThreads()) : NumThreads();
+}
@@ -0,0 +1,83 @@
+// parallel.h
+//
+// Persistent worker pool used by the Image filters to split work into
+// row bands or rectangular tiles.
+//
+// How many threads share an operation's loops and how it cuts up its work
+// can be tuned per operation. The settings come from the file named by
+// IMAGE_TUNE_FILE (default "image_tune.conf"), read once at startup and
+// written by "image -tune". Each line holds
+//
+//   <operation> <threads> <tile width> <tile height>
+//
+// where 0 keeps the built-in default and '#' starts a comment. Row-band
+// operations take the tile height as their rows per task.
+
+#ifndef PARALLEL_INCLUDED
+#define PARALLEL_INCLUDED
+
+#include <functional>
+#include <string>
+
+// Number of threads (workers + caller) that share a parallel loop.
+// Defaults to the hardware concurrency, overridable with IMAGE_THREADS.
+int NumThreads();
+
+// Calls fn(b, e) on disjoint sub-ranges covering [begin, end). Sub-ranges are
+// at least "grain" long. Nested calls from inside a worker run serially.
+void ParallelFor(int begin, int end, const std::function<void(int, int)> &fn,
+                 int grain = 1);
+
+// Calls fn(x0, y0, x1, y1) once per tile of a width x height area, where the
+// tile covers [x0, x1) x [y0, y1).
+void ParallelForTiles(int width, int height, int tile_w, int tile_h,
+                      const std::function<void(int, int, int, int)> &fn);
+
+/**
+ * Tuning
+ **/
+struct TuneParams {
+  int threads = 0; // at most NumThreads()
+  int tile_w = 0, tile_h = 0;
+};
+
+// The settings of the named operation, all 0 when it has none
+TuneParams GetTuneParams(const std::string &op);
+
+// Replaces the settings of the named operation. Not thread-safe: meant for
+// the tuner, while no other operation runs.
+void SetTuneParams(const std::string &op, const TuneParams &params);
+
+// Writes every operation's settings in the tuning file format. Returns
+// false if the file could not be written.
+bool SaveTuneFile(const char *fname);
+
+// Applies an operation's settings while in scope: parallel loops started
+// by the calling thread use at most its tuned number of threads, and the
+// operation asks for its tile size through TileW/TileH/Rows, passing its
+// default. Scopes nest, the innermost one wins.
+class TuneScope {
+public:
+  explicit TuneScope(const std::string &op);
+  ~TuneScope();
+
+  TuneScope(const TuneScope &) = delete;
+  TuneScope &operator=(const TuneScope &) = delete;
+
+  int TileW(int fallback) const {
+    return params.tile_w ? params.tile_w : fallback;
+  }
+  int TileH(int fallback) const {
+    return params.tile_h ? params.tile_h : fallback;
+  }
+  int Rows(int fallback) const { return TileH(fallback); }
+
+  // Threads that loops started on this thread may use
+  static int Threads();
+
+private:
+  TuneParams params;
+  TuneScope *outer;
+};
+
+#endif
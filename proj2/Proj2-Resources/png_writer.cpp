@@ -0,0 +1,153 @@
+#include "png_writer.h"
+#include "deflate.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+const uint8_t PNG_SIGNATURE[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+// Largest IDAT payload; the format allows up to 2^31 - 1 bytes
+const size_t MAX_CHUNK_DATA = 1 << 30;
+
+uint32_t Crc32(uint32_t crc, const uint8_t *data, size_t size) {
+  static const struct Table {
+    uint32_t entry[256];
+    Table() {
+      for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+          c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        entry[n] = c;
+      }
+    }
+  } table;
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++)
+    crc = table.entry[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+void Put32(uint8_t *p, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    p[i] = v >> (24 - 8 * i);
+}
+
+// Writes a chunk: length, type, data, then the CRC of type and data
+bool PutChunk(FILE *f, const char *type, const uint8_t *data, size_t size) {
+  uint8_t head[8], tail[4];
+  Put32(head, size);
+  memcpy(head + 4, type, 4);
+  Put32(tail, Crc32(Crc32(0, head + 4, 4), data, size));
+  return fwrite(head, 1, 8, f) == 8 &&
+         (size == 0 || fwrite(data, 1, size, f) == size) &&
+         fwrite(tail, 1, 4, f) == 4;
+}
+
+inline int Paeth(int a, int b, int c) {
+  int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return a;
+  return pb <= pc ? b : c;
+}
+
+// Applies filter type to row (up is the previous row, or NULL for the
+// first) of pixels with CHANNELS bytes each into out
+template <int CHANNELS>
+void FilterRow(int type, const uint8_t *row, const uint8_t *up, int bytes,
+               uint8_t *out) {
+  for (int i = 0; i < bytes; i++) {
+    int a = i >= CHANNELS ? row[i - CHANNELS] : 0;
+    int b = up ? up[i] : 0;
+    int c = i >= CHANNELS && up ? up[i - CHANNELS] : 0;
+    int pred = 0;
+    switch (type) {
+    case 1: // sub
+      pred = a;
+      break;
+    case 2: // up
+      pred = b;
+      break;
+    case 3: // average
+      pred = (a + b) >> 1;
+      break;
+    case 4:
+      pred = Paeth(a, b, c);
+      break;
+    }
+    out[i] = row[i] - pred;
+  }
+}
+
+} // namespace
+
+bool WritePNG(const char *fname, int width, int height, int stride,
+              const uint8_t *rgba, int level) {
+  return WritePNGRows(fname, width, height, 4,
+                      [&](int y, uint8_t *) {
+                        return rgba + (size_t)y * stride * 4;
+                      },
+                      level);
+}
+
+bool WritePNGRows(const char *fname, int width, int height, int channels,
+                  const PNGRowSource &rows, int level) {
+  // Filter every row, keeping the filter with the smallest sum of absolute
+  // residuals. Stored output gains nothing from filtering.
+  size_t row_bytes = (size_t)width * channels;
+  std::vector<uint8_t> filtered((row_bytes + 1) * height);
+  ParallelFor(0, height, [&](int b, int e) {
+    std::vector<uint8_t> trial(row_bytes);
+    // The source may decode into scratch, so the previous row gets its own
+    std::vector<uint8_t> scratch[2] = {std::vector<uint8_t>(row_bytes),
+                                       std::vector<uint8_t>(row_bytes)};
+    const uint8_t *up = b > 0 ? rows(b - 1, scratch[(b - 1) & 1].data()) : NULL;
+    for (int y = b; y < e; y++) {
+      const uint8_t *row = rows(y, scratch[y & 1].data());
+      uint8_t *out = &filtered[y * (row_bytes + 1)];
+      int best_type = 0;
+      long best_cost = -1;
+      for (int type = 0; type < (level > 0 ? 5 : 1); type++) {
+        if (channels == 4)
+          FilterRow<4>(type, row, up, row_bytes, trial.data());
+        else
+          FilterRow<3>(type, row, up, row_bytes, trial.data());
+        long cost = 0;
+        for (uint8_t v : trial)
+          cost += abs((signed char)v);
+        if (best_cost < 0 || cost < best_cost) {
+          best_cost = cost;
+          best_type = type;
+          memcpy(out + 1, trial.data(), row_bytes);
+        }
+      }
+      out[0] = best_type;
+      up = row;
+    }
+  });
+
+  std::vector<uint8_t> zlib =
+      ZlibCompress(filtered.data(), filtered.size(), level);
+  filtered = std::vector<uint8_t>();
+
+  uint8_t header[13] = {0};
+  Put32(header, width);
+  Put32(header + 4, height);
+  header[8] = 8; // bits per channel
+  header[9] = channels == 4 ? 6 : 2; // RGBA or RGB
+
+  FILE *f = fopen(fname, "wb");
+  if (!f)
+    return false;
+  bool ok = fwrite(PNG_SIGNATURE, 1, 8, f) == 8 &&
+            PutChunk(f, "IHDR", header, sizeof(header));
+  for (size_t at = 0; ok && at < zlib.size(); at += MAX_CHUNK_DATA)
+    ok = PutChunk(f, "IDAT", &zlib[at],
+                  std::min(MAX_CHUNK_DATA, zlib.size() - at));
+  ok = ok && PutChunk(f, "IEND", NULL, 0);
+  return (fclose(f) == 0) && ok;
+}
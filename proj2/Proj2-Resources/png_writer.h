@@ -0,0 +1,30 @@
+// png_writer.h
+//
+// Parallel PNG encoder for Image::Write. Rows are filtered on the worker
+// pool with the same per-row filter choice as stb_image_write, then the
+// filtered rows are deflated in parallel chunks (see deflate.h). Rows can
+// come from a callback, so storage such as bit-packed pixels is decoded one
+// row at a time straight into the filter.
+
+#ifndef PNG_WRITER_INCLUDED
+#define PNG_WRITER_INCLUDED
+
+#include <functional>
+#include <stdint.h>
+
+// Returns row y as width * channels bytes, either pointing into the
+// caller's own pixels or decoded into scratch, which holds one row
+typedef std::function<const uint8_t *(int y, uint8_t *scratch)> PNGRowSource;
+
+// Writes width x height RGBA pixels whose rows start stride pixels apart as
+// an 8-bit RGBA PNG at zlib level 0..9. Returns false if the file could not
+// be written.
+bool WritePNG(const char *fname, int width, int height, int stride,
+              const uint8_t *rgba, int level);
+
+// The same for rows from a source, as an 8-bit RGB (3 channels) or RGBA (4
+// channels) PNG
+bool WritePNGRows(const char *fname, int width, int height, int channels,
+                  const PNGRowSource &rows, int level);
+
+#endif
@@ -0,0 +1,285 @@
+#include "qim.h"
+#include "parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char QIM_MAGIC[4] = {'q', 'i', 'm', 'f'};
+const size_t HEADER_SIZE = 20;
+
+// Bands of about this many pixels keep every thread busy on typical images
+// while costing only 8 bytes of offset table each
+const int BAND_PIXELS = 1 << 18;
+
+// QOI ops
+const uint8_t OP_INDEX = 0x00; // 00xxxxxx
+const uint8_t OP_DIFF = 0x40;  // 01xxxxxx
+const uint8_t OP_LUMA = 0x80;  // 10xxxxxx
+const uint8_t OP_RUN = 0xc0;   // 11xxxxxx
+const uint8_t OP_RGB = 0xfe;
+const uint8_t OP_RGBA = 0xff;
+const uint8_t OP_MASK = 0xc0;
+const int MAX_RUN = 62;
+
+struct Rgba {
+  uint8_t r, g, b, a;
+};
+
+inline bool operator==(const Rgba &x, const Rgba &y) {
+  return x.r == y.r && x.g == y.g && x.b == y.b && x.a == y.a;
+}
+
+inline int Hash(const Rgba &p) {
+  return (p.r * 3 + p.g * 5 + p.b * 7 + p.a * 11) & 63;
+}
+
+void Put32(uint8_t *p, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    p[i] = v >> (8 * i);
+}
+
+uint32_t Get32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void Put64(uint8_t *p, uint64_t v) {
+  for (int i = 0; i < 8; i++)
+    p[i] = v >> (8 * i);
+}
+
+uint64_t Get64(const uint8_t *p) {
+  return Get32(p) | (uint64_t)Get32(p + 4) << 32;
+}
+
+// Codes rows [y0, y1) into out, which must hold the worst case of 5 bytes a
+// pixel. Returns the number of bytes written.
+size_t EncodeBand(const uint8_t *rgba, int width, int stride, int y0, int y1,
+                  uint8_t *out) {
+  Rgba index[64] = {};
+  Rgba prev = {0, 0, 0, 255};
+  uint8_t *o = out;
+  int run = 0;
+
+  for (int y = y0; y < y1; y++) {
+    const Rgba *row = (const Rgba *)(rgba + (size_t)y * stride * 4);
+    for (int x = 0; x < width; x++) {
+      Rgba px = row[x];
+      if (px == prev) {
+        if (++run == MAX_RUN) {
+          *o++ = OP_RUN | (run - 1);
+          run = 0;
+        }
+        continue;
+      }
+      if (run > 0) {
+        *o++ = OP_RUN | (run - 1);
+        run = 0;
+      }
+
+      int h = Hash(px);
+      if (index[h] == px) {
+        *o++ = OP_INDEX | h;
+      } else if (px.a == prev.a) {
+        index[h] = px;
+        int8_t dr = px.r - prev.r, dg = px.g - prev.g, db = px.b - prev.b;
+        int8_t dr_dg = dr - dg, db_dg = db - dg;
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 &&
+            db <= 1) {
+          *o++ = OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+        } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 &&
+                   db_dg >= -8 && db_dg <= 7) {
+          *o++ = OP_LUMA | (dg + 32);
+          *o++ = (dr_dg + 8) << 4 | (db_dg + 8);
+        } else {
+          *o++ = OP_RGB;
+          *o++ = px.r;
+          *o++ = px.g;
+          *o++ = px.b;
+        }
+      } else {
+        index[h] = px;
+        *o++ = OP_RGBA;
+        *o++ = px.r;
+        *o++ = px.g;
+        *o++ = px.b;
+        *o++ = px.a;
+      }
+      prev = px;
+    }
+  }
+  if (run > 0)
+    *o++ = OP_RUN | (run - 1);
+  return o - out;
+}
+
+// Decodes exactly count pixels from [in, end). Returns false if the band
+// is truncated or does not decode to count pixels.
+bool DecodeBand(const uint8_t *in, const uint8_t *end, Rgba *out,
+                size_t count) {
+  Rgba index[64] = {};
+  Rgba px = {0, 0, 0, 255};
+  size_t n = 0;
+
+  while (n < count) {
+    if (in >= end)
+      return false;
+    uint8_t op = *in++;
+    if (op == OP_RGB) {
+      if (end - in < 3)
+        return false;
+      px.r = in[0];
+      px.g = in[1];
+      px.b = in[2];
+      in += 3;
+    } else if (op == OP_RGBA) {
+      if (end - in < 4)
+        return false;
+      px = {in[0], in[1], in[2], in[3]};
+      in += 4;
+    } else {
+      switch (op & OP_MASK) {
+      case OP_INDEX:
+        px = index[op];
+        break;
+      case OP_DIFF:
+        px.r += ((op >> 4) & 3) - 2;
+        px.g += ((op >> 2) & 3) - 2;
+        px.b += (op & 3) - 2;
+        break;
+      case OP_LUMA: {
+        if (in >= end)
+          return false;
+        int dg = (op & 63) - 32;
+        uint8_t second = *in++;
+        px.r += dg + (second >> 4) - 8;
+        px.g += dg;
+        px.b += dg + (second & 15) - 8;
+        break;
+      }
+      case OP_RUN: {
+        size_t run = (op & 63) + 1;
+        if (run > count - n)
+          return false;
+        std::fill(out + n, out + n + run, px);
+        n += run;
+        continue;
+      }
+      }
+    }
+    index[Hash(px)] = px;
+    out[n++] = px;
+  }
+  return in == end;
+}
+
+} // namespace
+
+/**
+ * Encoding
+ **/
+bool WriteQim(const char *fname, int width, int height, int stride,
+              const uint8_t *rgba) {
+  int band_rows = std::max(1, BAND_PIXELS / std::max(width, 1));
+  int num_bands = (height + band_rows - 1) / band_rows;
+
+  std::vector<std::vector<uint8_t>> bands(num_bands);
+  ParallelFor(0, num_bands, [&](int b, int e) {
+    for (int i = b; i < e; i++) {
+      int y0 = i * band_rows, y1 = std::min(height, y0 + band_rows);
+      std::vector<uint8_t> &band = bands[i];
+      band.resize((size_t)width * (y1 - y0) * 5);
+      band.resize(EncodeBand(rgba, width, stride, y0, y1, band.data()));
+    }
+  });
+
+  std::vector<uint8_t> header(HEADER_SIZE + (size_t)num_bands * 8);
+  memcpy(header.data(), QIM_MAGIC, 4);
+  Put32(&header[4], width);
+  Put32(&header[8], height);
+  Put32(&header[12], band_rows);
+  Put32(&header[16], num_bands);
+  uint64_t offset = 0;
+  for (int i = 0; i < num_bands; i++) {
+    offset += bands[i].size();
+    Put64(&header[HEADER_SIZE + i * 8], offset);
+  }
+
+  FILE *f = fopen(fname, "wb");
+  if (!f)
+    return false;
+  bool ok = fwrite(header.data(), 1, header.size(), f) == header.size();
+  for (const std::vector<uint8_t> &band : bands)
+    ok = ok && fwrite(band.data(), 1, band.size(), f) == band.size();
+  return (fclose(f) == 0) && ok;
+}
+
+/**
+ * Decoding
+ **/
+uint8_t *ReadQim(const char *fname, int &width, int &height) {
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < HEADER_SIZE) {
+    close(fd);
+    return NULL;
+  }
+  size_t size = st.st_size;
+  const uint8_t *bytes =
+      (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (bytes == MAP_FAILED)
+    return NULL;
+
+  uint32_t w = Get32(bytes + 4), h = Get32(bytes + 8);
+  uint32_t band_rows = Get32(bytes + 12), num_bands = Get32(bytes + 16);
+  size_t table_end = HEADER_SIZE + (size_t)num_bands * 8;
+  bool valid = memcmp(bytes, QIM_MAGIC, 4) == 0 && w > 0 && h > 0 &&
+               w <= (1u << 30) / h && band_rows > 0 &&
+               num_bands == (h + band_rows - 1) / band_rows &&
+               table_end <= size &&
+               Get64(bytes + table_end - 8) == size - table_end;
+
+  uint8_t *pixels = NULL;
+  if (valid) {
+    pixels = (uint8_t *)malloc((size_t)w * h * 4);
+    const uint8_t *data = bytes + table_end;
+    std::atomic<bool> ok(pixels != NULL);
+    if (ok) {
+      ParallelFor(0, num_bands, [&](int b, int e) {
+        for (int i = b; i < e && ok; i++) {
+          uint64_t begin = i ? Get64(bytes + HEADER_SIZE + (i - 1) * 8) : 0;
+          uint64_t end = Get64(bytes + HEADER_SIZE + i * 8);
+          size_t y0 = (size_t)i * band_rows;
+          size_t rows = std::min<size_t>(band_rows, h - y0);
+          if (begin > end || end > size - table_end ||
+              !DecodeBand(data + begin, data + end,
+                          (Rgba *)(pixels + y0 * w * 4), rows * w))
+            ok = false;
+        }
+      });
+    }
+    if (!ok) {
+      free(pixels);
+      pixels = NULL;
+    }
+  }
+  munmap((void *)bytes, size);
+
+  if (pixels) {
+    width = w;
+    height = h;
+  }
+  return pixels;
+}
@@ -0,0 +1,27 @@
+// qim.h
+//
+// A fast lossless RGBA format for handing images between pipeline stages,
+// in the spirit of QOI: a small header, then QOI's run, index, delta and
+// literal ops. The image is split into bands of rows that are coded
+// independently and listed in an offset table, so bands are encoded and
+// decoded in parallel.
+//
+// Layout (integers little-endian):
+//   "qimf" | u32 width | u32 height | u32 band_rows | u32 num_bands
+//   | u64 band_end[num_bands] (offsets past the table) | band data
+
+#ifndef QIM_INCLUDED
+#define QIM_INCLUDED
+
+#include <stdint.h>
+
+// Writes width x height RGBA pixels whose rows start stride pixels apart.
+// Returns false if the file could not be written.
+bool WriteQim(const char *fname, int width, int height, int stride,
+              const uint8_t *rgba);
+
+// Returns the RGBA pixels of a qim file in a malloc'd buffer, or NULL if it
+// cannot be read or is malformed
+uint8_t *ReadQim(const char *fname, int &width, int &height);
+
+#endif
@@ -0,0 +1,198 @@
+#include "server.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+// Bounds the number of requests running at once
+class RequestSlots {
+public:
+  explicit RequestSlots(int n) : free_slots(n) {}
+
+  void Acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+    available.wait(lock, [&] { return free_slots > 0; });
+    free_slots--;
+  }
+
+  void Release() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      free_slots++;
+    }
+    available.notify_one();
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable available;
+  int free_slots;
+};
+
+bool SendAll(int client, const void *bytes, size_t size) {
+  const char *p = (const char *)bytes;
+  while (size > 0) {
+    ssize_t n = write(client, p, size);
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Splits a request line into flags
+std::vector<std::string> Tokenize(const std::string &line) {
+  std::vector<std::string> tokens;
+  size_t i = 0;
+  while (i < line.size()) {
+    while (i < line.size() && isspace((unsigned char)line[i]))
+      i++;
+    size_t start = i;
+    while (i < line.size() && !isspace((unsigned char)line[i]))
+      i++;
+    if (i > start)
+      tokens.push_back(line.substr(start, i - start));
+  }
+  return tokens;
+}
+
+void ServeClient(int client, RequestSlots &slots,
+                 const RequestHandler &handler) {
+  std::string pending;
+  char buf[4096];
+  for (;;) {
+    size_t newline;
+    while ((newline = pending.find('\n')) == std::string::npos) {
+      ssize_t n = read(client, buf, sizeof(buf));
+      if (n <= 0)
+        return;
+      pending.append(buf, n);
+    }
+    std::vector<std::string> tokens = Tokenize(pending.substr(0, newline));
+    pending.erase(0, newline + 1);
+    if (tokens.empty())
+      continue;
+
+    std::vector<char *> argv;
+    for (std::string &t : tokens)
+      argv.push_back(&t[0]);
+    argv.push_back(NULL);
+
+    slots.Acquire();
+    auto start = std::chrono::steady_clock::now();
+    try {
+      handler((int)tokens.size(), argv.data(), client);
+      double ms = std::chrono::duration<double, std::milli>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+      SendLine(client, "ok %.3f", ms);
+    } catch (const std::exception &e) {
+      // Keep the reply on one line
+      std::string msg = e.what();
+      for (char &c : msg)
+        if (c == '\n' || c == '\r')
+          c = ' ';
+      SendLine(client, "error %s", msg.c_str());
+    } catch (...) {
+      // Whatever was thrown, the slot must be given back
+      SendLine(client, "error unknown exception");
+    }
+    slots.Release();
+  }
+}
+
+} // namespace
+
+/**
+ * Replies
+ **/
+void SendLine(int client, const char *fmt, ...) {
+  char line[1024];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(line, sizeof(line) - 1, fmt, args);
+  va_end(args);
+  n = std::min(std::max(n, 0), (int)sizeof(line) - 2);
+  line[n] = '\n';
+  SendAll(client, line, n + 1);
+}
+
+void SendFile(int client, const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    throw std::runtime_error(std::string("could not read ") + path);
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  SendLine(client, "data %ld", size);
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    if (!SendAll(client, buf, n))
+      break;
+  }
+  fclose(f);
+}
+
+/**
+ * Server loop
+ **/
+void Serve(const char *socket_path, int max_concurrent,
+           const RequestHandler &handler) {
+  // A client hanging up mid-reply must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "ERROR: Socket path '%s' is too long\n", socket_path);
+    exit(EXIT_FAILURE);
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  // Replace a stale socket from an earlier run, but never anything else
+  // that happens to be at the path
+  struct stat st;
+  if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(socket_path);
+  if (listener < 0 || bind(listener, (sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(listener, 128) != 0) {
+    fprintf(stderr, "ERROR: Could not listen on '%s'\n", socket_path);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, "image: serving on %s (%d concurrent requests)\n",
+          socket_path, max_concurrent);
+
+  static RequestSlots slots(std::max(max_concurrent, 1));
+  for (;;) {
+    int client = accept(listener, NULL, NULL);
+    if (client < 0)
+      continue;
+    std::thread([client, &handler] {
+      ServeClient(client, slots, handler);
+      close(client);
+    }).detach();
+  }
+}
@@ -0,0 +1,33 @@
+// server.h
+//
+// Daemon mode for the image CLI. Listens on a Unix domain socket and runs
+// each request line as a chain of the usual command line flags, keeping the
+// worker pool and pixel buffer pool warm between requests.
+//
+// Protocol: a request is one line of flags separated by spaces, e.g.
+//   -input in.jpg -blur 2 -output out.png
+// The reply streams one "op <flag> <ms>" line per operation as it finishes,
+// "data <bytes>" followed by the raw file for every -send, and ends with
+// "ok <ms>" or "error <message>".
+
+#ifndef SERVER_INCLUDED
+#define SERVER_INCLUDED
+
+#include <functional>
+
+// Runs the flags of one request, replying to the client socket. Failures are
+// reported by throwing std::exception.
+typedef std::function<void(int argc, char **argv, int client)> RequestHandler;
+
+// Serves forever. At most max_concurrent requests run at once; the rest
+// wait for a free slot.
+void Serve(const char *socket_path, int max_concurrent,
+           const RequestHandler &handler);
+
+// Sends one formatted reply line (the newline is added)
+void SendLine(int client, const char *fmt, ...);
+
+// Sends "data <bytes>" followed by the contents of a file
+void SendFile(int client, const char *path);
+
+#endif
@@ -0,0 +1,400 @@
+#include "stream.h"
+#include "parallel.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+/**
+ * Frame formats
+ **/
+struct FrameFormat {
+  StreamFormat format;
+  // Y4M only
+  std::vector<std::string> header; // tokens after YUV4MPEG2
+  int chroma_shift = 1;            // log2 of the chroma subsampling
+  bool mono = false;
+};
+
+int ChromaSize(int n, int shift) { return (n + (1 << shift) - 1) >> shift; }
+
+size_t FrameBytes(const FrameFormat &f, int w, int h) {
+  if (f.format == STREAM_RGB)
+    return (size_t)w * h * 3;
+  size_t luma = (size_t)w * h;
+  if (f.mono)
+    return luma;
+  return luma + 2 * (size_t)ChromaSize(w, f.chroma_shift) *
+                    ChromaSize(h, f.chroma_shift);
+}
+
+bool ReadLine(FILE *in, std::string &line) {
+  line.clear();
+  int c;
+  while ((c = fgetc(in)) != EOF && c != '\n')
+    line += (char)c;
+  return c != EOF || !line.empty();
+}
+
+std::vector<std::string> Split(const std::string &line) {
+  std::vector<std::string> tokens;
+  size_t i = 0;
+  while (i < line.size()) {
+    size_t end = line.find(' ', i);
+    if (end == std::string::npos)
+      end = line.size();
+    if (end > i)
+      tokens.push_back(line.substr(i, end - i));
+    i = end + 1;
+  }
+  return tokens;
+}
+
+void ReadY4mHeader(FILE *in, FrameFormat &f, int &w, int &h) {
+  std::string line;
+  if (!ReadLine(in, line))
+    throw std::runtime_error("ERROR: Empty video stream");
+  std::vector<std::string> tokens = Split(line);
+  if (tokens.empty() || tokens[0] != "YUV4MPEG2")
+    throw std::runtime_error("ERROR: Input is not a YUV4MPEG2 stream");
+  tokens.erase(tokens.begin());
+
+  w = h = 0;
+  std::string chroma = "420jpeg";
+  for (const std::string &t : tokens) {
+    if (t[0] == 'W')
+      w = atoi(t.c_str() + 1);
+    else if (t[0] == 'H')
+      h = atoi(t.c_str() + 1);
+    else if (t[0] == 'C')
+      chroma = t.substr(1);
+  }
+  if (w <= 0 || h <= 0)
+    throw std::runtime_error("ERROR: Malformed YUV4MPEG2 header");
+  if (chroma == "420jpeg" || chroma == "420paldv" || chroma == "420mpeg2" ||
+      chroma == "420")
+    f.chroma_shift = 1;
+  else if (chroma == "444")
+    f.chroma_shift = 0;
+  else if (chroma == "mono")
+    f.mono = true;
+  else
+    throw std::runtime_error("ERROR: Unsupported YUV4MPEG2 colorspace C" +
+                             chroma);
+  f.header = tokens;
+}
+
+void WriteY4mHeader(FILE *out, const FrameFormat &f, int w, int h) {
+  std::string line = "YUV4MPEG2";
+  for (const std::string &t : f.header) {
+    if (t[0] == 'W')
+      line += " W" + std::to_string(w);
+    else if (t[0] == 'H')
+      line += " H" + std::to_string(h);
+    else
+      line += " " + t;
+  }
+  fprintf(out, "%s\n", line.c_str());
+}
+
+// Studio-swing BT.601, in 16.16 fixed point
+inline void YuvToRgb(int c, int d, int e, Pixel &p) {
+  c = 76309 * (c - 16);
+  d -= 128;
+  e -= 128;
+  p.r = ComponentClamp((c + 104597 * e + 32768) >> 16);
+  p.g = ComponentClamp((c - 25675 * d - 53279 * e + 32768) >> 16);
+  p.b = ComponentClamp((c + 132201 * d + 32768) >> 16);
+}
+
+inline int Luma(int r, int g, int b) {
+  return (16843 * r + 33030 * g + 6423 * b + (16 << 16) + 32768) >> 16;
+}
+
+inline int ChromaU(int r, int g, int b) {
+  return (-9699 * r - 19071 * g + 28770 * b + (128 << 16) + 32768) >> 16;
+}
+
+inline int ChromaV(int r, int g, int b) {
+  return (28770 * r - 24117 * g - 4653 * b + (128 << 16) + 32768) >> 16;
+}
+
+void DecodeFrame(const FrameFormat &f, const uint8_t *data, Image &img) {
+  int w = img.Width(), h = img.Height();
+  if (f.format == STREAM_RGB) {
+    ParallelFor(0, h, [&](int b, int e) {
+      for (int y = b; y < e; y++) {
+        const uint8_t *src = data + (size_t)y * w * 3;
+        Pixel *row = img.Row(y);
+        for (int x = 0; x < w; x++)
+          row[x] = Pixel(src[3 * x], src[3 * x + 1], src[3 * x + 2]);
+      }
+    });
+    return;
+  }
+
+  int s = f.chroma_shift;
+  int cw = ChromaSize(w, s), ch = ChromaSize(h, s);
+  const uint8_t *u = data + (size_t)w * h, *v = u + (size_t)cw * ch;
+  ParallelFor(0, h, [&](int b, int e) {
+    for (int y = b; y < e; y++) {
+      const uint8_t *luma = data + (size_t)y * w;
+      const uint8_t *cu = u + (size_t)(y >> s) * cw;
+      const uint8_t *cv = v + (size_t)(y >> s) * cw;
+      Pixel *row = img.Row(y);
+      for (int x = 0; x < w; x++) {
+        if (f.mono)
+          YuvToRgb(luma[x], 128, 128, row[x]);
+        else
+          YuvToRgb(luma[x], cu[x >> s], cv[x >> s], row[x]);
+        row[x].a = 255;
+      }
+    }
+  });
+}
+
+void EncodeFrame(const FrameFormat &f, const Image &img,
+                 std::vector<uint8_t> &data) {
+  // The filters can leave the frame packed; taking the view unpacks it
+  // once here instead of from the encode workers
+  ImageView view = img.View();
+  int w = view.width, h = view.height;
+  data.resize(FrameBytes(f, w, h));
+  if (f.format == STREAM_RGB) {
+    ParallelFor(0, h, [&](int b, int e) {
+      for (int y = b; y < e; y++) {
+        uint8_t *dst = &data[(size_t)y * w * 3];
+        const Pixel *row = view.Row(y);
+        for (int x = 0; x < w; x++) {
+          dst[3 * x] = row[x].r;
+          dst[3 * x + 1] = row[x].g;
+          dst[3 * x + 2] = row[x].b;
+        }
+      }
+    });
+    return;
+  }
+
+  ParallelFor(0, h, [&](int b, int e) {
+    for (int y = b; y < e; y++) {
+      uint8_t *luma = &data[(size_t)y * w];
+      const Pixel *row = view.Row(y);
+      for (int x = 0; x < w; x++)
+        luma[x] = ComponentClamp(Luma(row[x].r, row[x].g, row[x].b));
+    }
+  });
+  if (f.mono)
+    return;
+
+  // Each chroma sample averages the pixels it covers
+  int s = f.chroma_shift;
+  int cw = ChromaSize(w, s), ch = ChromaSize(h, s);
+  uint8_t *u = &data[(size_t)w * h], *v = u + (size_t)cw * ch;
+  ParallelFor(0, ch, [&](int b, int e) {
+    for (int cy = b; cy < e; cy++) {
+      int y0 = cy << s, y1 = std::min(h, (cy + 1) << s);
+      for (int cx = 0; cx < cw; cx++) {
+        int x0 = cx << s, x1 = std::min(w, (cx + 1) << s);
+        int r = 0, g = 0, bl = 0, n = (x1 - x0) * (y1 - y0);
+        for (int y = y0; y < y1; y++) {
+          const Pixel *row = view.Row(y);
+          for (int x = x0; x < x1; x++)
+            r += row[x].r, g += row[x].g, bl += row[x].b;
+        }
+        r = (r + n / 2) / n, g = (g + n / 2) / n, bl = (bl + n / 2) / n;
+        u[(size_t)cy * cw + cx] = ComponentClamp(ChromaU(r, g, bl));
+        v[(size_t)cy * cw + cx] = ComponentClamp(ChromaV(r, g, bl));
+      }
+    }
+  });
+}
+
+/**
+ * Pipeline
+ **/
+// Frames in flight between the reader, the frame workers and the writer
+class Pipeline {
+public:
+  explicit Pipeline(int max_in_flight) : max_in_flight(max_in_flight) {}
+
+  ~Pipeline() {
+    for (auto &job : pending)
+      delete job.second;
+    for (auto &done : finished)
+      delete done.second;
+  }
+
+  // Reader: waits for room, then queues a decoded frame. Returns false once
+  // the pipeline has failed.
+  bool Push(long index, Image *frame) {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] { return error || in_flight < max_in_flight; });
+    if (error) {
+      delete frame;
+      return false;
+    }
+    pending.push_back({index, frame});
+    in_flight++;
+    changed.notify_all();
+    return true;
+  }
+
+  void Close(long num_frames) {
+    std::lock_guard<std::mutex> lock(mutex);
+    total = num_frames;
+    changed.notify_all();
+  }
+
+  // Frame worker: filters queued frames until the input is exhausted
+  void Work(const FrameFilter &filter) {
+    for (;;) {
+      std::pair<long, Image *> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock,
+                     [&] { return error || !pending.empty() || total >= 0; });
+        if (error || pending.empty())
+          return;
+        job = pending.front();
+        pending.pop_front();
+      }
+      Image *result = NULL;
+      try {
+        result = filter(job.second);
+      } catch (...) {
+        Fail(std::current_exception());
+        return;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      finished[job.first] = result;
+      changed.notify_all();
+    }
+  }
+
+  // Writer: returns the next frame in input order, or NULL at the end
+  Image *Next() {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] {
+      return error || finished.count(next) || (total >= 0 && next >= total);
+    });
+    if (error || !finished.count(next))
+      return NULL;
+    Image *frame = finished[next];
+    finished.erase(next++);
+    in_flight--;
+    changed.notify_all();
+    return frame;
+  }
+
+  void Fail(std::exception_ptr e) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error)
+      error = e;
+    changed.notify_all();
+  }
+
+  std::exception_ptr Error() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return error;
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable changed;
+  int max_in_flight, in_flight = 0;
+  std::deque<std::pair<long, Image *>> pending; // decoded, not yet filtered
+  std::map<long, Image *> finished;             // filtered, not yet written
+  long next = 0, total = -1;
+  std::exception_ptr error;
+};
+
+} // namespace
+
+void StreamFrames(FILE *in, FILE *out, StreamFormat format, int rgb_width,
+                  int rgb_height, const FrameFilter &filter) {
+  FrameFormat f;
+  f.format = format;
+  int w = rgb_width, h = rgb_height;
+  if (format == STREAM_Y4M)
+    ReadY4mHeader(in, f, w, h);
+  if (w <= 0 || h <= 0)
+    throw std::runtime_error("ERROR: Invalid frame size");
+
+  // Enough frames in flight to keep every frame worker busy while the
+  // reader and writer block on the pipes
+  int workers = std::max(2, NumThreads());
+  Pipeline pipeline(2 * workers);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < workers; i++)
+    threads.emplace_back([&] { pipeline.Work(filter); });
+
+  std::thread reader([&] {
+    std::vector<uint8_t> data(FrameBytes(f, w, h));
+    long index = 0;
+    try {
+      std::string line;
+      for (;; index++) {
+        if (format == STREAM_Y4M) {
+          if (!ReadLine(in, line))
+            break;
+          if (line.compare(0, 5, "FRAME") != 0)
+            throw std::runtime_error(
+                "ERROR: Malformed YUV4MPEG2 frame header");
+        }
+        size_t got = fread(data.data(), 1, data.size(), in);
+        if (got == 0 && format == STREAM_RGB)
+          break;
+        if (got != data.size())
+          throw std::runtime_error("ERROR: Truncated frame in video stream");
+        Image *frame = new Image(w, h);
+        DecodeFrame(f, data.data(), *frame);
+        if (!pipeline.Push(index, frame))
+          break;
+      }
+    } catch (...) {
+      pipeline.Fail(std::current_exception());
+    }
+    pipeline.Close(index);
+  });
+
+  int out_w = -1, out_h = -1;
+  std::vector<uint8_t> data;
+  while (Image *frame = pipeline.Next()) {
+    try {
+      if (out_w < 0) {
+        out_w = frame->Width();
+        out_h = frame->Height();
+        if (format == STREAM_Y4M)
+          WriteY4mHeader(out, f, out_w, out_h);
+      }
+      if (frame->Width() != out_w || frame->Height() != out_h)
+        throw std::runtime_error("ERROR: Filtered frames differ in size");
+      EncodeFrame(f, *frame, data);
+      if (format == STREAM_Y4M)
+        fputs("FRAME\n", out);
+      if (fwrite(data.data(), 1, data.size(), out) != data.size())
+        throw std::runtime_error("ERROR: Could not write the video stream");
+    } catch (...) {
+      pipeline.Fail(std::current_exception());
+    }
+    delete frame;
+  }
+  if (out_w < 0 && format == STREAM_Y4M && !pipeline.Error())
+    WriteY4mHeader(out, f, w, h);
+  fflush(out);
+
+  reader.join();
+  for (std::thread &t : threads)
+    t.join();
+  if (std::exception_ptr e = pipeline.Error())
+    std::rethrow_exception(e);
+}
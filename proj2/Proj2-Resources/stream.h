@@ -0,0 +1,34 @@
+// stream.h
+//
+// Streaming mode for the image CLI: runs the op chain on every frame of a
+// raw video stream, so the tool can sit between a decoder and an encoder,
+// e.g.
+//   ffmpeg -i in.mp4 -f yuv4mpegpipe - | image -stream y4m -blur 3 | ...
+//
+// Frames are decoded by one reader, filtered by a pool of frame workers and
+// written by one writer in input order, so the three stages overlap.
+
+#ifndef STREAM_INCLUDED
+#define STREAM_INCLUDED
+
+#include "image.h"
+#include <functional>
+#include <stdio.h>
+
+enum StreamFormat {
+  STREAM_Y4M, // YUV4MPEG2 with 4:2:0, 4:4:4 or mono frames
+  STREAM_RGB, // packed 8-bit RGB frames of a given size, no header
+};
+
+// Filters one frame. Takes ownership of the frame and returns the image to
+// write, which may be the same one. Failures are reported by throwing.
+typedef std::function<Image *(Image *frame)> FrameFilter;
+
+// Filters every frame of in and writes the results to out. rgb_width and
+// rgb_height give the frame size of STREAM_RGB input. Frames of a Y4M
+// stream are written with the header of the input, resized to the filtered
+// frames. Throws std::runtime_error on malformed input or a failed write.
+void StreamFrames(FILE *in, FILE *out, StreamFormat format, int rgb_width,
+                  int rgb_height, const FrameFilter &filter);
+
+#endif
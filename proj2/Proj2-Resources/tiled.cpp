@@ -0,0 +1,311 @@
+#include "tiled.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <unistd.h>
+
+namespace {
+
+const size_t TILE_BYTES = (size_t)TILE_SIZE * TILE_SIZE * sizeof(Pixel);
+
+size_t CacheTiles() {
+  const char *env = getenv("IMAGE_TILE_CACHE_MB");
+  long long mb = env ? atoll(env) : 1024;
+  // Every thread may pin a source and a destination tile at once
+  size_t min_tiles = 4 * NumThreads() + 4;
+  return std::max<size_t>(((size_t)std::max(mb, 0LL) << 20) / TILE_BYTES,
+                          min_tiles);
+}
+
+std::string Describe(const char *fmt, const char *fname) {
+  char msg[1024];
+  snprintf(msg, sizeof(msg), fmt, fname);
+  return msg;
+}
+
+// Next integer of a PPM header or P3 body, skipping whitespace and comments
+bool ReadInt(FILE *f, int &value) {
+  int c = getc_unlocked(f);
+  while (c != EOF && (isspace(c) || c == '#')) {
+    if (c == '#')
+      while (c != EOF && c != '\n')
+        c = getc_unlocked(f);
+    c = getc_unlocked(f);
+  }
+  if (c == EOF || !isdigit(c))
+    return false;
+  value = 0;
+  while (c != EOF && isdigit(c)) {
+    value = value * 10 + (c - '0');
+    c = getc_unlocked(f);
+  }
+  return true;
+}
+
+} // namespace
+
+/**
+ * Tile cache
+ **/
+TiledImage::TiledImage(int width_, int height_)
+    : width(width_), height(height_),
+      tiles_x((width_ + TILE_SIZE - 1) / TILE_SIZE),
+      tiles_y((height_ + TILE_SIZE - 1) / TILE_SIZE), capacity(CacheTiles()),
+      on_disk((size_t)tiles_x * tiles_y, false) {
+  assert(width > 0 && height > 0);
+  const char *dir = getenv("IMAGE_SCRATCH_DIR");
+  std::string path = std::string(dir && *dir ? dir : "/tmp") +
+                     "/image-tiles-XXXXXX";
+  fd = mkstemp(&path[0]);
+  if (fd < 0)
+    throw std::runtime_error(
+        Describe("ERROR: Could not create scratch file in '%s'",
+                 path.substr(0, path.rfind('/')).c_str()));
+  // The file lives only as long as the descriptor
+  unlink(path.c_str());
+}
+
+TiledImage::~TiledImage() { close(fd); }
+
+// Writes back and drops an unpinned tile; the caller holds the lock
+void TiledImage::Evict(int index) {
+  Tile &tile = cache[index];
+  if (tile.dirty) {
+    if (pwrite(fd, tile.pixels.data(), TILE_BYTES,
+               (off_t)index * TILE_BYTES) != (ssize_t)TILE_BYTES)
+      throw std::runtime_error("ERROR: Could not write to the scratch file");
+    on_disk[index] = true;
+  }
+  lru.erase(tile.lru);
+  cache.erase(index);
+}
+
+Pixel *TiledImage::Acquire(int tx, int ty, bool overwrite) {
+  int index = ty * tiles_x + tx;
+  std::unique_lock<std::mutex> lock(mutex);
+  auto it = cache.find(index);
+  if (it != cache.end()) {
+    Tile &tile = it->second;
+    tile.pins++;
+    lru.splice(lru.begin(), lru, tile.lru);
+    return tile.pixels.data();
+  }
+
+  // Make room by evicting the least recently used unpinned tile
+  while (cache.size() >= capacity) {
+    auto victim = std::find_if(lru.rbegin(), lru.rend(), [&](int i) {
+      return cache[i].pins == 0;
+    });
+    if (victim != lru.rend())
+      Evict(*victim);
+    else
+      unpinned.wait(lock);
+  }
+
+  Tile &tile = cache[index];
+  tile.pixels.assign((size_t)TILE_SIZE * TILE_SIZE, Pixel(0, 0, 0, 0));
+  if (on_disk[index] && !overwrite &&
+      pread(fd, tile.pixels.data(), TILE_BYTES, (off_t)index * TILE_BYTES) !=
+          (ssize_t)TILE_BYTES)
+    throw std::runtime_error("ERROR: Could not read the scratch file");
+  tile.pins = 1;
+  lru.push_front(index);
+  tile.lru = lru.begin();
+  return tile.pixels.data();
+}
+
+void TiledImage::Release(int tx, int ty, bool dirty) {
+  std::lock_guard<std::mutex> lock(mutex);
+  Tile &tile = cache[ty * tiles_x + tx];
+  tile.dirty = tile.dirty || dirty;
+  if (--tile.pins == 0)
+    unpinned.notify_all();
+}
+
+/**
+ * Rectangle access
+ **/
+void TiledImage::ReadRect(int x, int y, int w, int h, Pixel *dst,
+                          int dst_stride) {
+  assert(x < width && y < height && x + w > 0 && y + h > 0);
+  // Copy the part inside the image, then replicate its edges outward
+  int ix0 = std::max(x, 0), ix1 = std::min(x + w, width);
+  int iy0 = std::max(y, 0), iy1 = std::min(y + h, height);
+
+  for (int ty = iy0 / TILE_SIZE; ty <= (iy1 - 1) / TILE_SIZE; ty++) {
+    for (int tx = ix0 / TILE_SIZE; tx <= (ix1 - 1) / TILE_SIZE; tx++) {
+      const Pixel *tile = Acquire(tx, ty);
+      int x0 = std::max(ix0, tx * TILE_SIZE);
+      int x1 = std::min(ix1, (tx + 1) * TILE_SIZE);
+      int y0 = std::max(iy0, ty * TILE_SIZE);
+      int y1 = std::min(iy1, (ty + 1) * TILE_SIZE);
+      for (int yy = y0; yy < y1; yy++)
+        memcpy(dst + (size_t)(yy - y) * dst_stride + (x0 - x),
+               tile + (size_t)(yy - ty * TILE_SIZE) * TILE_SIZE +
+                   (x0 - tx * TILE_SIZE),
+               (x1 - x0) * sizeof(Pixel));
+      Release(tx, ty, false);
+    }
+  }
+
+  int left = ix0 - x, right = x + w - ix1; // columns to replicate
+  int top = iy0 - y, bottom = y + h - iy1;
+  for (int dy = top; dy < h - bottom; dy++) {
+    Pixel *row = dst + (size_t)dy * dst_stride;
+    for (int dx = 0; dx < left; dx++)
+      row[dx] = row[left];
+    for (int dx = w - right; dx < w; dx++)
+      row[dx] = row[w - right - 1];
+  }
+  for (int dy = 0; dy < top; dy++)
+    memcpy(dst + (size_t)dy * dst_stride, dst + (size_t)top * dst_stride,
+           w * sizeof(Pixel));
+  for (int dy = h - bottom; dy < h; dy++)
+    memcpy(dst + (size_t)dy * dst_stride,
+           dst + (size_t)(h - bottom - 1) * dst_stride, w * sizeof(Pixel));
+}
+
+void TiledImage::WriteRect(int x, int y, int w, int h, const Pixel *src,
+                           int src_stride) {
+  assert(x >= 0 && y >= 0 && x + w <= width && y + h <= height);
+  for (int ty = y / TILE_SIZE; ty <= (y + h - 1) / TILE_SIZE; ty++) {
+    for (int tx = x / TILE_SIZE; tx <= (x + w - 1) / TILE_SIZE; tx++) {
+      int x0 = std::max(x, tx * TILE_SIZE);
+      int x1 = std::min(x + w, (tx + 1) * TILE_SIZE);
+      int y0 = std::max(y, ty * TILE_SIZE);
+      int y1 = std::min(y + h, (ty + 1) * TILE_SIZE);
+      // A write covering the whole tile needs none of its old contents
+      bool whole = x0 == tx * TILE_SIZE && y0 == ty * TILE_SIZE &&
+                   x1 == std::min(width, (tx + 1) * TILE_SIZE) &&
+                   y1 == std::min(height, (ty + 1) * TILE_SIZE);
+      Pixel *tile = Acquire(tx, ty, whole);
+      for (int yy = y0; yy < y1; yy++)
+        memcpy(tile + (size_t)(yy - ty * TILE_SIZE) * TILE_SIZE +
+                   (x0 - tx * TILE_SIZE),
+               src + (size_t)(yy - y) * src_stride + (x0 - x),
+               (x1 - x0) * sizeof(Pixel));
+      Release(tx, ty, true);
+    }
+  }
+}
+
+/**
+ * File I/O
+ **/
+TiledImage *TiledImage::Load(const char *fname) {
+  FILE *f = fopen(fname, "rb");
+  if (!f)
+    throw std::runtime_error(
+        Describe("ERROR: Image file '%s' not found.", fname));
+
+  char magic[3] = {0};
+  int w, h, maximum;
+  bool ok = fread(magic, 1, 2, f) == 2 &&
+            (!strcmp(magic, "P3") || !strcmp(magic, "P6")) && ReadInt(f, w) &&
+            ReadInt(f, h) && ReadInt(f, maximum) && w > 0 && h > 0 &&
+            maximum > 0 && maximum <= 255;
+  if (!ok) {
+    fclose(f);
+    throw std::runtime_error(
+        Describe("ERROR: '%s' is not an 8-bit P3 or P6 PPM file", fname));
+  }
+
+  TiledImage *img = new TiledImage(w, h);
+  std::vector<Pixel> row(w);
+  std::vector<uint8_t> bytes(3 * (size_t)w);
+  for (int y = 0; y < h && ok; y++) {
+    if (magic[1] == '6') {
+      ok = fread(bytes.data(), 1, bytes.size(), f) == bytes.size();
+    } else {
+      for (size_t i = 0; i < bytes.size() && ok; i++) {
+        int v;
+        ok = ReadInt(f, v);
+        bytes[i] = std::min(v, maximum);
+      }
+    }
+    for (int x = 0; x < w; x++)
+      row[x] = Pixel(bytes[3 * x] * 255 / maximum,
+                     bytes[3 * x + 1] * 255 / maximum,
+                     bytes[3 * x + 2] * 255 / maximum);
+    if (ok)
+      img->WriteRect(0, y, w, 1, row.data(), w);
+  }
+  fclose(f);
+  if (!ok) {
+    delete img;
+    throw std::runtime_error(
+        Describe("ERROR: PPM file '%s' is truncated", fname));
+  }
+  return img;
+}
+
+void TiledImage::Save(const char *fname) {
+  FILE *f = fopen(fname, "wb");
+  if (!f)
+    throw std::runtime_error(
+        Describe("ERROR: Could not create file '%s'", fname));
+  fprintf(f, "P6\n%d %d\n255\n", width, height);
+
+  std::vector<Pixel> row(width);
+  std::vector<uint8_t> bytes(3 * (size_t)width);
+  bool ok = true;
+  for (int y = 0; y < height && ok; y++) {
+    ReadRect(0, y, width, 1, row.data(), width);
+    for (int x = 0; x < width; x++) {
+      bytes[3 * x] = row[x].r;
+      bytes[3 * x + 1] = row[x].g;
+      bytes[3 * x + 2] = row[x].b;
+    }
+    ok = fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size();
+  }
+  ok = (fclose(f) == 0) && ok;
+  if (!ok)
+    throw std::runtime_error(
+        Describe("ERROR: Could not write file '%s'", fname));
+}
+
+/**
+ * Tiled filters
+ **/
+void ForEachTile(TiledImage &img, const std::function<void(Image &tile)> &op) {
+  int tiles = img.TilesX() * img.TilesY();
+  ParallelFor(0, tiles, [&](int b, int e) {
+    for (int i = b; i < e; i++) {
+      int tx = i % img.TilesX(), ty = i / img.TilesX();
+      Pixel *pixels = img.Acquire(tx, ty);
+      int w = std::min(TILE_SIZE, img.Width() - tx * TILE_SIZE);
+      int h = std::min(TILE_SIZE, img.Height() - ty * TILE_SIZE);
+      Image tile(ImageView{pixels, w, h, TILE_SIZE});
+      op(tile);
+      img.Release(tx, ty, true);
+    }
+  });
+}
+
+TiledImage *MapWithHalo(TiledImage &src, int halo,
+                        const std::function<void(Image &padded)> &op) {
+  TiledImage *dst = new TiledImage(src.Width(), src.Height());
+  int tiles = src.TilesX() * src.TilesY();
+  ParallelFor(0, tiles, [&](int b, int e) {
+    for (int i = b; i < e; i++) {
+      int tx = i % src.TilesX(), ty = i / src.TilesX();
+      int x = tx * TILE_SIZE, y = ty * TILE_SIZE;
+      int w = std::min(TILE_SIZE, src.Width() - x);
+      int h = std::min(TILE_SIZE, src.Height() - y);
+
+      int pw = w + 2 * halo, ph = h + 2 * halo;
+      Image padded(pw, ph);
+      src.ReadRect(x - halo, y - halo, pw, ph, padded.Row(0), pw);
+      op(padded);
+      dst->WriteRect(x, y, w, h, padded.Row(halo) + halo, pw);
+    }
+  });
+  return dst;
+}
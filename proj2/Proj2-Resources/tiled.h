@@ -0,0 +1,94 @@
+// tiled.h
+//
+// Disk-backed tiled images for inputs larger than RAM. Pixels live in
+// square tiles in an unlinked scratch file and are paged through an LRU
+// cache of IMAGE_TILE_CACHE_MB megabytes (default 1024), so peak memory is
+// set by the cache, not by the image size. Scratch files go to
+// IMAGE_SCRATCH_DIR (default /tmp).
+//
+// Filters run tile by tile on the worker pool, reusing the Image
+// operations: point ops see each tile as an Image wrapping the cached
+// pixels, neighbourhood ops see each tile padded with a halo of its
+// neighbours' pixels.
+
+#ifndef TILED_INCLUDED
+#define TILED_INCLUDED
+
+#include "image.h"
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+const int TILE_SIZE = 256;
+
+class TiledImage {
+public:
+  // A blank (all zero) image
+  TiledImage(int width, int height);
+  ~TiledImage();
+
+  TiledImage(const TiledImage &) = delete;
+  TiledImage &operator=(const TiledImage &) = delete;
+
+  // Streams a P3 or P6 PPM file in row by row
+  static TiledImage *Load(const char *fname);
+
+  // Streams the image out as a binary (P6) PPM file
+  void Save(const char *fname);
+
+  int Width() const { return width; }
+  int Height() const { return height; }
+  int TilesX() const { return tiles_x; }
+  int TilesY() const { return tiles_y; }
+
+  // Copies the w x h rectangle at (x, y) into dst, whose rows are
+  // dst_stride pixels apart. Coordinates outside the image are clamped to
+  // the nearest edge pixel.
+  void ReadRect(int x, int y, int w, int h, Pixel *dst, int dst_stride);
+
+  // Copies src into the w x h rectangle at (x, y), which must lie inside
+  // the image
+  void WriteRect(int x, int y, int w, int h, const Pixel *src,
+                 int src_stride);
+
+  // Pins tile (tx, ty) in the cache and returns its TILE_SIZE x TILE_SIZE
+  // pixels. Every Acquire needs a matching Release; dirty marks the tile as
+  // modified. With overwrite, the old contents are not read from disk.
+  Pixel *Acquire(int tx, int ty, bool overwrite = false);
+  void Release(int tx, int ty, bool dirty);
+
+private:
+  struct Tile {
+    std::vector<Pixel> pixels;
+    bool dirty = false;
+    int pins = 0;
+    std::list<int>::iterator lru;
+  };
+
+  void Evict(int index);
+
+  int width, height, tiles_x, tiles_y;
+  int fd;
+  size_t capacity; // tiles kept in memory
+
+  std::mutex mutex;
+  std::condition_variable unpinned;
+  std::unordered_map<int, Tile> cache;
+  std::list<int> lru; // most recently used first
+  std::vector<bool> on_disk;
+};
+
+// Runs a point op on every tile in place
+void ForEachTile(TiledImage &img, const std::function<void(Image &tile)> &op);
+
+// Runs a neighbourhood op that reads at most halo pixels away from each
+// output pixel. Each tile is handed to op padded by halo pixels on every
+// side (clamped at the image edges, as Convolve does) and the center of the
+// result is kept. Returns the filtered image; src is left unchanged.
+TiledImage *MapWithHalo(TiledImage &src, int halo,
+                        const std::function<void(Image &padded)> &op);
+
+#endif
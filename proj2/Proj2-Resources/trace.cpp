@@ -0,0 +1,156 @@
+#include "trace.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <sys/resource.h>
+#include <time.h>
+#include <vector>
+
+namespace {
+
+struct TraceEvent {
+  std::string op;
+  double start_us, wall_us, cpu_us;
+  long long pixels;
+  long long bytes_allocated;
+  long peak_rss_kb;
+};
+
+bool enabled = false;
+std::string trace_file;
+std::vector<TraceEvent> events;
+std::atomic<long long> bytes_allocated{0};
+
+// State of the operation in flight
+TraceEvent current;
+double cpu_start_us;
+long long alloc_start;
+
+std::chrono::steady_clock::time_point trace_start;
+
+double WallMicros() {
+  return std::chrono::duration<double, std::micro>(
+             std::chrono::steady_clock::now() - trace_start)
+      .count();
+}
+
+// CPU time of the whole process, so worker threads are included
+double CpuMicros() {
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+long PeakRssKb() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// Escapes the characters JSON strings cannot hold as-is
+std::string JsonString(const std::string &s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\')
+      out += '\\';
+    out += c;
+  }
+  return out + "\"";
+}
+
+} // namespace
+
+/**
+ * Trace recording
+ **/
+void TraceEnable(const char *fname) {
+  enabled = true;
+  trace_file = fname;
+  trace_start = std::chrono::steady_clock::now();
+}
+
+bool TraceEnabled() { return enabled; }
+
+void TraceAlloc(long long bytes) {
+  if (enabled)
+    bytes_allocated.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void TraceBegin(const char *op) {
+  if (!enabled)
+    return;
+  current = TraceEvent();
+  current.op = op;
+  current.start_us = WallMicros();
+  cpu_start_us = CpuMicros();
+  alloc_start = bytes_allocated.load();
+}
+
+void TraceEnd(long long pixels) {
+  if (!enabled)
+    return;
+  current.wall_us = WallMicros() - current.start_us;
+  current.cpu_us = CpuMicros() - cpu_start_us;
+  current.pixels = pixels;
+  current.bytes_allocated = bytes_allocated.load() - alloc_start;
+  current.peak_rss_kb = PeakRssKb();
+  events.push_back(current);
+}
+
+void TraceFinish() {
+  if (!enabled)
+    return;
+
+  FILE *f = fopen(trace_file.c_str(), "w");
+  if (!f) {
+    fprintf(stderr, "ERROR: Could not create trace file '%s'\n",
+            trace_file.c_str());
+  } else {
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (size_t i = 0; i < events.size(); i++) {
+      const TraceEvent &e = events[i];
+      fprintf(f,
+              "  {\"name\": %s, \"cat\": \"image\", \"ph\": \"X\", "
+              "\"pid\": 1, \"tid\": 1, \"ts\": %.1f, \"dur\": %.1f, "
+              "\"args\": {\"cpu_us\": %.1f, \"pixels\": %lld, "
+              "\"bytes_allocated\": %lld, \"peak_rss_kb\": %ld}}%s\n",
+              JsonString(e.op).c_str(), e.start_us, e.wall_us, e.cpu_us,
+              e.pixels, e.bytes_allocated, e.peak_rss_kb,
+              i + 1 < events.size() ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    fclose(f);
+  }
+
+  // Summary, one line per operation in the order it first ran
+  std::vector<std::string> order;
+  std::map<std::string, TraceEvent> totals;
+  std::map<std::string, int> counts;
+  for (const TraceEvent &e : events) {
+    if (!counts[e.op]++) {
+      order.push_back(e.op);
+      totals[e.op] = e;
+      continue;
+    }
+    TraceEvent &t = totals[e.op];
+    t.wall_us += e.wall_us;
+    t.cpu_us += e.cpu_us;
+    t.pixels += e.pixels;
+    t.bytes_allocated += e.bytes_allocated;
+    if (e.peak_rss_kb > t.peak_rss_kb)
+      t.peak_rss_kb = e.peak_rss_kb;
+  }
+
+  fprintf(stderr, "%-24s %5s %11s %11s %12s %12s %10s\n", "operation",
+          "calls", "wall ms", "cpu ms", "Mpixels", "alloc MB", "peak MB");
+  for (const std::string &op : order) {
+    const TraceEvent &t = totals[op];
+    fprintf(stderr, "%-24s %5d %11.2f %11.2f %12.2f %12.2f %10.1f\n",
+            op.c_str(), counts[op], t.wall_us / 1e3, t.cpu_us / 1e3,
+            t.pixels / 1e6, t.bytes_allocated / (1024.0 * 1024.0),
+            t.peak_rss_kb / 1024.0);
+  }
+}
@@ -0,0 +1,27 @@
+// trace.h
+//
+// Opt-in per-operation trace for the image CLI. Records wall time, CPU time,
+// pixels touched, bytes of pixel buffers allocated and peak RSS for every
+// operation, and on TraceFinish writes them as Chrome trace-event JSON
+// (chrome://tracing, Perfetto) plus a summary table on stderr. When tracing
+// is off every call is a single branch.
+
+#ifndef TRACE_INCLUDED
+#define TRACE_INCLUDED
+
+// Starts recording; the JSON trace goes to fname
+void TraceEnable(const char *fname);
+
+bool TraceEnabled();
+
+// Brackets one operation. "pixels" is the number of pixels it touched.
+void TraceBegin(const char *op);
+void TraceEnd(long long pixels);
+
+// Counts an allocation of the given size against the operation in flight
+void TraceAlloc(long long bytes);
+
+// Writes the trace file and the summary table
+void TraceFinish();
+
+#endif
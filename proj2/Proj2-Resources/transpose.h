@@ -0,0 +1,41 @@
+// transpose.h
+//
+// Cache-blocked matrix transpose. In a row-major image, vertically adjacent
+// pixels sit a whole row apart, so a naive transpose writes (or reads) a
+// new cache line for every element. Working in small square tiles touches
+// each line several times while it is still cached.
+
+#ifndef TRANSPOSE_INCLUDED
+#define TRANSPOSE_INCLUDED
+
+#include <algorithm>
+#include <stddef.h>
+
+const int TRANSPOSE_TILE = 8;
+
+// Writes the transpose of the rows x cols matrix src into dst, so that
+// dst[c * dst_stride + r] = src[r * src_stride + c]. Strides are in
+// elements.
+template <class T>
+void Transpose(const T *src, size_t src_stride, T *dst, size_t dst_stride,
+               int rows, int cols) {
+  for (int r0 = 0; r0 < rows; r0 += TRANSPOSE_TILE) {
+    int r1 = std::min(r0 + TRANSPOSE_TILE, rows);
+    for (int c0 = 0; c0 < cols; c0 += TRANSPOSE_TILE) {
+      int c1 = std::min(c0 + TRANSPOSE_TILE, cols);
+      if (r1 - r0 == TRANSPOSE_TILE && c1 - c0 == TRANSPOSE_TILE) {
+        // Full tiles have constant bounds the compiler can unroll
+        for (int c = 0; c < TRANSPOSE_TILE; c++)
+          for (int r = 0; r < TRANSPOSE_TILE; r++)
+            dst[(size_t)(c0 + c) * dst_stride + r0 + r] =
+                src[(size_t)(r0 + r) * src_stride + c0 + c];
+      } else {
+        for (int c = c0; c < c1; c++)
+          for (int r = r0; r < r1; r++)
+            dst[(size_t)c * dst_stride + r] = src[(size_t)r * src_stride + c];
+      }
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,124 @@
+#include "tune.h"
+#include "composite.h"
+#include "parallel.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <random>
+#include <vector>
+
+namespace {
+
+const int TUNE_REPS = 3;          // each setting is timed as the best of 3
+const double TUNE_MIN_GAIN = 0.97; // a new best must be 3% faster
+
+const int TILE_WIDTHS[] = {32, 64, 128, 256, 512};
+const int TILE_HEIGHTS[] = {16, 32, 64, 128, 256};
+const int ROW_GRAINS[] = {1, 2, 4, 8, 16, 32, 64};
+
+// How an operation splits its work: 2D tiles, or bands of rows that only
+// take the tile height
+enum Split { SPLIT_TILES, SPLIT_ROWS };
+
+struct Benchmark {
+  const char *op; // as passed to TuneScope
+  Split split;
+  std::function<void(Image &)> run;
+};
+
+std::vector<Benchmark> Benchmarks() {
+  return {
+      {"convolve", SPLIT_ROWS, [](Image &img) { img.Blur(2); }},
+      {"quantize", SPLIT_ROWS, [](Image &img) { img.Quantize(3); }},
+      {"saturation", SPLIT_ROWS, [](Image &img) { img.ChangeSaturation(60); }},
+      {"contrast", SPLIT_ROWS, [](Image &img) { img.ChangeContrast(60); }},
+      {"median", SPLIT_TILES, [](Image &img) { img.Median(3); }},
+      {"bilateral", SPLIT_TILES, [](Image &img) { img.Bilateral(8, 24); }},
+      {"kuwahara", SPLIT_TILES, [](Image &img) { img.Kuwahara(4); }},
+      {"morph", SPLIT_TILES, [](Image &img) { img.Erode(7, 7); }},
+      {"resample", SPLIT_TILES, [](Image &img) { delete img.Rotate(0.3); }},
+      {"flatten", SPLIT_TILES,
+       [](Image &img) {
+         ImageView v = img.View();
+         FlattenLayers({{v, BLEND_NORMAL, 255},
+                        {v, BLEND_MULTIPLY, 128},
+                        {v, BLEND_SCREEN, 64}},
+                       v);
+       }},
+  };
+}
+
+// Smooth gradients with some noise, so the data-dependent filters do
+// typical work
+Image *SamplePattern() {
+  Image *img = new Image(TUNE_SAMPLE_SIZE, TUNE_SAMPLE_SIZE);
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<int> noise(-24, 24);
+  for (int y = 0; y < img->Height(); y++) {
+    Pixel *row = img->Row(y);
+    for (int x = 0; x < img->Width(); x++)
+      row[x].SetClamp(128 + 100 * sin(x * 0.011) + noise(rng),
+                      128 + 100 * cos(y * 0.017) + noise(rng),
+                      (x ^ y) % 256 + noise(rng));
+  }
+  return img;
+}
+
+// Seconds for the best of TUNE_REPS runs on fresh copies of sample
+double Time(const Benchmark &bench, const Image &sample,
+            const TuneParams &params) {
+  SetTuneParams(bench.op, params);
+  double best = INFINITY;
+  for (int rep = 0; rep < TUNE_REPS; rep++) {
+    Image img(sample);
+    auto start = std::chrono::steady_clock::now();
+    bench.run(img);
+    std::chrono::duration<double> took =
+        std::chrono::steady_clock::now() - start;
+    best = std::min(best, took.count());
+  }
+  return best;
+}
+
+void Tune(const Benchmark &bench, const Image &sample, FILE *log) {
+  TuneParams best;
+  double best_time = Time(bench, sample, best);
+  double default_time = best_time;
+  auto Try = [&](const TuneParams &p) {
+    double t = Time(bench, sample, p);
+    if (t < best_time * TUNE_MIN_GAIN)
+      best = p, best_time = t;
+  };
+
+  if (bench.split == SPLIT_TILES) {
+    for (int tw : TILE_WIDTHS)
+      for (int th : TILE_HEIGHTS)
+        Try(TuneParams{0, tw, th});
+  } else {
+    for (int rows : ROW_GRAINS)
+      Try(TuneParams{0, 0, rows});
+  }
+
+  // Fewer threads can win when a pass is memory bound
+  TuneParams tile = best;
+  for (int n = 1; n < NumThreads(); n *= 2)
+    Try(TuneParams{n, tile.tile_w, tile.tile_h});
+
+  SetTuneParams(bench.op, best);
+  fprintf(log, "%-10s threads %2d tile %3dx%-3d  %8.2f ms (default %.2f ms)\n",
+          bench.op, best.threads, best.tile_w, best.tile_h, best_time * 1e3,
+          default_time * 1e3);
+}
+
+} // namespace
+
+void AutoTune(const Image *sample, FILE *log) {
+  Image *pattern = sample ? NULL : SamplePattern();
+  const Image &img = sample ? *sample : *pattern;
+  fprintf(log, "Tuning on %dx%d with up to %d threads\n", img.Width(),
+          img.Height(), NumThreads());
+  for (const Benchmark &bench : Benchmarks())
+    Tune(bench, img, log);
+  delete pattern;
+}
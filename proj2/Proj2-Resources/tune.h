@@ -0,0 +1,24 @@
+// tune.h
+//
+// Auto-tuner for the per-operation settings of the worker pool (see
+// TuneScope in parallel.h). Every tunable operation is timed on a sample
+// image: first over a grid of tile sizes (or rows per task) with all
+// threads, then over thread counts with the winning tile. A setting only
+// replaces the current best if it is a few percent faster, so timing noise
+// does not move the defaults.
+
+#ifndef TUNE_INCLUDED
+#define TUNE_INCLUDED
+
+#include "image.h"
+#include <stdio.h>
+
+// Size of the built-in sample image
+const int TUNE_SAMPLE_SIZE = 1024;
+
+// Tunes every operation on sample, or on a built-in pattern of
+// TUNE_SAMPLE_SIZE pixels square when it is NULL, and stores the winners
+// with SetTuneParams. Progress goes to log.
+void AutoTune(const Image *sample, FILE *log);
+
+#endif